@@ -0,0 +1,68 @@
+#!/usr/bin/env ruby
+$:.unshift(File.dirname(__FILE__))
+
+require 'ffi_gen'
+require 'benchmark'
+
+# Invocation: ruby bench.rb <filename> [<iterations>] [<clang args>]
+#
+# Times repeated walks of a header with callbacks that do no work, so the
+# numbers reflect the native side (preprocessing, parsing and conversion).
+# Run it before and after a change to ffi_gen.cpp to compare. FFI_GEN_CACHE_DIR
+# is honoured as in task.rb, and FFI_GEN_BATCH_SIZE turns on batched delivery
+# to compare the number of calls into Ruby. For the full suite over
+# synthetic and system headers, see bench_suite.rb or run `make bench`.
+
+DEFAULT_ARGUMENTS = "-I/usr/lib/llvm-7/lib/clang/7.0.1/include -I/usr/include/x86_64-linux-gnu -include stddef.h -include stdio.h".split(" ").freeze
+
+class NullCallbacks
+  attr_reader :count
+
+  def initialize
+    @count = 0
+  end
+
+  def define_macro(*)
+    @count += 1
+  end
+
+  alias define_typedef define_macro
+  alias define_function define_macro
+  alias define_enum define_macro
+  alias define_struct define_macro
+  alias define_union define_macro
+  alias define_variable define_macro
+  alias declare_forward define_macro
+end
+
+# bench_suite.rb reuses the callbacks above
+if __FILE__ == $0
+  default_arguments = DEFAULT_ARGUMENTS.dup
+  file_name, iterations, *args = ARGV
+  iterations = (iterations || 10).to_i
+
+  default_arguments.concat args
+
+  options = { cache_dir: ENV['FFI_GEN_CACHE_DIR'], batch_size: ENV['FFI_GEN_BATCH_SIZE'].to_i }
+  stats = nil
+  times = (1..iterations).map do
+    cb = NullCallbacks.new
+    t = Benchmark.realtime { stats = FFIGen.inspect_file(file_name, [file_name], default_arguments.dup, cb, **options) }
+    [t, cb.count]
+  end
+
+  walls = times.map(&:first)
+  puts format("%s: %d walks, %d declarations per walk", file_name, iterations, times.last.last)
+  puts format("  min %.2f ms  mean %.2f ms  max %.2f ms",
+              walls.min * 1000, walls.sum / walls.size * 1000, walls.max * 1000)
+  puts format("  %d type lookups, %d type nodes, %d arena bytes",
+              stats[:type_lookups], stats[:type_nodes], stats[:arena_bytes])
+  puts format("  %d calls into Ruby", stats[:callbacks])
+  puts format("  %d declarations visited, %d pruned, %d filtered, %d repeated, %d conflicting, %d emitted; " \
+              "%d of %d macros emitted; %d string bytes",
+              stats[:decls_visited], stats[:decls_pruned], stats[:decls_filtered], stats[:decls_repeated],
+              stats[:decls_conflict], stats[:decls_emitted],
+              stats[:macros_emitted], stats[:macros_seen], stats[:string_bytes])
+  puts format("  last walk: read %.2f  setup %.2f  parse %.2f  macros %.2f  traverse %.2f  convert %.2f  callbacks %.2f ms",
+              *%i[read_ns setup_ns parse_ns macros_ns traverse_ns convert_ns callback_ns].map { |k| stats[k] / 1e6 })
+end
@@ -0,0 +1,95 @@
+# frozen_string_literal: true
+
+require 'fileutils'
+
+# Writes synthetic headers that stress one part of the walk each, at a
+# controlled scale. Every header is plain C that only needs <stdint.h>.
+module BenchHeaders
+  # Returns [[case name, path], ...] for every header written to dir
+  def self.write(dir)
+    FileUtils.mkdir_p(dir)
+
+    cases = {
+      'functions_1k' => functions(1_000),
+      'functions_10k' => functions(10_000),
+      'functions_100k' => functions(100_000),
+      'nested_records' => nested_records(200, 32),
+      'typedef_chains' => typedef_chains(100, 200),
+      'large_enums' => large_enums(20, 1_000),
+      'macro_table' => macro_table(20_000)
+    }
+
+    cases.map do |name, body|
+      path = File.join(dir, "#{name}.h")
+      File.write(path, "#include <stdint.h>\n\n#{body}")
+      [name, path]
+    end
+  end
+
+  # Functions over a handful of shared record and pointer types, as in a
+  # typical library header
+  def self.functions(n)
+    out = +''
+
+    16.times do |s|
+      out << "struct rec#{s} { int32_t a; uint64_t b; struct rec#{s} *next; char name[16]; };\n"
+    end
+
+    n.times do |i|
+      s = i % 16
+      out << "int32_t fn#{i}(struct rec#{s} *r, const char *key, uint32_t flags, double scale);\n"
+    end
+
+    out
+  end
+
+  # Records whose members are anonymous records, depth levels deep
+  def self.nested_records(n, depth)
+    out = +''
+
+    n.times do |i|
+      out << "struct nest#{i} {\n"
+      depth.times { |d| out << "#{'  ' * d}  #{d.even? ? 'struct' : 'union'} {\n#{'  ' * d}    int32_t v#{d};\n" }
+      depth.times.reverse_each { |d| out << "#{'  ' * d}  };\n" }
+      out << "};\n"
+    end
+
+    out
+  end
+
+  # Typedefs of typedefs, each chain ending in a function using its last link
+  def self.typedef_chains(n, length)
+    out = +''
+
+    n.times do |c|
+      out << "typedef uint32_t chain#{c}_0;\n"
+      (1...length).each { |l| out << "typedef chain#{c}_#{l - 1} chain#{c}_#{l};\n" }
+      out << "chain#{c}_#{length - 1} use_chain#{c}(chain#{c}_#{length / 2} v);\n"
+    end
+
+    out
+  end
+
+  def self.large_enums(n, members)
+    out = +''
+
+    n.times do |e|
+      out << "enum big#{e} {\n"
+      members.times { |m| out << "  BIG#{e}_#{m} = #{m * 3},\n" }
+      out << "};\n"
+    end
+
+    out
+  end
+
+  # A register map: every address derived from a block base, which derives
+  # from a shared base
+  def self.macro_table(n)
+    out = +"#define PERIPH_BASE 0x40000000UL\n"
+
+    (n / 64).times { |b| out << "#define BLOCK#{b}_BASE (PERIPH_BASE + 0x#{(b * 0x1000).to_s(16)}UL)\n" }
+    n.times { |r| out << "#define REG#{r} (BLOCK#{r / 64}_BASE + 0x#{((r % 64) * 4).to_s(16)})\n" }
+
+    out
+  end
+end
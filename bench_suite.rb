@@ -0,0 +1,132 @@
+#!/usr/bin/env ruby
+$:.unshift(File.dirname(__FILE__))
+
+require 'ffi_gen'
+require 'generator'
+require 'bench'
+require 'bench_headers'
+require 'benchmark'
+require 'json'
+require 'time'
+require 'tmpdir'
+
+# Invocation: ruby bench_suite.rb [<iterations>] [<case name pattern>]
+#
+# Walks every synthetic header from bench_headers.rb and a few installed
+# system headers, each in a forked process so peak RSS is per case. For each
+# case it reports the median wall time of
+#
+#   walk:      parse and convert, with callbacks that do no work
+#   generate:  the whole task.rb pipeline, Generator included
+#   cached:    a walk replayed from a warm incremental cache
+#
+# along with peak RSS, the Ruby objects allocated by the generate phase (heap
+# allocations on the native side aren't counted; arena_bytes stands in for
+# them) and the native counters and phase timings of the last walk from
+# FFIGenStats. One JSON object per case is appended to BENCH_OUTPUT
+# (bench_results.jsonl by default) for regression tracking.
+
+CORPORA = {
+  'stdio' => '/usr/include/stdio.h',
+  'pthread' => '/usr/include/pthread.h',
+  'uapi_input' => '/usr/include/linux/input.h',
+  'uapi_videodev2' => '/usr/include/linux/videodev2.h'
+}.freeze
+
+def median(values)
+  sorted = values.sort
+  (sorted[(sorted.size - 1) / 2] + sorted[sorted.size / 2]) / 2.0
+end
+
+def peak_rss_kb
+  File.read('/proc/self/status')[/^VmHWM:\s+(\d+)/, 1].to_i
+end
+
+def measure(name, path, iterations)
+  args = DEFAULT_ARGUMENTS.dup
+  stats = nil
+
+  walk = (1..iterations).map do
+    Benchmark.realtime { stats = FFIGen.inspect_file(path, [path], args.dup, NullCallbacks.new) }
+  end
+
+  allocated = 0
+  generate = (1..iterations).map do
+    before = GC.stat(:total_allocated_objects)
+    t = Benchmark.realtime do
+      g = Generator.new('Bench')
+      FFIGen.inspect_file(path, [path], args.dup, g)
+      g.parsed
+    end
+    allocated = GC.stat(:total_allocated_objects) - before
+    t
+  end
+
+  cached = Dir.mktmpdir do |dir|
+    FFIGen.inspect_file(path, [path], args.dup, NullCallbacks.new, cache_dir: dir, incremental: true)
+    (1..iterations).map do
+      Benchmark.realtime { FFIGen.inspect_file(path, [path], args.dup, NullCallbacks.new, cache_dir: dir, incremental: true) }
+    end
+  end
+
+  {
+    name: name,
+    header: path,
+    iterations: iterations,
+    walk_ms: median(walk) * 1000,
+    generate_ms: median(generate) * 1000,
+    cached_ms: median(cached) * 1000,
+    peak_rss_kb: peak_rss_kb,
+    ruby_allocations: allocated
+  }.merge(stats)
+end
+
+# Runs a case in a child process and returns its results
+def run_case(name, path, iterations)
+  reader, writer = IO.pipe
+
+  pid = fork do
+    reader.close
+    writer.write(JSON.generate(measure(name, path, iterations)))
+    writer.close
+    exit!(0)
+  end
+
+  writer.close
+  result = reader.read
+  reader.close
+  Process.wait(pid)
+
+  result.empty? ? nil : JSON.parse(result, symbolize_names: true)
+end
+
+if __FILE__ == $0
+  iterations = (ARGV[0] || 5).to_i
+  pattern = Regexp.new(ARGV[1] || '')
+  output = ENV['BENCH_OUTPUT'] || 'bench_results.jsonl'
+  commit = `git rev-parse --short HEAD 2>/dev/null`.strip
+
+  cases = BenchHeaders.write(File.join(Dir.tmpdir, 'ffi_gen_bench'))
+  cases += CORPORA.select { |_, path| File.exist?(path) }.to_a
+
+  puts format('%-16s %10s %12s %10s %10s %12s %10s',
+              'case', 'walk ms', 'generate ms', 'cached ms', 'rss KB', 'ruby objects', 'types')
+
+  File.open(output, 'a') do |out|
+    cases.each do |name, path|
+      next unless name =~ pattern
+
+      r = run_case(name, path, iterations)
+
+      if r.nil?
+        puts format('%-16s failed', name)
+        next
+      end
+
+      out.puts JSON.generate(r.merge(commit: commit, time: Time.now.utc.iso8601))
+      puts format('%-16s %10.1f %12.1f %10.1f %10d %12d %10d',
+                  name, r[:walk_ms], r[:generate_ms], r[:cached_ms],
+                  r[:peak_rss_kb], r[:ruby_allocations], r[:type_nodes])
+    end
+  end
+end
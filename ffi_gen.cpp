@@ -2,604 +2,5159 @@
 #include "clang/AST/AST.h"
 #include "clang/AST/ASTContext.h"
 #include "clang/AST/ASTConsumer.h"
+#include "clang/AST/RecordLayout.h"
 #include "clang/AST/RecursiveASTVisitor.h"
 #include "clang/Frontend/ASTConsumers.h"
 #include "clang/Frontend/FrontendActions.h"
 #include "clang/Frontend/CompilerInstance.h"
+#include "clang/Index/USRGeneration.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Tooling.h"
 #include "clang/Rewrite/Core/Rewriter.h"
+#include "clang/Basic/OperatorPrecedence.h"
+#include "clang/Basic/Version.h"
+#include "clang/Basic/VirtualFileSystem.h"
+#include "clang/Lex/LiteralSupport.h"
+#include "llvm/ADT/APSInt.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Chrono.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/GlobPattern.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Regex.h"
 
 #include <iostream>
 #include <fstream>
-#include <streambuf>
+#include <sstream>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
 
 #include "ffi_gen.h"
+#include "ffi_gen_snapshot.h"
 
 using namespace clang;
 using namespace clang::driver;
 using namespace clang::tooling;
 using namespace llvm;
 
-static FFITypeRef type_for_qual(QualType qt, ASTContext *ctx);
-static void get_types_for_func(FunctionDecl *fd, FFITypeRef &returnTy, std::vector<FFITypeRef> &paramTys, ASTContext *ctx);
+class Recording;
+class TargetMerge;
+class Trace;
+class TypeTable;
+
+// The elements of parameter and member arrays, which are copies, to the type
+// cache node each copies
+typedef DenseMap<const FFITypeRef *, const FFITypeRef *> TypeCopies;
+
+struct ffi_gen_result {
+    llvm::BumpPtrAllocator arena; ///< Owns every type node and string of a walk
+    FFIGenStats stats {};
+    std::vector<std::unique_ptr<ffi_gen_result> > units; ///< Per-file results of walk_files
+    std::vector<std::string> files; ///< Every file the TU read, main file first
+    std::vector<std::pair<int, int> > includes; ///< (includer, included) indices into files
+    std::unique_ptr<Recording> recording; ///< Declarations kept for a cache or snapshot
+    std::unique_ptr<TypeTable> table; ///< Created by the first handle request
+    TypeCopies copies; ///< Filled in as parameter and member arrays are made
+    std::unique_ptr<TargetMerge> merge; ///< How the units of walk_targets, one per target, line up
+    bool complete = true; ///< Cleared when the walk was stopped early
+};
 
-class GetMacros : public PPCallbacks
+// Index of the file or target the calling thread is walking or delivering,
+// the result that owns its types and, for walk_targets, every target the
+// declaration being delivered stands for
+static thread_local int current_unit = -1;
+static thread_local ffi_gen_result *current_result = nullptr;
+static thread_local uint64_t current_targets = 0;
+static thread_local Trace *current_trace = nullptr; // NULL unless the walk is traced
+static thread_local int current_cycle = 0; // of the declaration being delivered
+static thread_local const char *current_file = nullptr; // for progress reports
+
+class TypeCache;
+
+static FFITypeRef type_for_qual(QualType qt, const std::string &qualName, TypeCache &types);
+static FFITypeRef *get_types_for_func(FunctionDecl *fd, FFITypeRef *&paramTys, size_t &numParams, TypeCache &types);
+static FFIRecordLayout get_record_layout(const RecordDecl *rd, ASTContext &ctx, std::vector<FFIFieldLayout> &fields);
+
+static char *arena_strdup(BumpPtrAllocator &arena, StringRef str)
 {
-public:
-    Preprocessor &pp;
-    std::map<std::string, std::vector<Token> > macros;
-    std::vector<std::string> &sources;
+    char *ret = arena.Allocate<char>(str.size() + 1);
 
-    GetMacros(Preprocessor &p, std::vector<std::string> &sources) : pp(p), sources(sources) {}
+    std::copy(str.begin(), str.end(), ret);
+    ret[str.size()] = '\0';
 
-    virtual void MacroDefined(const Token &MacroNameTok, const MacroDirective *MD)
-	{
-        const MacroInfo *i = MD->getMacroInfo();
-        const IdentifierTable &table = pp.getIdentifierTable();
+    return ret;
+}
 
-        // Ignore function-like macros and macros not in the
-        // file we wanted to parse
-	    if (i->isObjectLike() && isInRequestedSourceFiles(i)) {
-	        std::vector<Token> tokens;
+template <typename T>
+static T *arena_copy(BumpPtrAllocator &arena, const std::vector<T> &items)
+{
+    if (items.empty())
+        return nullptr;
 
-	        for (auto &t : i->tokens())
-                tokens.push_back(Token { t });
+    T *ret = arena.Allocate<T>(items.size());
+    std::uninitialized_copy(items.begin(), items.end(), ret);
 
-            // Ignore macros with no tokens
-            if (tokens.size() == 0)
-                return;
+    return ret;
+}
 
-    	    macros[pp.getSpelling(MacroNameTok)] = tokens;
-	    }
-	}
+typedef std::chrono::steady_clock Clock;
 
-    virtual void MacroUndefined(const Token &MacroNameTok, const MacroDefinition &MD, const MacroDirective *Undef)
+static uint64_t elapsed_ns(Clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+// Spans of a walk, written to walk_options.trace_path as Chrome trace-event
+// JSON. The threads of a walk record into one trace, under its lock.
+class Trace
+{
+public:
+    void span(const char *name, StringRef detail, Clock::time_point start, Clock::time_point end)
     {
-        macros.erase(MacroNameTok.getName());
+        std::lock_guard<std::mutex> guard { lock };
+        auto thread = threads.insert(std::make_pair(std::this_thread::get_id(), threads.size()));
+
+        events.push_back(Event { name, detail.str(), thread.first->second, ns(start), ns(end) - ns(start) });
+    }
+
+    bool write(const std::string &path)
+    {
+        std::error_code ec;
+        raw_fd_ostream out { path, ec, sys::fs::F_Text };
+        const char *separator = "\n";
+
+        if (ec)
+            return false;
+
+        std::lock_guard<std::mutex> guard { lock };
+
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+        for (auto &e : events) {
+            out << separator << "{\"name\":\"" << e.name << "\",\"cat\":\"ffi_gen\",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.thread
+                << ",\"ts\":" << format("%.3f", e.start / 1e3) << ",\"dur\":" << format("%.3f", e.duration / 1e3);
+
+            if (!e.detail.empty()) {
+                out << ",\"args\":{\"detail\":";
+                string(out, e.detail);
+                out << "}";
+            }
+
+            out << "}";
+            separator = ",\n";
+        }
+
+        out << "\n]}\n";
+
+        return !out.has_error();
     }
 
 private:
-    bool isInRequestedSourceFiles(const MacroInfo *i)
+    struct Event {
+        const char *name;
+        std::string detail;
+        int thread;
+        uint64_t start; // ns since the trace began
+        uint64_t duration;
+    };
+
+    uint64_t ns(Clock::time_point t) const
     {
-        SourceManager &sm { pp.getSourceManager() };
-        SourceLocation loc = i->getDefinitionLoc();
+        return t < origin ? 0 : std::chrono::duration_cast<std::chrono::nanoseconds>(t - origin).count();
+    }
 
-        for (auto &f : sources)
-            if (sm.getFilename(loc) == f)
-                return true;
+    static void string(raw_ostream &out, StringRef s)
+    {
+        out << '"';
+
+        for (unsigned char c : s) {
+            if (c == '"' || c == '\\')
+                out << '\\' << c;
+            else if (c < 0x20)
+                out << format("\\u%04x", c);
+            else
+                out << c;
+        }
 
-        return false;
+        out << '"';
     }
+
+    std::mutex lock;
+    Clock::time_point origin = Clock::now();
+    std::map<std::thread::id, int> threads; // numbered in order of their first span
+    std::vector<Event> events;
 };
 
-class MacroParseAction : public clang::PreprocessOnlyAction
+// A span of the trace of the walk running on this thread, if it is traced,
+// from construction until it goes out of scope. The detail is only copied
+// when tracing.
+class TraceSpan
 {
 public:
-    MacroParseAction(callbacks &cb, std::vector<std::string> &sources) : cb(cb), sources(sources) {}
+    explicit TraceSpan(const char *name, StringRef detail = StringRef {})
+        : trace(name ? current_trace : nullptr), name(name), start(Clock::now())
+    {
+        if (trace)
+            this->detail = detail.str();
+    }
 
-    virtual void ExecuteAction()
+    ~TraceSpan()
     {
-        Preprocessor &p = getCompilerInstance().getPreprocessor();
+        if (trace)
+            trace->span(name, detail, start, Clock::now());
+    }
 
-        std::unique_ptr<GetMacros> get_macros { new GetMacros { p, sources } };
-        p.addPPCallbacks(std::move(get_macros));
+private:
+    Trace *trace;
+    const char *name;
+    std::string detail;
+    Clock::time_point start;
+};
 
-        clang::PreprocessOnlyAction::ExecuteAction();
+// Adds the time until it goes out of scope to one of the FFIGenStats timings,
+// and with a span name, also records it as a span when tracing
+class PhaseTimer
+{
+public:
+    explicit PhaseTimer(uint64_t &ns, const char *span = nullptr, StringRef detail = StringRef {}) : ns(ns), start(Clock::now()), traced(span, detail) {}
 
-        GetMacros *m = static_cast<GetMacros *>(p.getPPCallbacks());
+    ~PhaseTimer()
+    {
+        ns += elapsed_ns(start);
+    }
 
-        for (auto &m : m->macros) {
-            try {
-                std::vector<Token> tokens = fixMacrosRecursive(p, m.second);
-                std::string tokenPaste;
+private:
+    uint64_t &ns;
+    Clock::time_point start;
+    TraceSpan traced;
+};
 
-                for (auto &t : tokens) {
-                    tokenPaste.append(p.getSpelling(t));
-                    tokenPaste.append(" ");
-                }
+// Counts one call into the callbacks struct, timing it until it goes out of
+// scope
+class CallTimer : public PhaseTimer
+{
+public:
+    explicit CallTimer(FFIGenStats &calls, StringRef name = StringRef {}) : PhaseTimer(calls.callback_ns, "callback", name)
+    {
+        ++calls.callbacks;
+    }
+};
 
-                cb.mc(m.first.c_str(), tokenPaste.c_str(), cb.user_data);
-            } catch (std::invalid_argument &ex) {
-                // do nothing
-            }
-        }
+// Cancellation, the deadline and progress reports of one walk, shared by
+// all of its threads
+class WalkControl
+{
+public:
+    explicit WalkControl(const walk_options &opts)
+        : progress(opts.progress), progressData(opts.progress_data), interval(std::max<size_t>(opts.progress_interval, 1)),
+          deadline(opts.timeout_ms ? Clock::now() + std::chrono::milliseconds(opts.timeout_ms) : Clock::time_point::max())
+    {}
+
+    void cancel()
+    {
+        cancelled = true;
     }
 
-private:
-    std::vector<Token> fixMacrosRecursive(Preprocessor &p, std::vector<Token> input, size_t recursionNum = 0)
+    // Whether to give up on the rest of the walk. Callers skip work when it
+    // returns true, so the walk only counts as interrupted from then on.
+    bool stopped()
     {
-        std::vector<Token> ret;
+        if (!cancelled && deadline != Clock::time_point::max() && Clock::now() >= deadline)
+            cancelled = true;
 
-        for (auto &t : input) {
-            IdentifierInfo *i;
-            MacroInfo *mi;
+        if (cancelled)
+            interrupted = true;
 
-            if (t.getKind() != tok::identifier) {
-                ret.push_back(t);
-                continue;
-            }
+        return cancelled;
+    }
 
-            i  = t.getIdentifierInfo();
-            mi = p.getMacroInfo(i);
+    bool wasInterrupted() const
+    {
+        return interrupted;
+    }
 
-            if (!mi || recursionNum > 5) {
-                ret.push_back(t);
-                continue;
-            }
+    void startFile(int unit, const std::string &filename)
+    {
+        current_file = filename.c_str();
+        file = unit;
+        report(decls);
+    }
 
-            if (!mi->isObjectLike()) {
-                // need to propagate up to the root in order to not emit this
-                // macro
-                throw std::invalid_argument { "Macro child is not object-like" };
-            }
+    // Counts n more declarations processed on this thread
+    void done(size_t n)
+    {
+        size_t before = decls.fetch_add(n);
 
-            std::vector<Token> childTokens;
+        if (before / interval != (before + n) / interval)
+            report(before + n);
+    }
 
-            for (auto &k : mi->tokens())
-                childTokens.push_back(k);
+    size_t processed() const
+    {
+        return decls;
+    }
 
-            childTokens = fixMacrosRecursive(p, childTokens, recursionNum + 1);
+    int currentFile() const
+    {
+        return file;
+    }
 
-            for (auto &k : childTokens)
-                ret.push_back(k);
-        }
+private:
+    void report(size_t n)
+    {
+        if (!progress)
+            return;
 
-        return ret;
+        std::lock_guard<std::mutex> guard { lock };
+        progress(n, current_file, progressData);
     }
 
-    callbacks &cb;
-    std::vector<std::string> &sources;
+    progress_callback progress;
+    void *progressData;
+    size_t interval;
+    Clock::time_point deadline;
+    std::atomic<bool> cancelled { false };
+    std::atomic<bool> interrupted { false };
+    std::atomic<size_t> decls { 0 };
+    std::atomic<int> file { -1 };
+    std::mutex lock; // progress is called by one thread at a time
 };
 
-class FFIGenVisitor : public RecursiveASTVisitor<FFIGenVisitor>
+// Per-TU table of converted types. Each distinct type is converted once and
+// its node shared by every user, so the graph handed out is a DAG.
+class TypeCache
 {
 public:
-    explicit FFIGenVisitor(ASTContext *Context, callbacks &cb, std::vector<std::string> &sources)
-        : Context(Context), cb(cb), sources(sources) {}
+    TypeCache(ASTContext *ctx, ffi_gen_result &result) : ctx(ctx), arena(result.arena), stats(result.stats), copies(result.copies) {}
 
-    bool isInRequestedSourceFiles(SourceLocation l)
+    FFITypeRef *get(QualType qt)
     {
-        clang::SourceManager &sm { Context->getSourceManager() };
+        ++stats.type_lookups;
 
-        l = sm.getExpansionLoc(l);
+        // Conversions recurse; only the outermost lookup is timed
+        if (depth > 0)
+            return lookup(qt);
 
-        for (auto &f : sources)
-            if (sm.getFilename(l) == f)
-                return true;
+        PhaseTimer timer { stats.convert_ns, "convert" };
 
-        return false;
+        ++depth;
+        FFITypeRef *ret = lookup(qt);
+        --depth;
+
+        return ret;
     }
 
-    virtual bool VisitFunctionDecl(FunctionDecl *func)
+    char *copyString(StringRef str)
     {
-        if (!isInRequestedSourceFiles(func->getLocStart()))
-            return true;
-
-        FFITypeRef returnTy;
-        std::string funcName = func->getNameInfo().getName().getAsString();
-        std::vector<FFITypeRef> paramTys;
-
-        get_types_for_func(func, returnTy, paramTys, Context);
-
-        cb.fc(funcName.c_str(), &returnTy, &paramTys[0], paramTys.size(), cb.user_data);
-
-        return true;
+        stats.string_bytes += str.size() + 1;
+        return arena_strdup(arena, str);
     }
 
-    virtual bool VisitVarDecl(VarDecl *vd)
+    // Parameters and members are handed out as arrays of values rather than
+    // of nodes, so each element remembers the node it copies. A copy of a
+    // record not defined yet is completed along with the node.
+    FFITypeRef *array(const std::vector<FFITypeRef *> &nodes)
     {
-        if (!isInRequestedSourceFiles(vd->getLocStart()))
-            return true;
+        if (nodes.empty())
+            return nullptr;
 
-        // Don't try to do binding for non-exported variables
-        if (!vd->isExternC())
-            return true;
+        FFITypeRef *ret = arena.Allocate<FFITypeRef>(nodes.size());
 
-        std::string name = vd->getNameAsString();
-        FFITypeRef varTy = type_for_qual(vd->getType(), Context);
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            ret[i] = *nodes[i];
+            copies[&ret[i]] = nodes[i];
 
-        cb.vc(name.c_str(), &varTy, cb.user_data);
+            auto decl = incompleteNodes.find(nodes[i]);
+            if (decl != incompleteNodes.end())
+                incomplete[decl->second].push_back(&ret[i]);
+        }
 
-        return true;
+        return ret;
     }
 
-    virtual bool VisitEnumDecl(EnumDecl *ed)
+    // Fills in a record that was converted while it was only declared, which
+    // happens when declarations are streamed. The nodes and their copies are
+    // updated in place, so every type and declaration already reported with
+    // them sees the definition.
+    void completed(const RecordDecl *rd)
     {
-        // Don't visit forward declarations
-        if (!ed->isThisDeclarationADefinition())
-            return true;
+        auto i = incomplete.find(rd->getCanonicalDecl());
 
-        ed = ed->getCanonicalDecl();
+        if (i == incomplete.end())
+            return;
 
-        if (!isInRequestedSourceFiles(ed->getLocStart()))
-            return true;
+        // Members and their positions are only listed for anonymous records,
+        // which are always complete where they are used
+        std::vector<FFIFieldLayout> fields;
+        FFIRecordLayout layout = get_record_layout(rd, *ctx, fields);
 
-        // Don't try to do binding for non-exported enums
-        if (!ed->hasNameForLinkage())
-            return true;
+        layout.fields = nullptr;
 
+        for (FFITypeRef *node : i->second) {
+            if (node->type == FFIRefType::UNION_REF) {
+                node->union_type.defined = 1;
+                node->union_type.layout = layout;
+            } else {
+                node->struct_type.defined = 1;
+                node->struct_type.layout = layout;
+            }
 
-        std::string name = ed->getNameAsString();
-        if (name.size() == 0)
-            name = ed->getTypedefNameForAnonDecl()->getUnderlyingType().getAsString();
+            incompleteNodes.erase(node);
+        }
 
-        std::vector<std::string> memberNameStrings;
-        std::vector<const char *> memberNames;
-        std::vector<int64_t> memberValues;
+        incomplete.erase(i);
+    }
 
-        for (auto d : ed->enumerators()) {
-            std::string memberName = d->getNameAsString();
+    ASTContext *ctx;
+    BumpPtrAllocator &arena;
 
-            memberNameStrings.push_back(memberName);
-            memberValues.push_back(d->getInitVal().getExtValue());
+private:
+    FFITypeRef *lookup(QualType qt)
+    {
+        // Fast path: this exact sugared type was seen before
+        auto sugared = bySugaredType.find(qt.getAsOpaquePtr());
+        if (sugared != bySugaredType.end())
+            return sugared->second;
+
+        // Different sugar can still print the same, so fall back to the
+        // canonical type plus the spelling consumers will see
+        std::string qualName = qt.getAsString();
+        auto key = std::make_pair(qt.getCanonicalType().getAsOpaquePtr(), qualName);
+        FFITypeRef *&node = byCanonicalType[key];
+
+        if (!node) {
+            FFITypeRef *ret = new (arena.Allocate<FFITypeRef>()) FFITypeRef;
+
+            node = ret;
+            *ret = type_for_qual(qt, qualName, *this);
+            ++stats.type_nodes;
+
+            if ((ret->type == FFIRefType::STRUCT_REF && !ret->struct_type.defined)
+                || (ret->type == FFIRefType::UNION_REF && !ret->union_type.defined)) {
+                const RecordDecl *rd = qt->getAsRecordDecl()->getCanonicalDecl();
+
+                incomplete[rd].push_back(ret);
+                incompleteNodes[ret] = rd;
+            }
         }
 
-        for (auto &s : memberNameStrings)
-            memberNames.push_back(s.c_str());
+        bySugaredType[qt.getAsOpaquePtr()] = node;
 
-        cb.ec(name.c_str(), &memberNames[0], &memberValues[0], memberValues.size(), cb.user_data);
+        return node;
+    }
 
-        return true;
+    FFIGenStats &stats;
+    TypeCopies &copies;
+    unsigned depth = 0;
+    DenseMap<void *, FFITypeRef *> bySugaredType;
+    std::map<std::pair<void *, std::string>, FFITypeRef *> byCanonicalType;
+    DenseMap<const RecordDecl *, std::vector<FFITypeRef *> > incomplete; ///< Nodes of records not defined yet and their copies, by canonical declaration
+    DenseMap<const FFITypeRef *, const RecordDecl *> incompleteNodes; ///< The nodes only, to their canonical declaration
+};
+
+// Decides whether a location is in one of the requested source files. Each
+// FileID is resolved by name once, so later lookups are a single hash probe
+// however many sources were requested.
+class SourceFilter
+{
+public:
+    SourceFilter(SourceManager &sm, const std::vector<std::string> &sources) : sm(sm)
+    {
+        for (auto &f : sources)
+            names.insert(f);
     }
 
-    virtual bool VisitTypedefDecl(TypedefDecl *td)
+    bool contains(SourceLocation l)
     {
-        if (!isInRequestedSourceFiles(td->getLocStart()))
-            return true;
+        FileID id = sm.getFileID(sm.getExpansionLoc(l));
+        auto i = requested.find(id);
 
-        std::string aliasName = td->getNameAsString();
-        FFITypeRef type = type_for_qual(td->getUnderlyingType(), Context);
+        if (i != requested.end())
+            return i->second;
 
-        cb.tc(aliasName.c_str(), &type, cb.user_data);
+        const FileEntry *fe = sm.getFileEntryForID(id);
+        bool in = names.count(fe ? fe->getName() : StringRef {}) != 0;
 
-        return true;
+        requested[id] = in;
+        return in;
     }
 
-    virtual bool VisitRecordDecl(RecordDecl *rd)
-    {
-        // Don't visit forward declarations
-        if (!rd->isThisDeclarationADefinition())
-            return tag_forward_decl(rd);
+private:
+    SourceManager &sm;
+    StringSet<> names;
+    DenseMap<FileID, bool> requested;
+};
 
-        rd = rd->getDefinition();
+// The symbol patterns and roots of walk_options, compiled once per walk.
+// It is only read after construction, so every thread of a walk shares one.
+class SymbolFilter
+{
+public:
+    explicit SymbolFilter(const walk_options &opts)
+    {
+        add(opts.include_symbols, opts.num_include_symbols, '+', include);
+        add(opts.exclude_symbols, opts.num_exclude_symbols, '-', exclude);
 
-        if (!rd || !isInRequestedSourceFiles(rd->getLocStart()))
-            return true;
+        for (size_t i = 0; i < opts.num_root_symbols; ++i) {
+            roots.insert(opts.root_symbols[i]);
+            key.push_back('*' + std::string { opts.root_symbols[i] });
+        }
 
-        // Don't try to do binding for non-exported structs/unions
-        if (!rd->hasNameForLinkage())
-            return true;
+        for (auto &p : include) {
+            for (int k = MACRO_DECL; k <= FORWARD_DECL; ++k)
+                restricted[k] = restricted[k] || p->kind < 0 || p->kind == k;
+        }
+    }
 
-        bool defined = rd->getDefinition() != NULL;
+    bool wants(FFIDeclKind kind, StringRef name) const
+    {
+        if (restricted[kind] && !matches(include, kind, name))
+            return false;
 
-        std::string name = rd->getNameAsString();
-        if (name.size() == 0)
-            name = rd->getTypedefNameForAnonDecl()->getUnderlyingType().getAsString();
+        return !matches(exclude, kind, name);
+    }
 
-        std::vector<std::string> memberNameStrings;
-        std::vector<const char *> memberNames;
-        std::vector<FFITypeRef> memberTypes;
+    bool hasRoots() const
+    {
+        return !roots.empty();
+    }
 
-        for (auto f : rd->fields()) {
-            std::string memberName = f->getNameAsString();
+    bool isRoot(StringRef name) const
+    {
+        return roots.count(name) != 0;
+    }
 
-            memberTypes.push_back(type_for_qual(f->getType(), Context));
-            memberNameStrings.push_back(memberName);
+    // Every pattern and root as given, for keying cached walks
+    void hash(MD5 &md5) const
+    {
+        for (auto &k : key) {
+            md5.update(k);
+            md5.update(StringRef { "\0", 1 });
         }
+    }
 
-        for (auto &s : memberNameStrings)
-            memberNames.push_back(s.c_str());
-
-        if (rd->isUnion()) {
-            cb.uc(name.c_str(), &memberTypes[0], &memberNames[0], memberTypes.size(), defined, cb.user_data);
-        } else {
-            cb.sc(name.c_str(), &memberTypes[0], &memberNames[0], memberTypes.size(), defined, cb.user_data);
+private:
+    struct Pattern
+    {
+        int kind = -1; // any kind
+        std::string text; // the glob refers into this
+        Optional<GlobPattern> glob;
+        std::unique_ptr<Regex> regex;
+
+        bool matches(StringRef name) const
+        {
+            return glob ? glob->match(name) : regex && regex->match(name);
         }
+    };
 
-        return true;
-    }
+    typedef std::vector<std::unique_ptr<Pattern> > Patterns;
 
-private:
-    bool tag_forward_decl(TagDecl *td)
+    void add(const char **specs, size_t n, char sign, Patterns &list)
     {
-        // Don't try to do binding for non-exported names
-        if (!td->hasNameForLinkage())
-            return true;
+        static const char *const kinds[] = { "macro", "typedef", "function", "enum", "struct", "union", "variable", "forward" };
+
+        for (size_t i = 0; i < n; ++i) {
+            std::unique_ptr<Pattern> p { new Pattern };
+            StringRef spec = specs[i];
+            size_t colon = spec.find(':');
+
+            for (int k = MACRO_DECL; colon != StringRef::npos && k <= FORWARD_DECL; ++k) {
+                if (spec.substr(0, colon) == kinds[k]) {
+                    p->kind = k;
+                    spec = spec.substr(colon + 1);
+                    break;
+                }
+            }
 
-        if (!isInRequestedSourceFiles(td->getLocStart()))
-            return true;
+            p->text = spec.str();
 
-        std::string name = td->getNameAsString();
-        if (name.size() == 0)
-            name = td->getTypedefNameForAnonDecl()->getUnderlyingType().getAsString();
+            // A pattern that doesn't compile is reported and matches nothing
+            if (spec.size() >= 2 && spec.front() == '/' && spec.back() == '/') {
+                std::string error;
 
-        FFIForwardType t;
+                p->regex.reset(new Regex { "^(" + spec.slice(1, spec.size() - 1).str() + ")$" });
 
-        if (td->isUnion())
-            t = FFIForwardType::UNION;
-        else
-            t = FFIForwardType::STRUCT;
+                if (!p->regex->isValid(error)) {
+                    fprintf(stderr, "ffi_gen: bad symbol pattern %s: %s\n", specs[i], error.c_str());
+                    p->regex.reset();
+                }
+            } else {
+                Expected<GlobPattern> glob = GlobPattern::create(p->text);
 
-        cb.fdc(name.c_str(), t, cb.user_data);
+                if (glob)
+                    p->glob = std::move(*glob);
+                else
+                    fprintf(stderr, "ffi_gen: bad symbol pattern %s: %s\n", specs[i], toString(glob.takeError()).c_str());
+            }
 
-        return true;
+            key.push_back(sign + std::string { specs[i] });
+            list.push_back(std::move(p));
+        }
     }
 
-    ASTContext *Context;
-    callbacks &cb;
-    std::vector<std::string> &sources;
-};
+    static bool matches(const Patterns &patterns, FFIDeclKind kind, StringRef name)
+    {
+        for (auto &p : patterns) {
+            if ((p->kind < 0 || p->kind == kind) && p->matches(name))
+                return true;
+        }
 
+        return false;
+    }
 
-class FFIParseConsumer : public clang::ASTConsumer
+    Patterns include;
+    Patterns exclude;
+    bool restricted[FORWARD_DECL + 1] = {}; // kinds that some include pattern applies to
+    StringSet<> roots;
+    std::vector<std::string> key;
+};
+
+// The declarations of a TU that the root symbols depend on. Types are
+// followed through sugar, pointers, arrays and function types to the
+// typedefs, records and enums they name, and from those on through
+// underlying types and fields.
+class Reachable
 {
 public:
-    explicit FFIParseConsumer(ASTContext *Context, callbacks &cb, std::vector<std::string> &sources) : Visitor(Context, cb, sources)
-    {}
+    explicit Reachable(const SymbolFilter &symbols) : symbols(symbols) {}
 
-    virtual void HandleTranslationUnit(clang::ASTContext &Context)
+    void compute(ASTContext &ctx)
     {
-        Visitor.TraverseDecl(Context.getTranslationUnitDecl());
-    }
+        if (!symbols.hasRoots())
+            return;
 
-private:
-    FFIGenVisitor Visitor;
-};
+        findRoots(ctx.getTranslationUnitDecl());
 
-class FFIParseAction : public clang::ASTFrontendAction {
-public:
-    FFIParseAction(callbacks &cb, std::vector<std::string> &sources) : cb(cb), sources(sources) {}
+        while (!pending.empty()) {
+            const Decl *d = pending.back();
 
-    virtual std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(clang::CompilerInstance &Compiler, llvm::StringRef InFile)
+            pending.pop_back();
+
+            if (auto vd = dyn_cast<ValueDecl>(d)) {
+                reachType(vd->getType(), ctx);
+            } else if (auto td = dyn_cast<TypedefNameDecl>(d)) {
+                reachType(td->getUnderlyingType(), ctx);
+            } else if (auto rd = dyn_cast<RecordDecl>(d)) {
+                if ((rd = rd->getDefinition())) {
+                    for (auto f : rd->fields())
+                        reachType(f->getType(), ctx);
+                }
+            }
+        }
+    }
+
+    // Everything is reachable when there are no roots
+    bool contains(const Decl *d) const
     {
-        return std::unique_ptr<clang::ASTConsumer> { new FFIParseConsumer { &Compiler.getASTContext(), cb, sources } };
+        return !symbols.hasRoots() || decls.count(d->getCanonicalDecl()) != 0;
     }
 
 private:
-    callbacks &cb;
-    std::vector<std::string> &sources;
+    // Roots are looked for among the top-level declarations, linkage specs
+    // included, and the enumerators of top-level enums
+    void findRoots(const DeclContext *dc)
+    {
+        for (auto d : dc->decls()) {
+            if (auto ls = dyn_cast<LinkageSpecDecl>(d)) {
+                findRoots(ls);
+                continue;
+            }
+
+            auto nd = dyn_cast<NamedDecl>(d);
+
+            if (!nd)
+                continue;
+
+            if (nd->getIdentifier() && symbols.isRoot(nd->getName()))
+                reach(nd);
+
+            if (auto ed = dyn_cast<EnumDecl>(nd)) {
+                for (auto e : ed->enumerators()) {
+                    if (symbols.isRoot(e->getName()))
+                        reach(ed);
+                }
+            }
+        }
+    }
+
+    void reach(const Decl *d)
+    {
+        if (decls.insert(d->getCanonicalDecl()).second)
+            pending.push_back(d);
+    }
+
+    void reachType(QualType qt, ASTContext &ctx)
+    {
+        while (!qt.isNull()) {
+            const Type *t = qt.getTypePtr();
+
+            if (auto tt = dyn_cast<TypedefType>(t)) {
+                reach(tt->getDecl());
+                return;
+            } else if (auto tt = dyn_cast<TagType>(t)) {
+                reach(tt->getDecl());
+                return;
+            } else if (auto pt = dyn_cast<PointerType>(t)) {
+                qt = pt->getPointeeType();
+            } else if (auto at = dyn_cast<ArrayType>(t)) {
+                qt = at->getElementType();
+            } else if (auto ft = dyn_cast<FunctionType>(t)) {
+                if (auto fpt = dyn_cast<FunctionProtoType>(ft)) {
+                    for (auto p : fpt->getParamTypes())
+                        reachType(p, ctx);
+                }
+
+                qt = ft->getReturnType();
+            } else {
+                QualType next = qt.getSingleStepDesugaredType(ctx);
+
+                if (next == qt)
+                    return;
+
+                qt = next;
+            }
+        }
+    }
+
+    const SymbolFilter &symbols;
+    DenseSet<const Decl *> decls; // canonical declarations
+    std::vector<const Decl *> pending;
+};
+
+// Entities reported by the walks sharing an index, keyed by kind and USR,
+// with a digest of what was reported to tell conflicting redeclarations from
+// repeats
+struct ffi_gen_index {
+    enum Claim { FIRST, REPEATED, CONFLICT };
+
+    virtual ~ffi_gen_index() {}
+
+    virtual Claim claim(FFIDeclKind kind, StringRef usr, StringRef signature)
+    {
+        MD5 md5;
+        MD5::MD5Result digest;
+        SmallString<128> key;
+
+        md5.update(signature);
+        md5.final(digest);
+        key.push_back('0' + kind);
+        key.append(usr);
+
+        std::lock_guard<std::mutex> guard { lock };
+        auto i = reported.insert(std::make_pair(key.str(), digest));
+
+        if (i.second)
+            return FIRST;
+
+        return i.first->second == digest ? REPEATED : CONFLICT;
+    }
+
+    std::mutex lock;
+    StringMap<MD5::MD5Result> reported;
+};
+
+// What a declaration reports, in canonical types, for comparing
+// redeclarations across TUs
+static std::string type_signature(QualType qt)
+{
+    return qt.getCanonicalType().getAsString();
+}
+
+static std::string record_signature(const RecordDecl *rd)
+{
+    std::string ret;
+
+    for (auto f : rd->fields())
+        ret += f->getNameAsString() + ":" + f->getType().getCanonicalType().getAsString() + ";";
+
+    return ret;
+}
+
+static std::string enum_signature(const EnumDecl *ed)
+{
+    std::string ret;
+
+    for (auto e : ed->enumerators())
+        ret += e->getNameAsString() + "=" + e->getInitVal().toString(10) + ";";
+
+    return ret;
+}
+
+// Evaluates the expanded tokens of an object-like macro as a C constant
+// expression. Literals are decoded by clang's own literal parsers, operator
+// precedence is clang's, and integer widths come from the target, so the
+// value is the one the compiler would compute for the same expression.
+// Enumerators and sizeof/_Alignof of a type name are resolved against the
+// AST. Anything else, and any operation the compiler would not define such
+// as signed overflow, leaves the macro unfolded rather than guessed; an
+// operand that &&, || or ?: skips is only type-checked, as in C.
+class MacroFolder
+{
+public:
+    struct Value {
+        FFIMacroValueType type = MACRO_NONE;
+        APSInt integer;
+        double floating = 0;
+        std::string string;
+    };
+
+    MacroFolder(Preprocessor &pp, ASTContext &ctx, const std::vector<Token> &tokens)
+        : pp(pp), ctx(ctx), tokens(tokens), intWidth(ctx.getTypeSize(ctx.IntTy)) {}
+
+    bool fold(Value &v)
+    {
+        return conditional(v) && pos == tokens.size();
+    }
+
+private:
+    bool at(tok::TokenKind k)
+    {
+        return pos < tokens.size() && tokens[pos].is(k);
+    }
+
+    bool conditional(Value &v)
+    {
+        Value t, f;
+
+        if (!binary(v, prec::LogicalOr))
+            return false;
+
+        if (!at(tok::question))
+            return true;
+
+        ++pos;
+
+        bool cond;
+
+        if (!truth(v, cond) || !skipped(!cond, t) || !at(tok::colon))
+            return false;
+
+        ++pos;
+
+        if (!skipped(cond, f))
+            return false;
+
+        if (t.type == MACRO_STRING || f.type == MACRO_STRING) {
+            if (t.type != f.type)
+                return false;
+        } else if (!arithmetic(t, f)) {
+            return false;
+        }
+
+        v = cond ? t : f;
+        return true;
+    }
+
+    // Precedence climbing over clang's binary operator table
+    bool binary(Value &v, prec::Level minPrec)
+    {
+        if (!unary(v))
+            return false;
+
+        while (pos < tokens.size()) {
+            tok::TokenKind op = tokens[pos].getKind();
+            prec::Level p = getBinOpPrecedence(op, true, false);
+            Value rhs;
+
+            if (p < minPrec || p <= prec::Conditional)
+                break;
+
+            ++pos;
+
+            // The right operand of && and || is not evaluated once the left
+            // one decides the result
+            bool skip = false;
+
+            if (op == tok::ampamp || op == tok::pipepipe) {
+                bool t;
+
+                if (!truth(v, t))
+                    return false;
+
+                skip = op == tok::ampamp ? !t : t;
+            }
+
+            unevaluated += skip;
+            bool parsed = binary(rhs, static_cast<prec::Level>(p + 1));
+            unevaluated -= skip;
+
+            if (!parsed || !apply(op, v, rhs))
+                return false;
+        }
+
+        return true;
+    }
+
+    // Parses one arm of ?:, evaluated unless skip
+    bool skipped(bool skip, Value &v)
+    {
+        unevaluated += skip;
+        bool parsed = conditional(v);
+        unevaluated -= skip;
+
+        return parsed;
+    }
+
+    // An operation whose result C leaves undefined. Folding fails, unless the
+    // operand is never evaluated, where only its type matters.
+    bool undefined(Value &v)
+    {
+        if (!unevaluated)
+            return false;
+
+        v.integer = 0;
+        return true;
+    }
+
+    bool unary(Value &v)
+    {
+        if (pos >= tokens.size())
+            return false;
+
+        tok::TokenKind op = tokens[pos].getKind();
+
+        if (op == tok::kw_sizeof || op == tok::kw_alignof || op == tok::kw__Alignof)
+            return measure(v);
+
+        if (op != tok::plus && op != tok::minus && op != tok::tilde && op != tok::exclaim)
+            return primary(v);
+
+        ++pos;
+
+        if (!unary(v) || v.type == MACRO_STRING)
+            return false;
+
+        if (op == tok::exclaim) {
+            bool t;
+
+            truth(v, t);
+            v = integer(!t);
+            return true;
+        }
+
+        if (v.type == MACRO_FLOAT) {
+            if (op == tok::tilde)
+                return false;
+
+            if (op == tok::minus)
+                v.floating = -v.floating;
+
+            return true;
+        }
+
+        promote(v.integer);
+
+        if (op == tok::minus && v.integer.isSigned() && v.integer.isMinSignedValue())
+            return undefined(v);
+
+        if (op == tok::minus)
+            v.integer.negate();
+        else if (op == tok::tilde)
+            v.integer.flipAllBits();
+
+        return true;
+    }
+
+    // sizeof or _Alignof of a parenthesized type name; sizeof of an
+    // expression is left alone, as its type is not known here
+    bool measure(Value &v)
+    {
+        bool size = tokens[pos].is(tok::kw_sizeof);
+        QualType type;
+
+        ++pos;
+
+        if (!at(tok::l_paren))
+            return false;
+
+        ++pos;
+
+        if (!typeName(type) || !at(tok::r_paren))
+            return false;
+
+        ++pos;
+
+        if (type->isIncompleteType() || type->isFunctionType())
+            return false;
+
+        CharUnits n = size ? ctx.getTypeSizeInChars(type) : ctx.getTypeAlignInChars(type);
+        unsigned width = ctx.getTypeSize(ctx.getSizeType());
+
+        v.type = MACRO_INTEGER;
+        v.integer = APSInt { APInt { width, uint64_t(n.getQuantity()) }, true };
+        return true;
+    }
+
+    bool primary(Value &v)
+    {
+        const Token &t = tokens[pos];
+
+        switch (t.getKind()) {
+        case tok::numeric_constant:
+            ++pos;
+            return number(t, v);
+        case tok::char_constant:
+            ++pos;
+            return character(t, v);
+        case tok::string_literal:
+        case tok::utf8_string_literal:
+            return literal(v);
+        case tok::identifier:
+            ++pos;
+            return enumerator(t, v);
+        case tok::l_paren: {
+            QualType type;
+
+            ++pos;
+
+            if (typeName(type)) {
+                if (!at(tok::r_paren))
+                    return false;
+
+                ++pos;
+                return unary(v) && convert(v, type);
+            }
+
+            if (!conditional(v) || !at(tok::r_paren))
+                return false;
+
+            ++pos;
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+
+    bool number(const Token &t, Value &v)
+    {
+        // NumericLiteralParser may read one character past the spelling
+        SmallString<64> buffer;
+        bool invalid = false;
+
+        buffer.resize(t.getLength() + 1);
+
+        StringRef spelling = pp.getSpelling(t, buffer, &invalid);
+        NumericLiteralParser lit { spelling, t.getLocation(), pp };
+
+        if (invalid || lit.hadError || lit.isImaginary)
+            return false;
+
+        if (lit.isFloatingLiteral()) {
+            APFloat f { APFloat::IEEEdouble() };
+
+            if (lit.GetFloatValue(f) & APFloat::opInvalidOp)
+                return false;
+
+            v.type = MACRO_FLOAT;
+            v.floating = f.convertToDouble();
+            return true;
+        }
+
+        APInt value { 64, 0 };
+
+        if (!lit.isIntegerLiteral() || lit.GetIntegerValue(value))
+            return false;
+
+        // C11 6.4.4.1: the first of int, long and long long, starting from
+        // the suffix, that holds the value. Octal and hex literals may also
+        // take the unsigned type of each rank.
+        const QualType ranks[] = { ctx.IntTy, ctx.LongTy, ctx.LongLongTy };
+        bool decimal = lit.getRadix() == 10;
+        bool typed = false;
+
+        for (int r = lit.isLongLong ? 2 : lit.isLong ? 1 : 0; r < 3 && !typed; ++r) {
+            unsigned width = ctx.getTypeSize(ranks[r]);
+
+            if (!lit.isUnsigned && value.isIntN(width - 1)) {
+                v.integer = APSInt { value.zextOrTrunc(width), false };
+                typed = true;
+            } else if ((lit.isUnsigned || !decimal) && value.isIntN(width)) {
+                v.integer = APSInt { value.zextOrTrunc(width), true };
+                typed = true;
+            }
+        }
+
+        // Too large for long long; clang makes it unsigned long long
+        if (!typed)
+            v.integer = APSInt { value, true };
+
+        v.type = MACRO_INTEGER;
+        return true;
+    }
+
+    bool character(const Token &t, Value &v)
+    {
+        SmallString<16> buffer;
+        bool invalid = false;
+        StringRef spelling = pp.getSpelling(t, buffer, &invalid);
+        CharLiteralParser lit { spelling.begin(), spelling.end(), t.getLocation(), pp, t.getKind() };
+
+        if (invalid || lit.hadError())
+            return false;
+
+        // A character constant has type int in C
+        v.type = MACRO_INTEGER;
+        v.integer = APSInt { APInt { intWidth, lit.getValue(), true }, false };
+        return true;
+    }
+
+    // An enumeration constant declared at file scope, with the type clang
+    // gave it
+    bool enumerator(const Token &t, Value &v)
+    {
+        DeclarationName name { t.getIdentifierInfo() };
+
+        for (auto d : ctx.getTranslationUnitDecl()->lookup(name)) {
+            if (auto ecd = dyn_cast<EnumConstantDecl>(d)) {
+                QualType type = ecd->getType();
+
+                v.type = MACRO_INTEGER;
+                v.integer = ecd->getInitVal().extOrTrunc(ctx.getTypeSize(type));
+                v.integer.setIsUnsigned(type->isUnsignedIntegerOrEnumerationType());
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Adjacent string literals are concatenated, as in translation phase 6
+    bool literal(Value &v)
+    {
+        size_t first = pos;
+
+        while (at(tok::string_literal) || at(tok::utf8_string_literal))
+            ++pos;
+
+        StringLiteralParser lit { ArrayRef<Token>(tokens).slice(first, pos - first), pp, false };
+
+        if (lit.hadError || lit.GetCharByteWidth() != 1)
+            return false;
+
+        v.type = MACRO_STRING;
+        v.string = lit.GetString().str();
+        return true;
+    }
+
+    // Parses the type of a cast or sizeof: builtin type keywords, a typedef
+    // name or a tag declared at file scope, followed by any number of *
+    bool typeName(QualType &type)
+    {
+        if (!baseType(type))
+            return false;
+
+        while (at(tok::star)) {
+            type = ctx.getPointerType(type);
+
+            for (++pos; at(tok::kw_const) || at(tok::kw_volatile); ++pos)
+                ;
+        }
+
+        return true;
+    }
+
+    bool baseType(QualType &type)
+    {
+        unsigned longs = 0;
+        bool isUnsigned = false, isSigned = false, isShort = false, isChar = false, isBool = false;
+        bool isFloat = false, isDouble = false, isVoid = false, any = false;
+
+        if (at(tok::identifier)) {
+            DeclarationName name { tokens[pos].getIdentifierInfo() };
+
+            for (auto d : ctx.getTranslationUnitDecl()->lookup(name)) {
+                if (auto td = dyn_cast<TypedefNameDecl>(d)) {
+                    ++pos;
+                    type = td->getUnderlyingType();
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        if (at(tok::kw_struct) || at(tok::kw_union) || at(tok::kw_enum))
+            return tag(type);
+
+        for (; pos < tokens.size(); ++pos) {
+            tok::TokenKind k = tokens[pos].getKind();
+
+            if (k == tok::kw_unsigned)
+                isUnsigned = true;
+            else if (k == tok::kw_signed)
+                isSigned = true;
+            else if (k == tok::kw_long)
+                ++longs;
+            else if (k == tok::kw_short)
+                isShort = true;
+            else if (k == tok::kw_char)
+                isChar = true;
+            else if (k == tok::kw__Bool)
+                isBool = true;
+            else if (k == tok::kw_float)
+                isFloat = true;
+            else if (k == tok::kw_double)
+                isDouble = true;
+            else if (k == tok::kw_void)
+                isVoid = true;
+            else if (k != tok::kw_int && k != tok::kw_const && k != tok::kw_volatile)
+                break;
+
+            any = true;
+        }
+
+        if (!any)
+            return false;
+
+        if (isVoid)
+            type = ctx.VoidTy;
+        else if (isBool)
+            type = ctx.BoolTy;
+        else if (isFloat)
+            type = ctx.FloatTy;
+        else if (isDouble)
+            type = longs ? ctx.LongDoubleTy : ctx.DoubleTy;
+        else if (isChar)
+            type = isUnsigned ? ctx.UnsignedCharTy : isSigned ? ctx.SignedCharTy : ctx.CharTy;
+        else if (isShort)
+            type = isUnsigned ? ctx.UnsignedShortTy : ctx.ShortTy;
+        else if (longs >= 2)
+            type = isUnsigned ? ctx.UnsignedLongLongTy : ctx.LongLongTy;
+        else if (longs == 1)
+            type = isUnsigned ? ctx.UnsignedLongTy : ctx.LongTy;
+        else
+            type = isUnsigned ? ctx.UnsignedIntTy : ctx.IntTy;
+
+        return true;
+    }
+
+    bool tag(QualType &type)
+    {
+        TagTypeKind kind = at(tok::kw_struct) ? TTK_Struct : at(tok::kw_union) ? TTK_Union : TTK_Enum;
+
+        if (++pos >= tokens.size() || !at(tok::identifier))
+            return false;
+
+        DeclarationName name { tokens[pos].getIdentifierInfo() };
+
+        for (auto d : ctx.getTranslationUnitDecl()->lookup(name)) {
+            auto td = dyn_cast<TagDecl>(d);
+
+            if (td && td->getTagKind() == kind) {
+                ++pos;
+                type = ctx.getTagDeclType(td);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool convert(Value &v, QualType type)
+    {
+        type = type.getCanonicalType();
+
+        if (v.type == MACRO_STRING)
+            return false;
+
+        if (type->isRealFloatingType()) {
+            if (v.type == MACRO_INTEGER)
+                v.floating = v.integer.isSigned() ? double(v.integer.getSExtValue()) : double(v.integer.getZExtValue());
+
+            v.type = MACRO_FLOAT;
+            return true;
+        }
+
+        if (!type->isIntegerType())
+            return false;
+
+        unsigned width = ctx.getTypeSize(type);
+        bool isUnsigned = type->isUnsignedIntegerOrEnumerationType();
+
+        if (type->isBooleanType()) {
+            bool t;
+
+            truth(v, t);
+            v.integer = APSInt { APInt { width, t }, true };
+        } else if (v.type == MACRO_FLOAT) {
+            APSInt result { width, isUnsigned };
+            bool exact;
+
+            if (APFloat { v.floating }.convertToInteger(result, APFloat::rmTowardZero, &exact) & APFloat::opInvalidOp)
+                return false;
+
+            v.integer = result;
+        } else {
+            v.integer = v.integer.extOrTrunc(width);
+            v.integer.setIsUnsigned(isUnsigned);
+        }
+
+        v.type = MACRO_INTEGER;
+        return true;
+    }
+
+    bool truth(const Value &v, bool &t)
+    {
+        if (v.type == MACRO_STRING)
+            return false;
+
+        t = v.type == MACRO_FLOAT ? v.floating != 0 : v.integer.getBoolValue();
+        return true;
+    }
+
+    Value integer(bool b)
+    {
+        Value v;
+
+        v.type = MACRO_INTEGER;
+        v.integer = APSInt { APInt { intWidth, b }, false };
+        return v;
+    }
+
+    // Integer promotion: anything narrower than int becomes int
+    void promote(APSInt &i)
+    {
+        if (i.getBitWidth() < intWidth) {
+            i = i.extend(intWidth);
+            i.setIsUnsigned(false);
+        }
+    }
+
+    // The usual arithmetic conversions, applied to both operands
+    bool arithmetic(Value &l, Value &r)
+    {
+        if (l.type == MACRO_FLOAT || r.type == MACRO_FLOAT)
+            return convert(l, ctx.DoubleTy) && convert(r, ctx.DoubleTy);
+
+        promote(l.integer);
+        promote(r.integer);
+
+        unsigned width = std::max(l.integer.getBitWidth(), r.integer.getBitWidth());
+        bool isUnsigned;
+
+        if (l.integer.isUnsigned() == r.integer.isUnsigned())
+            isUnsigned = l.integer.isUnsigned();
+        else if (l.integer.isUnsigned())
+            isUnsigned = l.integer.getBitWidth() >= r.integer.getBitWidth();
+        else
+            isUnsigned = r.integer.getBitWidth() >= l.integer.getBitWidth();
+
+        l.integer = l.integer.extOrTrunc(width);
+        r.integer = r.integer.extOrTrunc(width);
+        l.integer.setIsUnsigned(isUnsigned);
+        r.integer.setIsUnsigned(isUnsigned);
+
+        return true;
+    }
+
+    bool apply(tok::TokenKind op, Value &l, Value &r)
+    {
+        bool lt, rt;
+
+        if (!truth(l, lt) || !truth(r, rt))
+            return false;
+
+        if (op == tok::ampamp || op == tok::pipepipe) {
+            l = integer(op == tok::ampamp ? lt && rt : lt || rt);
+            return true;
+        }
+
+        if (op == tok::lessless || op == tok::greatergreater) {
+            if (l.type != MACRO_INTEGER || r.type != MACRO_INTEGER)
+                return false;
+
+            promote(l.integer);
+
+            // Shifting by a negative amount or the full width is undefined,
+            // as is shifting a negative value left or shifting bits out of
+            // it. Like clang, a shift into the sign bit is allowed.
+            if (r.integer.isNegative() || r.integer.uge(l.integer.getBitWidth()))
+                return undefined(l);
+
+            unsigned n = r.integer.getZExtValue();
+
+            if (op == tok::lessless && l.integer.isSigned()
+                && (l.integer.isNegative() || l.integer.countLeadingZeros() < n))
+                return undefined(l);
+
+            l.integer = op == tok::lessless ? l.integer << n : l.integer >> n;
+            return true;
+        }
+
+        if (!arithmetic(l, r))
+            return false;
+
+        if (l.type == MACRO_FLOAT) {
+            double a = l.floating, b = r.floating;
+
+            switch (op) {
+            case tok::plus: l.floating = a + b; return true;
+            case tok::minus: l.floating = a - b; return true;
+            case tok::star: l.floating = a * b; return true;
+            case tok::slash: l.floating = a / b; return true;
+            case tok::less: l = integer(a < b); return true;
+            case tok::greater: l = integer(a > b); return true;
+            case tok::lessequal: l = integer(a <= b); return true;
+            case tok::greaterequal: l = integer(a >= b); return true;
+            case tok::equalequal: l = integer(a == b); return true;
+            case tok::exclaimequal: l = integer(a != b); return true;
+            default: return false;
+            }
+        }
+
+        const APSInt &a = l.integer, &b = r.integer;
+
+        if ((op == tok::slash || op == tok::percent)
+            && (!b || (a.isSigned() && a.isMinSignedValue() && b.isAllOnesValue())))
+            return undefined(l);
+
+        // Signed overflow is undefined; unsigned arithmetic wraps
+        if (a.isSigned() && (op == tok::plus || op == tok::minus || op == tok::star)) {
+            bool overflow = false;
+            APInt result = op == tok::plus ? a.sadd_ov(b, overflow)
+                         : op == tok::minus ? a.ssub_ov(b, overflow)
+                         : a.smul_ov(b, overflow);
+
+            if (overflow)
+                return undefined(l);
+
+            l.integer = APSInt { result, false };
+            return true;
+        }
+
+        switch (op) {
+        case tok::plus: l.integer = a + b; return true;
+        case tok::minus: l.integer = a - b; return true;
+        case tok::star: l.integer = a * b; return true;
+        case tok::slash: l.integer = a / b; return true;
+        case tok::percent: l.integer = a % b; return true;
+        case tok::amp: l.integer = a & b; return true;
+        case tok::caret: l.integer = a ^ b; return true;
+        case tok::pipe: l.integer = a | b; return true;
+        case tok::less: l = integer(a < b); return true;
+        case tok::greater: l = integer(a > b); return true;
+        case tok::lessequal: l = integer(a <= b); return true;
+        case tok::greaterequal: l = integer(a >= b); return true;
+        case tok::equalequal: l = integer(a == b); return true;
+        case tok::exclaimequal: l = integer(a != b); return true;
+        default: return false;
+        }
+    }
+
+    Preprocessor &pp;
+    ASTContext &ctx;
+    const std::vector<Token> &tokens;
+    unsigned intWidth;
+    size_t pos = 0;
+    unsigned unevaluated = 0; // depth of operands that are not evaluated
+};
+
+class GetMacros : public PPCallbacks
+{
+public:
+    Preprocessor &pp;
+    std::map<std::string, const MacroInfo *> macros;
+    SourceFilter &filter;
+    const SymbolFilter &symbols;
+    WalkControl &control;
+    FFIGenStats &stats;
+    ffi_gen_index *shared; // NULL unless walks share an index
+
+    GetMacros(Preprocessor &p, SourceFilter &filter, const SymbolFilter &symbols, WalkControl &control, ffi_gen_index *shared, FFIGenStats &stats)
+        : pp(p), filter(filter), symbols(symbols), control(control), stats(stats), shared(shared) {}
+
+    virtual void MacroDefined(const Token &MacroNameTok, const MacroDirective *MD)
+	{
+        const MacroInfo *i = MD->getMacroInfo();
+
+        // Ignore function-like macros, macros with no tokens and macros not
+        // in the file we wanted to parse
+        if (!i->isObjectLike() || i->getNumTokens() == 0 || !isInRequestedSourceFiles(i))
+            return;
+
+        StringRef name = MacroNameTok.getIdentifierInfo()->getName();
+
+        // Macros aren't named by any type, so only roots are reachable
+        if (!symbols.wants(MACRO_DECL, name) || (symbols.hasRoots() && !symbols.isRoot(name))) {
+            ++stats.decls_filtered;
+            return;
+        }
+
+        macros[name.str()] = i;
+        ++stats.macros_seen;
+	}
+
+    virtual void MacroUndefined(const Token &MacroNameTok, const MacroDefinition &MD, const MacroDirective *Undef)
+    {
+        macros.erase(MacroNameTok.getName());
+    }
+
+    // Must only be called once the preprocessor has reached the end of the
+    // translation unit, so that child macros resolve to their final values.
+    // Calls into cb are counted and timed in calls.
+    void emitMacros(callbacks &cb, FFIGenStats &calls, ASTContext &ctx)
+    {
+        PhaseTimer timer { stats.macros_ns, "macros" };
+        DiagnosticsEngine &diags = pp.getDiagnostics();
+        bool suppressed = diags.getSuppressAllDiagnostics();
+
+        // Plenty of macros aren't expressions; the literal parsers shouldn't
+        // report those as errors
+        diags.setSuppressAllDiagnostics(true);
+
+        for (auto &m : macros) {
+            if (control.stopped())
+                break;
+
+            control.done(1);
+
+            TraceSpan span { "macro", m.first };
+            const std::vector<Token> *tokens = expand(m.second);
+
+            if (!tokens)
+                continue;
+
+            std::string tokenPaste;
+            MacroFolder::Value folded;
+            FFIMacroValue value {};
+
+            for (auto &t : *tokens) {
+                tokenPaste.append(pp.getSpelling(t));
+                tokenPaste.append(" ");
+            }
+
+            if (!isFirst(m.first, m.second, tokenPaste))
+                continue;
+
+            bool folds = MacroFolder { pp, ctx, *tokens }.fold(folded);
+
+            // Integers wider than 64 bits, from a cast to __int128, can't be
+            // reported
+            if (folded.type == MACRO_INTEGER)
+                folds = folds && (folded.integer.isUnsigned() ? folded.integer.getActiveBits() : folded.integer.getMinSignedBits()) <= 64;
+
+            if (folds) {
+                value.type = folded.type;
+                value.is_unsigned = folded.type == MACRO_INTEGER && folded.integer.isUnsigned();
+                value.floating = folded.floating;
+                value.string = folded.type == MACRO_STRING ? folded.string.c_str() : nullptr;
+                value.string_size = folded.string.size();
+
+                if (folded.type == MACRO_INTEGER)
+                    value.integer = value.is_unsigned ? int64_t(folded.integer.getZExtValue()) : folded.integer.getSExtValue();
+            }
+
+            CallTimer call { calls, m.first };
+
+            cb.mc(m.first.c_str(), tokenPaste.c_str(), &value, cb.user_data);
+            ++stats.macros_emitted;
+            ++stats.decls_emitted;
+        }
+
+        diags.setSuppressAllDiagnostics(suppressed);
+    }
+
+private:
+    // A macro's USR is its name and where it is defined, so only the same
+    // header seen by several TUs sharing the index makes a repeat
+    bool isFirst(const std::string &name, const MacroInfo *mi, const std::string &definition)
+    {
+        SmallString<128> usr;
+
+        if (!shared || index::generateUSRForMacro(name, mi->getDefinitionLoc(), pp.getSourceManager(), usr))
+            return true;
+
+        switch (shared->claim(MACRO_DECL, usr, definition)) {
+        case ffi_gen_index::FIRST:
+            return true;
+        case ffi_gen_index::CONFLICT:
+            fprintf(stderr, "ffi_gen: %s: macro %s differs from the one already reported\n",
+                    mi->getDefinitionLoc().printToString(pp.getSourceManager()).c_str(), name.c_str());
+            ++stats.decls_conflict;
+            return false;
+        case ffi_gen_index::REPEATED:
+            break;
+        }
+
+        ++stats.decls_repeated;
+        return false;
+    }
+
+    struct Expansion {
+        std::vector<Token> tokens;
+        bool active = false;
+        bool done = false;
+        bool valid = false;
+    };
+
+    // Expansions are memoized per definition
+    std::map<const MacroInfo *, Expansion> expansions;
+
+    bool isInRequestedSourceFiles(const MacroInfo *i)
+    {
+        return filter.contains(i->getDefinitionLoc());
+    }
+
+    // Replaces every identifier in a macro body that names an object-like
+    // macro with that macro's own expansion. Each definition is expanded
+    // once however many macros refer to it. A macro that refers back to one
+    // being expanded is left as is, as the preprocessor does. Returns NULL if
+    // the body uses a function-like macro.
+    const std::vector<Token> *expand(const MacroInfo *mi)
+    {
+        Expansion &e = expansions[mi];
+
+        if (e.done)
+            return e.valid ? &e.tokens : nullptr;
+
+        e.active = true;
+
+        for (auto &t : mi->tokens()) {
+            const MacroInfo *child = t.is(tok::identifier) ? pp.getMacroInfo(t.getIdentifierInfo()) : nullptr;
+
+            if (!child || expansions[child].active) {
+                e.tokens.push_back(t);
+                continue;
+            }
+
+            const std::vector<Token> *childTokens = child->isObjectLike() ? expand(child) : nullptr;
+
+            if (!childTokens) {
+                e.tokens.clear();
+                e.active = false;
+                e.done = true;
+                return nullptr;
+            }
+
+            e.tokens.insert(e.tokens.end(), childTokens->begin(), childTokens->end());
+        }
+
+        e.active = false;
+        e.done = true;
+        e.valid = true;
+
+        return &e.tokens;
+    }
+};
+
+class FFIGenVisitor : public RecursiveASTVisitor<FFIGenVisitor>
+{
+public:
+    explicit FFIGenVisitor(ASTContext *Context, callbacks &cb, SourceFilter &filter, const SymbolFilter &symbols, const Reachable &reachable,
+                           TypeCache &types, WalkControl &control, ffi_gen_index *shared, FFIGenStats &stats, FFIGenStats &calls)
+        : Context(Context), cb(cb), filter(filter), symbols(symbols), reachable(reachable), types(types), control(control), shared(shared),
+          stats(stats), calls(calls) {}
+
+    // Skips top-level declarations of files that weren't requested as a
+    // whole, instead of visiting everything inside them. Linkage specs are
+    // still entered since they may wrap declarations from anywhere. The
+    // walk may be stopped before any top-level declaration.
+    bool TraverseDecl(Decl *d)
+    {
+        if (d && !isa<TranslationUnitDecl>(d) && !isa<LinkageSpecDecl>(d) && d->getDeclContext()->isTranslationUnit()) {
+            if (control.stopped())
+                return false;
+
+            control.done(1);
+
+            if (!filter.contains(d->getLocStart())) {
+                ++stats.decls_pruned;
+                return true;
+            }
+        }
+
+        return RecursiveASTVisitor<FFIGenVisitor>::TraverseDecl(d);
+    }
+
+    bool isInRequestedSourceFiles(SourceLocation l)
+    {
+        return filter.contains(l);
+    }
+
+    // Checked before any type of the declaration is converted
+    bool isWanted(FFIDeclKind kind, const Decl *d, const std::string &name)
+    {
+        if (symbols.wants(kind, name) && reachable.contains(d))
+            return true;
+
+        ++stats.decls_filtered;
+        return false;
+    }
+
+    // Whether d is the first declaration of its entity to be reported as
+    // kind. Redeclarations in this TU are skipped, and with a shared index so
+    // is anything another walk reported, or reported differently; the
+    // signature of d is only computed for the index.
+    template <typename Signature>
+    bool isFirst(FFIDeclKind kind, const Decl *d, Signature signature)
+    {
+        if (!reported.insert(std::make_pair(d->getCanonicalDecl(), kind)).second) {
+            ++stats.decls_repeated;
+            return false;
+        }
+
+        SmallString<128> usr;
+
+        // Entities without a USR are reported as they always were
+        if (!shared || index::generateUSRForDecl(d, usr))
+            return true;
+
+        switch (shared->claim(kind, usr, signature())) {
+        case ffi_gen_index::FIRST:
+            return true;
+        case ffi_gen_index::CONFLICT:
+            fprintf(stderr, "ffi_gen: %s: %s differs from the declaration already reported\n",
+                    d->getLocation().printToString(Context->getSourceManager()).c_str(), usr.c_str());
+            ++stats.decls_conflict;
+            return false;
+        case ffi_gen_index::REPEATED:
+            break;
+        }
+
+        ++stats.decls_repeated;
+        return false;
+    }
+
+    virtual bool VisitFunctionDecl(FunctionDecl *func)
+    {
+        if (!isInRequestedSourceFiles(func->getLocStart()))
+            return true;
+
+        ++stats.decls_visited;
+
+        // A later declaration may still give this one its parameters
+        if (deferring && !func->hasPrototype()) {
+            deferred.push_back(func);
+            return true;
+        }
+
+        return reportFunction(func);
+    }
+
+    // Reports the functions whose visit was put off while streaming, once
+    // the TU has been parsed
+    bool reportDeferred()
+    {
+        for (FunctionDecl *func : deferred) {
+            if (control.stopped())
+                return false;
+
+            reportFunction(func);
+        }
+
+        deferred.clear();
+        return true;
+    }
+
+    // While streaming, functions declared without a prototype are only
+    // reported by reportDeferred
+    void deferUnprototyped()
+    {
+        deferring = true;
+    }
+
+    // Reported as the most recent declaration, which has the parameters of
+    // any prototype before it
+    bool reportFunction(FunctionDecl *func)
+    {
+        FunctionDecl *latest = func->getMostRecentDecl();
+        std::string funcName = func->getNameInfo().getName().getAsString();
+
+        if (!isWanted(FUNCTION_DECL, func, funcName) || !isFirst(FUNCTION_DECL, func, [latest] { return type_signature(latest->getType()); }))
+            return true;
+
+        TraceSpan span { "declaration", funcName };
+
+        FFITypeRef *paramTys;
+        size_t numParams;
+        FFITypeRef *returnTy = get_types_for_func(latest, paramTys, numParams, types);
+
+        CallTimer call { calls, funcName };
+
+        cb.fc(funcName.c_str(), returnTy, paramTys, numParams, cb.user_data);
+        ++stats.decls_emitted;
+
+        return true;
+    }
+
+    virtual bool VisitVarDecl(VarDecl *vd)
+    {
+        if (!isInRequestedSourceFiles(vd->getLocStart()))
+            return true;
+
+        ++stats.decls_visited;
+
+        // Don't try to do binding for non-exported variables
+        if (!vd->isExternC())
+            return true;
+
+        std::string name = vd->getNameAsString();
+
+        // The most recent declaration may complete an array's size
+        VarDecl *latest = vd->getMostRecentDecl();
+
+        if (!isWanted(VARIABLE_DECL, vd, name) || !isFirst(VARIABLE_DECL, vd, [latest] { return type_signature(latest->getType()); }))
+            return true;
+
+        TraceSpan span { "declaration", name };
+
+        FFITypeRef *varTy = types.get(latest->getType());
+
+        CallTimer call { calls, name };
+
+        cb.vc(name.c_str(), varTy, cb.user_data);
+        ++stats.decls_emitted;
+
+        return true;
+    }
+
+    virtual bool VisitEnumDecl(EnumDecl *ed)
+    {
+        // Don't visit forward declarations
+        if (!ed->isThisDeclarationADefinition())
+            return true;
+
+        ed = ed->getCanonicalDecl();
+
+        if (!isInRequestedSourceFiles(ed->getLocStart()))
+            return true;
+
+        ++stats.decls_visited;
+
+        // Don't try to do binding for non-exported enums
+        if (!ed->hasNameForLinkage())
+            return true;
+
+
+        std::string name = ed->getNameAsString();
+        if (name.size() == 0)
+            name = ed->getTypedefNameForAnonDecl()->getUnderlyingType().getAsString();
+
+        if (!isWanted(ENUM_DECL, ed, name) || !isFirst(ENUM_DECL, ed, [ed] { return enum_signature(ed); }))
+            return true;
+
+        TraceSpan span { "declaration", name };
+
+        std::vector<std::string> memberNameStrings;
+        std::vector<const char *> memberNames;
+        std::vector<int64_t> memberValues;
+
+        for (auto d : ed->enumerators()) {
+            std::string memberName = d->getNameAsString();
+
+            memberNameStrings.push_back(memberName);
+            memberValues.push_back(d->getInitVal().getExtValue());
+        }
+
+        for (auto &s : memberNameStrings)
+            memberNames.push_back(s.c_str());
+
+        CallTimer call { calls, name };
+
+        cb.ec(name.c_str(), memberNames.data(), memberValues.data(), memberValues.size(), cb.user_data);
+        ++stats.decls_emitted;
+
+        return true;
+    }
+
+    virtual bool VisitTypedefDecl(TypedefDecl *td)
+    {
+        if (!isInRequestedSourceFiles(td->getLocStart()))
+            return true;
+
+        ++stats.decls_visited;
+
+        std::string aliasName = td->getNameAsString();
+
+        if (!isWanted(TYPEDEF_DECL, td, aliasName) || !isFirst(TYPEDEF_DECL, td, [td] { return type_signature(td->getUnderlyingType()); }))
+            return true;
+
+        TraceSpan span { "declaration", aliasName };
+
+        FFITypeRef *type = types.get(td->getUnderlyingType());
+
+        CallTimer call { calls, aliasName };
+
+        cb.tc(aliasName.c_str(), type, cb.user_data);
+        ++stats.decls_emitted;
+
+        return true;
+    }
+
+    virtual bool VisitRecordDecl(RecordDecl *rd)
+    {
+        // Don't visit forward declarations
+        if (!rd->isThisDeclarationADefinition())
+            return tag_forward_decl(rd);
+
+        rd = rd->getDefinition();
+
+        if (!rd || !isInRequestedSourceFiles(rd->getLocStart()))
+            return true;
+
+        ++stats.decls_visited;
+
+        // Don't try to do binding for non-exported structs/unions
+        if (!rd->hasNameForLinkage())
+            return true;
+
+        bool defined = rd->getDefinition() != NULL;
+
+        std::string name = rd->getNameAsString();
+        if (name.size() == 0)
+            name = rd->getTypedefNameForAnonDecl()->getUnderlyingType().getAsString();
+
+        FFIDeclKind kind = rd->isUnion() ? UNION_DECL : STRUCT_DECL;
+
+        if (!isWanted(kind, rd, name) || !isFirst(kind, rd, [rd] { return record_signature(rd); }))
+            return true;
+
+        TraceSpan span { "declaration", name };
+
+        std::vector<std::string> memberNameStrings;
+        std::vector<const char *> memberNames;
+        std::vector<FFITypeRef *> memberTypes;
+        std::vector<FFIFieldLayout> fields;
+        FFIRecordLayout layout = get_record_layout(rd, *Context, fields);
+
+        for (auto f : rd->fields()) {
+            std::string memberName = f->getNameAsString();
+
+            memberTypes.push_back(types.get(f->getType()));
+            memberNameStrings.push_back(memberName);
+        }
+
+        for (auto &s : memberNameStrings)
+            memberNames.push_back(s.c_str());
+
+        // Types handed to a callback live in the arena, so a handle taken on
+        // them stays valid for as long as the result
+        FFITypeRef *members = types.array(memberTypes);
+
+        CallTimer call { calls, name };
+
+        if (rd->isUnion()) {
+            cb.uc(name.c_str(), members, memberNames.data(), memberTypes.size(), defined, &layout, cb.user_data);
+        } else {
+            cb.sc(name.c_str(), members, memberNames.data(), memberTypes.size(), defined, &layout, cb.user_data);
+        }
+
+        ++stats.decls_emitted;
+
+        return true;
+    }
+
+private:
+    bool tag_forward_decl(TagDecl *td)
+    {
+        // Don't try to do binding for non-exported names
+        if (!td->hasNameForLinkage())
+            return true;
+
+        if (!isInRequestedSourceFiles(td->getLocStart()))
+            return true;
+
+        ++stats.decls_visited;
+
+        std::string name = td->getNameAsString();
+        if (name.size() == 0)
+            name = td->getTypedefNameForAnonDecl()->getUnderlyingType().getAsString();
+
+        if (!isWanted(FORWARD_DECL, td, name) || !isFirst(FORWARD_DECL, td, [] { return std::string {}; }))
+            return true;
+
+        TraceSpan span { "declaration", name };
+
+        FFIForwardType t;
+
+        if (td->isUnion())
+            t = FFIForwardType::UNION;
+        else
+            t = FFIForwardType::STRUCT;
+
+        CallTimer call { calls, name };
+
+        cb.fdc(name.c_str(), t, cb.user_data);
+        ++stats.decls_emitted;
+
+        return true;
+    }
+
+    ASTContext *Context;
+    callbacks &cb;
+    SourceFilter &filter;
+    const SymbolFilter &symbols;
+    const Reachable &reachable;
+    TypeCache &types;
+    WalkControl &control;
+    ffi_gen_index *shared; // NULL unless walks share an index
+    DenseSet<std::pair<const Decl *, int> > reported; // canonical declarations, by the FFIDeclKind reported
+    bool deferring = false;
+    std::vector<FunctionDecl *> deferred; // unprototyped, while streaming
+    FFIGenStats &stats;
+    FFIGenStats &calls; ///< Where calls into cb are counted and timed
+};
+
+
+class FFIParseConsumer : public clang::ASTConsumer
+{
+public:
+    // When streaming, each top-level declaration is visited as soon as it
+    // is parsed, instead of once the whole TU is
+    explicit FFIParseConsumer(ASTContext *Context, callbacks &cb, SourceFilter &filter, const SymbolFilter &symbols, WalkControl &control,
+                              ffi_gen_index *shared, ffi_gen_result &result, FFIGenStats &calls, GetMacros *macros, bool streaming)
+        : Types(Context, result), Reached(symbols), Visitor(Context, cb, filter, symbols, Reached, Types, control, shared, result.stats, calls),
+          cb(cb), control(control), stats(result.stats), calls(calls), macros(macros), streaming(streaming), parseStart(Clock::now())
+    {
+        if (streaming)
+            Visitor.deferUnprototyped();
+    }
+
+    // Returning false abandons the parse, once the walk has been stopped,
+    // whether or not declarations are streamed
+    virtual bool HandleTopLevelDecl(DeclGroupRef group)
+    {
+        if (control.stopped())
+            return false;
+
+        if (!streaming)
+            return true;
+
+        PhaseTimer timer { streamedNs, "traverse" };
+
+        for (Decl *d : group) {
+            if (!Visitor.TraverseDecl(d))
+                return false;
+        }
+
+        return true;
+    }
+
+    virtual void HandleTagDeclDefinition(TagDecl *td)
+    {
+        if (auto rd = dyn_cast<RecordDecl>(td))
+            Types.completed(rd);
+    }
+
+    virtual void HandleTranslationUnit(clang::ASTContext &Context)
+    {
+        stats.parse_ns += elapsed_ns(parseStart) - streamedNs;
+
+        if (current_trace)
+            current_trace->span("parse", StringRef {}, parseStart, Clock::now());
+
+        stats.traverse_ns += streamedNs;
+
+        if (streaming) {
+            PhaseTimer timer { stats.traverse_ns, "traverse" };
+
+            Visitor.reportDeferred();
+        }
+
+        // The preprocessor has seen the whole TU by now. Without streaming,
+        // macros are reported first, exactly as the old preprocess-only pass
+        // used to; when streaming they can only follow the declarations.
+        macros->emitMacros(cb, calls, Context);
+
+        if (streaming)
+            return;
+
+        PhaseTimer timer { stats.traverse_ns, "traverse" };
+
+        Reached.compute(Context);
+        Visitor.TraverseDecl(Context.getTranslationUnitDecl());
+    }
+
+private:
+    TypeCache Types;
+    Reachable Reached;
+    FFIGenVisitor Visitor;
+    callbacks &cb;
+    WalkControl &control;
+    FFIGenStats &stats;
+    FFIGenStats &calls;
+    GetMacros *macros; // owned by the preprocessor
+    bool streaming;
+    uint64_t streamedNs = 0; // visiting done while parsing
+    Clock::time_point parseStart; // the consumer is created just before parsing starts
+};
+
+// Collects macros and declarations from a single parse: the macro callbacks
+// are registered on the same preprocessor that feeds the AST consumer.
+class FFIParseAction : public clang::ASTFrontendAction {
+public:
+    // Calls into cb are counted and timed in calls, which is result.stats
+    // unless cb only records them for later
+    FFIParseAction(callbacks &cb, std::vector<std::string> &sources, const SymbolFilter &symbols, WalkControl &control, ffi_gen_index *shared,
+                   ffi_gen_result &result, FFIGenStats &calls, bool streaming)
+        : cb(cb), sources(sources), symbols(symbols), control(control), shared(shared), result(result), calls(calls), streaming(streaming),
+          created(Clock::now()) {}
+
+    virtual std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(clang::CompilerInstance &Compiler, llvm::StringRef InFile)
+    {
+        Preprocessor &p = Compiler.getPreprocessor();
+        filter.reset(new SourceFilter { Compiler.getSourceManager(), sources });
+
+        GetMacros *macros = new GetMacros { p, *filter, symbols, control, shared, result.stats };
+
+        result.stats.setup_ns += elapsed_ns(created);
+
+        if (current_trace)
+            current_trace->span("setup", InFile, created, Clock::now());
+
+        p.addPPCallbacks(std::unique_ptr<PPCallbacks> { macros });
+
+        return std::unique_ptr<clang::ASTConsumer> { new FFIParseConsumer { &Compiler.getASTContext(), cb, *filter, symbols, control, shared, result, calls, macros, streaming } };
+    }
+
+    // Records the include graph of the TU, for invalidating cached walks
+    virtual void EndSourceFileAction()
+    {
+        SourceManager &sm = getCompilerInstance().getSourceManager();
+        std::map<const FileEntry *, int> index;
+
+        auto fileIndex = [&](const FileEntry *fe) {
+            auto i = index.find(fe);
+            if (i != index.end())
+                return i->second;
+
+            result.files.push_back(fe->getName().str());
+            return index[fe] = result.files.size() - 1;
+        };
+
+        for (unsigned i = 0; i < sm.local_sloc_entry_size(); ++i) {
+            const SrcMgr::SLocEntry &e = sm.getLocalSLocEntry(i);
+
+            if (!e.isFile())
+                continue;
+
+            const FileEntry *fe = e.getFile().getContentCache()->OrigEntry;
+            SourceLocation includeLoc = e.getFile().getIncludeLoc();
+
+            // Skip the predefines and other builtin buffers
+            if (!fe)
+                continue;
+
+            int included = fileIndex(fe);
+
+            if (includeLoc.isValid()) {
+                const FileEntry *includer = sm.getFileEntryForID(sm.getFileID(includeLoc));
+
+                if (includer)
+                    result.includes.push_back(std::make_pair(fileIndex(includer), included));
+            }
+        }
+    }
+
+private:
+    callbacks &cb;
+    std::vector<std::string> &sources;
+    std::unique_ptr<SourceFilter> filter; // shared by the macro callbacks and the visitor
+    const SymbolFilter &symbols;
+    WalkControl &control;
+    ffi_gen_index *shared;
+    ffi_gen_result &result;
+    FFIGenStats &calls;
+    bool streaming;
+    Clock::time_point created;
+};
+
+static FFITypeRef type_for_qual(QualType qt, const std::string &qualName, TypeCache &types)
+{
+    ASTContext *ctx = types.ctx;
+    BumpPtrAllocator &arena = types.arena;
+    FFITypeRef returnTy;
+    returnTy.qual_name = types.copyString(qualName);
+
+    if (qt->isVoidType()) {
+        returnTy.type = FFIRefType::VOID_REF;
+    } else if (qt->isPointerType()) {
+        returnTy.type = FFIRefType::POINTER_REF;
+        returnTy.point_type.pointed_type = types.get(qt->getPointeeType());
+    } else if (qt->isEnumeralType()) {
+        const EnumDecl *ed = qt->castAs<EnumType>()->getDecl();
+
+        returnTy.type = FFIRefType::ENUM_REF;
+
+        if (ed->hasNameForLinkage()) {
+            std::string name = ed->getNameAsString();
+            if (name.size() == 0)
+                name = ed->getTypedefNameForAnonDecl()->getUnderlyingType().getAsString();
+
+            returnTy.enum_type.name = types.copyString(name);
+            returnTy.enum_type.anonymous = 0;
+        } else {
+            returnTy.enum_type.name = NULL;
+            returnTy.enum_type.anonymous = 1;
+        }
+    } else if (qt->isRecordType()) {
+        const RecordDecl *rd = qt->castAs<RecordType>()->getDecl();
+
+        std::string name;
+        std::vector<FFIRecordMember> members;
+        std::vector<FFIFieldLayout> fields;
+        FFIRecordLayout layout = get_record_layout(rd, *ctx, fields);
+
+        // see if it's defined
+        bool defined = rd->getDefinition() != NULL;
+
+        // Members, and so their positions, are only listed for anonymous
+        // records
+        layout.fields = rd->isAnonymousStructOrUnion() ? arena_copy(arena, fields) : nullptr;
+
+        if (rd->isAnonymousStructOrUnion()) {
+            // Only add fields in an anonymous record!
+            for (auto f : rd->fields()) {
+                FFIRecordMember m;
+                std::string memberName = f->getNameAsString();
+
+                m.name = NULL;
+                if (memberName.size() > 0)
+                    m.name = types.copyString(memberName);
+                m.type = types.get(f->getType());
+
+                members.push_back(m);
+            }
+        } else if (rd->hasNameForLinkage()) {
+            name = rd->getNameAsString();
+            if (name.size() == 0)
+                name = rd->getTypedefNameForAnonDecl()->getUnderlyingType().getAsString();
+        }
+
+        if (qt->isUnionType()) {
+            returnTy.type = FFIRefType::UNION_REF;
+            returnTy.union_type.anonymous = rd->isAnonymousStructOrUnion();
+            returnTy.union_type.members = arena_copy(arena, members);
+            returnTy.union_type.num_members = members.size();
+            returnTy.union_type.name = NULL;
+            returnTy.union_type.defined = defined;
+            returnTy.union_type.layout = layout;
+            if (name.size() > 0)
+                returnTy.union_type.name = types.copyString(name);
+        } else {
+            returnTy.type = FFIRefType::STRUCT_REF;
+            returnTy.struct_type.anonymous = rd->isAnonymousStructOrUnion();
+            returnTy.struct_type.members = arena_copy(arena, members);
+            returnTy.struct_type.num_members = members.size();
+            returnTy.struct_type.name = NULL;
+            returnTy.struct_type.defined = defined;
+            returnTy.struct_type.layout = layout;
+            if (name.size() > 0)
+                returnTy.struct_type.name = types.copyString(name);
+        }
+    } else if (qt->isFunctionProtoType()) {
+        const FunctionProtoType *ft = qt->castAs<FunctionProtoType>();
+        std::vector<FFITypeRef *> paramTypes;
+
+        for (size_t i = 0; i < ft->getNumParams(); ++i)
+            paramTypes.push_back(types.get(ft->getParamType(i)));
+
+        returnTy.type = FFIRefType::FUNCTION_REF;
+        returnTy.func_type.return_type = types.get(ft->getReturnType());
+        returnTy.func_type.param_types = types.array(paramTypes);
+        returnTy.func_type.num_params = paramTypes.size();
+    } else if (qt->isFunctionNoProtoType()) {
+        const FunctionNoProtoType *ft = qt->castAs<FunctionNoProtoType>();
+
+        returnTy.type = FFIRefType::FUNCTION_REF;
+        returnTy.func_type.return_type = types.get(ft->getReturnType());
+        returnTy.func_type.param_types = nullptr;
+        returnTy.func_type.num_params = 0;
+    } else if (qt->isConstantArrayType()) {
+        const ConstantArrayType *at = ctx->getAsConstantArrayType(qt);
+
+        returnTy.type = FFIRefType::ARRAY_REF;
+        returnTy.array_type.type = types.get(at->getElementType());
+        returnTy.array_type.size = at->getSize().getZExtValue();
+    } else if (qt->isIncompleteArrayType()) {
+        const IncompleteArrayType *at = ctx->getAsIncompleteArrayType(qt);
+
+        returnTy.type = FFIRefType::FLEX_REF;
+        returnTy.flex_type.type = types.get(at->getElementType());
+    } else if (qt->isBuiltinType()) {
+        const BuiltinType *bt = qt->castAs<BuiltinType>();
+
+        switch (bt->getKind()) {
+        case BuiltinType::Kind::Bool:
+            returnTy.type = FFIRefType::INTEGER_REF;
+            returnTy.int_type.type = FFIIntegerType::Bool;
+            break;
+
+        case BuiltinType::Kind::Char_U:
+        case BuiltinType::Kind::UChar:
+            returnTy.type = FFIRefType::INTEGER_REF;
+            returnTy.int_type.type = FFIIntegerType::UInt8;
+            break;
+
+        case BuiltinType::Kind::Char8:
+        case BuiltinType::Kind::Char_S:
+        case BuiltinType::Kind::SChar:
+            returnTy.type = FFIRefType::INTEGER_REF;
+            returnTy.int_type.type = FFIIntegerType::Int8;
+            break;
+
+        case BuiltinType::Kind::WChar_U:
+        case BuiltinType::Kind::UShort:
+            returnTy.type = FFIRefType::INTEGER_REF;
+            returnTy.int_type.type = FFIIntegerType::UInt16;
+            break;
+
+        case BuiltinType::Kind::WChar_S:
+        case BuiltinType::Kind::Char16:
+        case BuiltinType::Kind::Short:
+            returnTy.type = FFIRefType::INTEGER_REF;
+            returnTy.int_type.type = FFIIntegerType::Int16;
+            break;
+
+        case BuiltinType::Kind::Char32:
+        case BuiltinType::Kind::Int:
+            returnTy.type = FFIRefType::INTEGER_REF;
+            returnTy.int_type.type = FFIIntegerType::Int32;
+            break;
+
+        case BuiltinType::Kind::UInt:
+            returnTy.type = FFIRefType::INTEGER_REF;
+            returnTy.int_type.type = FFIIntegerType::UInt32;
+            break;
+
+        case BuiltinType::Kind::Long:
+        case BuiltinType::Kind::LongLong:
+            returnTy.type = FFIRefType::INTEGER_REF;
+            returnTy.int_type.type = FFIIntegerType::Int64;
+            break;
+
+        case BuiltinType::Kind::ULong:
+        case BuiltinType::Kind::ULongLong:
+            returnTy.type = FFIRefType::INTEGER_REF;
+            returnTy.int_type.type = FFIIntegerType::UInt64;
+            break;
+
+        case BuiltinType::Kind::Int128:
+            returnTy.type = FFIRefType::INTEGER_REF;
+            returnTy.int_type.type = FFIIntegerType::Int128;
+            break;
+
+        case BuiltinType::Kind::Float:
+            returnTy.type = FFIRefType::FLOAT_REF;
+            returnTy.float_type.type = FFIFloatType::Float;
+            break;
+
+        case BuiltinType::Kind::Double:
+            returnTy.type = FFIRefType::FLOAT_REF;
+            returnTy.float_type.type = FFIFloatType::Double;
+            break;
+
+        case BuiltinType::Kind::LongDouble:
+            returnTy.type = FFIRefType::FLOAT_REF;
+            returnTy.float_type.type = FFIFloatType::LongDouble;
+            break;
+        default:
+            fprintf(stderr, "unknown type %s\n", qt.getAsString().c_str());
+            abort();
+        };
+    } else {
+        fprintf(stderr, "unknown type %s\n", qt.getAsString().c_str());
+        abort();
+    }
+
+    return returnTy;
+}
+
+// Returns the return type; the parameter types are copied into the arena, so
+// that like every other node they outlive the callback
+static FFITypeRef *get_types_for_func(FunctionDecl *fd, FFITypeRef *&paramTys, size_t &numParams, TypeCache &types)
+{
+    std::vector<FFITypeRef *> params;
+
+    const FunctionProtoType *ft = fd->getType()->getAs<FunctionProtoType>();
+    if (ft) {
+        for (size_t i = 0; i < ft->getNumParams(); ++i)
+            params.push_back(types.get(ft->getParamType(i)));
+    }
+
+    paramTys = types.array(params);
+    numParams = params.size();
+
+    return types.get(fd->getReturnType());
+}
+
+// Size, alignment and the position of every field of a record, as clang lays
+// it out for the target. fields receives one entry per field, in order.
+static FFIRecordLayout get_record_layout(const RecordDecl *rd, ASTContext &ctx, std::vector<FFIFieldLayout> &fields)
+{
+    FFIRecordLayout layout {};
+
+    rd = rd->getDefinition();
+
+    // Clang can't lay out a record it couldn't make sense of
+    if (!rd || rd->isInvalidDecl())
+        return layout;
+
+    const ASTRecordLayout &rl = ctx.getASTRecordLayout(rd);
+
+    layout.size = rl.getSize().getQuantity();
+    layout.align = rl.getAlignment().getQuantity();
+
+    for (auto f : rd->fields()) {
+        FFIFieldLayout fl {};
+
+        fl.offset = rl.getFieldOffset(f->getFieldIndex());
+
+        if (f->isBitField()) {
+            fl.is_bitfield = 1;
+            fl.bit_width = f->getBitWidthValue(ctx);
+        }
+
+        fields.push_back(fl);
+    }
+
+    layout.fields = fields.empty() ? nullptr : fields.data();
+
+    return layout;
+}
+
+// Orders recorded declarations so that each comes after the records, enums
+// and typedefs its types refer to by name, pointers included. Declarations
+// that refer to each other in a cycle, as mutually recursive records do,
+// form one strongly connected component: they stay together in their
+// original order, share a cycle number and are preceded by forward
+// declarations of the records among them. Everything else keeps its
+// original order as far as the dependencies allow.
+class TopologicalOrder
+{
+public:
+    explicit TopologicalOrder(const std::vector<FFIDecl> &decls) : decls(decls), state(decls.size())
+    {
+        DenseSet<const FFITypeRef *> seen;
+
+        for (size_t i = 0; i < decls.size(); ++i)
+            byName.insert(std::make_pair(key(decls[i].kind, decls[i].name), i));
+
+        // The dependencies of declaration i are edges[firstEdge[i],
+        // firstEdge[i + 1]), found once up front
+        for (size_t i = 0; i < decls.size(); ++i) {
+            firstEdge.push_back(edges.size());
+            seen.clear();
+            dependencies(decls[i], seen, edges);
+        }
+
+        firstEdge.push_back(edges.size());
+    }
+
+    std::vector<FFIDecl> sorted()
+    {
+        for (size_t i = 0; i < decls.size(); ++i) {
+            if (!state[i].visited)
+                visit(i);
+        }
+
+        return std::move(out);
+    }
+
+private:
+    struct State {
+        bool visited = false;
+        bool onStack = false;
+        size_t index = 0;
+        size_t lowlink = 0;
+    };
+
+    struct Frame {
+        size_t decl;
+        size_t edge; // the next of its dependencies to follow
+    };
+
+    // Tarjan's algorithm, which completes each component after every
+    // component it depends on. The path being explored is kept in frames
+    // rather than on the call stack: chains of declarations in generated
+    // headers can run deeper than a worker thread's stack.
+    void visit(size_t root)
+    {
+        enter(root);
+
+        while (!frames.empty()) {
+            Frame &f = frames.back();
+            size_t v = f.decl;
+
+            if (f.edge < firstEdge[v + 1]) {
+                size_t w = edges[f.edge++];
+
+                if (!state[w].visited)
+                    enter(w);
+                else if (state[w].onStack)
+                    state[v].lowlink = std::min(state[v].lowlink, state[w].index);
+                continue;
+            }
+
+            frames.pop_back();
+
+            if (!frames.empty()) {
+                size_t u = frames.back().decl;
+                state[u].lowlink = std::min(state[u].lowlink, state[v].lowlink);
+            }
+
+            if (state[v].lowlink == state[v].index)
+                complete(v);
+        }
+    }
+
+    void enter(size_t v)
+    {
+        state[v].visited = true;
+        state[v].onStack = true;
+        state[v].index = state[v].lowlink = counter++;
+        stack.push_back(v);
+        frames.push_back(Frame { v, firstEdge[v] });
+    }
+
+    // Pops the component v is the root of and appends it to out
+    void complete(size_t v)
+    {
+        std::vector<size_t> component;
+        size_t w;
+
+        do {
+            w = stack.back();
+            stack.pop_back();
+            state[w].onStack = false;
+            component.push_back(w);
+        } while (w != v);
+
+        std::sort(component.begin(), component.end());
+
+        // A declaration referring only to itself, like a list node, needs
+        // no forward declaration
+        int cycle = component.size() > 1 ? ++cycles : 0;
+
+        for (size_t c : component) {
+            const FFIDecl &d = decls[c];
+
+            // One recorded already comes before the record; see dependencies
+            if (!cycle || (d.kind != STRUCT_DECL && d.kind != UNION_DECL) || byName.count(key(FORWARD_DECL, d.name)))
+                continue;
+
+            FFIDecl forward {};
+            forward.kind = FORWARD_DECL;
+            forward.name = d.name;
+            forward.flag = d.kind == UNION_DECL ? UNION : STRUCT;
+            forward.cycle = cycle;
+            out.push_back(forward);
+        }
+
+        for (size_t c : component) {
+            out.push_back(decls[c]);
+            out.back().cycle = cycle;
+        }
+    }
+
+    void dependencies(const FFIDecl &d, DenseSet<const FFITypeRef *> &seen, std::vector<size_t> &deps)
+    {
+        // A record follows its own forward declaration, which then serves
+        // any cycle the record is in
+        if (d.kind == STRUCT_DECL || d.kind == UNION_DECL)
+            dependOn(FORWARD_DECL, d.name, deps);
+
+        if (d.type)
+            refer(d.type, seen, deps);
+
+        for (size_t i = 0; d.types && i < d.count; ++i)
+            refer(&d.types[i], seen, deps);
+    }
+
+    // Named types t refers to, looking through pointers, arrays, functions
+    // and anonymous records. Named records and typedefs end the search, so
+    // the recursion only goes as deep as a single type is nested.
+    void refer(const FFITypeRef *t, DenseSet<const FFITypeRef *> &seen, std::vector<size_t> &deps)
+    {
+        if (!seen.insert(t).second)
+            return;
+
+        // A tag spelling names the record or enum itself, even when a
+        // typedef shares its name
+        if (t->qual_name && !isTagSpelling(t->qual_name))
+            dependOn(TYPEDEF_DECL, t->qual_name, deps);
+
+        switch (t->type) {
+        case FFIRefType::ENUM_REF:
+            if (t->enum_type.name)
+                dependOn(ENUM_DECL, t->enum_type.name, deps);
+            break;
+        case FFIRefType::STRUCT_REF:
+        case FFIRefType::UNION_REF: {
+            // The two record layouts are identical
+            const FFIStructRef &r = t->type == FFIRefType::STRUCT_REF ? t->struct_type : reinterpret_cast<const FFIStructRef &>(t->union_type);
+
+            for (size_t m = 0; m < r.num_members; ++m)
+                refer(r.members[m].type, seen, deps);
+
+            // Refer to the definition, or failing that a forward declaration
+            if (r.name && !dependOn(t->type == FFIRefType::STRUCT_REF ? STRUCT_DECL : UNION_DECL, r.name, deps))
+                dependOn(FORWARD_DECL, r.name, deps);
+            break;
+        }
+        case FFIRefType::FUNCTION_REF:
+            refer(t->func_type.return_type, seen, deps);
+
+            for (size_t p = 0; p < t->func_type.num_params; ++p)
+                refer(&t->func_type.param_types[p], seen, deps);
+            break;
+        case FFIRefType::POINTER_REF:
+            refer(t->point_type.pointed_type, seen, deps);
+            break;
+        case FFIRefType::ARRAY_REF:
+            refer(t->array_type.type, seen, deps);
+            break;
+        case FFIRefType::FLEX_REF:
+            refer(t->flex_type.type, seen, deps);
+            break;
+        case FFIRefType::INTEGER_REF:
+        case FFIRefType::FLOAT_REF:
+        case FFIRefType::VOID_REF:
+            break;
+        }
+    }
+
+    bool dependOn(FFIDeclKind kind, StringRef name, std::vector<size_t> &deps)
+    {
+        auto i = byName.find(key(kind, name));
+
+        if (i == byName.end())
+            return false;
+
+        deps.push_back(i->second);
+        return true;
+    }
+
+    static bool isTagSpelling(StringRef name)
+    {
+        while (name.consume_front("const ") || name.consume_front("volatile "))
+            ;
+
+        return name.startswith("struct ") || name.startswith("union ") || name.startswith("enum ");
+    }
+
+    // Type names are spelled with qualifiers and tags that declaration
+    // names don't have
+    static std::string key(FFIDeclKind kind, StringRef name)
+    {
+        for (StringRef prefix : { "const ", "volatile ", "struct ", "union ", "enum " })
+            name.consume_front(prefix);
+
+        return std::string(1, '0' + kind) + name.str();
+    }
+
+    const std::vector<FFIDecl> &decls;
+    StringMap<size_t> byName; // the first declaration of each kind and name
+    std::vector<State> state;
+    std::vector<size_t> firstEdge;
+    std::vector<size_t> edges;
+    std::vector<Frame> frames; // the path from the declaration visit started at
+    std::vector<size_t> stack;
+    std::vector<FFIDecl> out;
+    size_t counter = 0;
+    int cycles = 0;
+};
+
+// Buffers the callbacks of one walk so they can be delivered later from
+// another thread. Strings and arrays are copied into the walk's arena; the
+// type nodes, and the arrays of parameter and member types, already live
+// there.
+class Recording
+{
+public:
+    typedef FFIDecl Event;
+
+    Recording(BumpPtrAllocator &arena, FFIGenStats &stats) : arena(arena), stats(stats) {}
+
+    callbacks sink()
+    {
+        callbacks c;
+
+        c.mc = record_macro;
+        c.tc = record_typedef;
+        c.fc = record_function;
+        c.ec = record_enum;
+        c.sc = record_struct;
+        c.uc = record_union;
+        c.vc = record_variable;
+        c.fdc = record_forward;
+        c.user_data = this;
+        c.bc = nullptr;
+
+        return c;
+    }
+
+    // Hands the events to the callbacks, batchSize at a time through bc if
+    // that is set, counting and timing every call in calls
+    void replay(callbacks &c, size_t batchSize, FFIGenStats &calls) const
+    {
+        replay(0, events.size(), c, batchSize, calls);
+    }
+
+    // replay, of the events in [begin, end) only
+    void replay(size_t begin, size_t end, callbacks &c, size_t batchSize, FFIGenStats &calls) const
+    {
+        if (batchSize && c.bc) {
+            for (size_t i = begin; i < end; i += batchSize) {
+                CallTimer call { calls, "batch" };
+
+                c.bc(&events[i], std::min(batchSize, end - i), c.user_data);
+            }
+
+            return;
+        }
+
+        for (size_t i = begin; i < end; ++i) {
+            const Event &e = events[i];
+            CallTimer call { calls, e.name };
+
+            current_cycle = e.cycle;
+
+            switch (e.kind) {
+            case MACRO_DECL:
+                c.mc(e.name, e.definition, e.value, c.user_data);
+                break;
+            case TYPEDEF_DECL:
+                c.tc(e.name, e.type, c.user_data);
+                break;
+            case FUNCTION_DECL:
+                c.fc(e.name, e.type, e.types, e.count, c.user_data);
+                break;
+            case ENUM_DECL:
+                c.ec(e.name, e.names, e.values, e.count, c.user_data);
+                break;
+            case STRUCT_DECL:
+                c.sc(e.name, e.types, e.names, e.count, e.flag, e.layout, c.user_data);
+                break;
+            case UNION_DECL:
+                c.uc(e.name, e.types, e.names, e.count, e.flag, e.layout, c.user_data);
+                break;
+            case VARIABLE_DECL:
+                if (c.vc)
+                    c.vc(e.name, e.type, c.user_data);
+                break;
+            case FORWARD_DECL:
+                c.fdc(e.name, static_cast<FFIForwardType>(e.flag), c.user_data);
+                break;
+            }
+        }
+
+        current_cycle = 0;
+    }
+
+    const std::vector<Event> &getEvents() const
+    {
+        return events;
+    }
+
+    // Puts every declaration after those it depends on; see TopologicalOrder
+    void sortTopologically()
+    {
+        events = TopologicalOrder { events }.sorted();
+    }
+
+    void append(const Event &e)
+    {
+        events.push_back(e);
+    }
+
+    // Removes the events at positions, given in ascending order
+    void drop(const std::vector<size_t> &positions)
+    {
+        size_t kept = 0;
+        auto p = positions.begin();
+
+        for (size_t i = 0; i < events.size(); ++i) {
+            if (p != positions.end() && *p == i)
+                ++p;
+            else
+                events[kept++] = events[i];
+        }
+
+        events.resize(kept);
+    }
+
+private:
+
+    const char *copy(const char *str)
+    {
+        StringRef s { str };
+
+        stats.string_bytes += s.size() + 1;
+        return arena_strdup(arena, s);
+    }
+
+    template <typename T>
+    T *copy(const T *items, size_t n)
+    {
+        return arena_copy(arena, std::vector<T>(items, items + n));
+    }
+
+    const FFIMacroValue *copy(const FFIMacroValue *value)
+    {
+        FFIMacroValue *ret = new (arena.Allocate<FFIMacroValue>()) FFIMacroValue { *value };
+
+        if (value->string) {
+            char *str = arena.Allocate<char>(value->string_size + 1);
+
+            stats.string_bytes += value->string_size + 1;
+
+            std::copy(value->string, value->string + value->string_size + 1, str);
+            ret->string = str;
+        }
+
+        return ret;
+    }
+
+    const FFIRecordLayout *copy(const FFIRecordLayout *layout, size_t numFields)
+    {
+        FFIRecordLayout *ret = new (arena.Allocate<FFIRecordLayout>()) FFIRecordLayout { *layout };
+
+        ret->fields = layout->fields ? copy(layout->fields, numFields) : nullptr;
+
+        return ret;
+    }
+
+    const char **copy(const char **strs, size_t n)
+    {
+        std::vector<const char *> ret;
+
+        for (size_t i = 0; i < n; ++i)
+            ret.push_back(copy(strs[i]));
+
+        return arena_copy(arena, ret);
+    }
+
+    static Recording &self(void *data)
+    {
+        return *static_cast<Recording *>(data);
+    }
+
+    static void record_macro(const char *name, const char *definition, const FFIMacroValue *value, void *data)
+    {
+        Event e {};
+        e.kind = MACRO_DECL;
+        e.name = self(data).copy(name);
+        e.definition = self(data).copy(definition);
+        e.value = self(data).copy(value);
+        self(data).events.push_back(e);
+    }
+
+    static void record_typedef(const char *name, FFITypeRef *to, void *data)
+    {
+        Event e {};
+        e.kind = TYPEDEF_DECL;
+        e.name = self(data).copy(name);
+        e.type = to;
+        self(data).events.push_back(e);
+    }
+
+    static void record_function(const char *name, FFITypeRef *return_type, FFITypeRef *param_types, size_t num_params, void *data)
+    {
+        Event e {};
+        e.kind = FUNCTION_DECL;
+        e.name = self(data).copy(name);
+        e.type = return_type;
+        e.types = param_types;
+        e.count = num_params;
+        self(data).events.push_back(e);
+    }
+
+    static void record_enum(const char *name, const char **member_names, int64_t *member_values, size_t num_members, void *data)
+    {
+        Event e {};
+        e.kind = ENUM_DECL;
+        e.name = self(data).copy(name);
+        e.names = self(data).copy(member_names, num_members);
+        e.values = self(data).copy(member_values, num_members);
+        e.count = num_members;
+        self(data).events.push_back(e);
+    }
+
+    static void record_record(FFIDeclKind kind, const char *name, FFITypeRef *member_types, const char **member_names, size_t num_members, int defined, const FFIRecordLayout *layout, void *data)
+    {
+        Event e {};
+        e.kind = kind;
+        e.name = self(data).copy(name);
+        e.types = member_types;
+        e.names = self(data).copy(member_names, num_members);
+        e.count = num_members;
+        e.flag = defined;
+        e.layout = self(data).copy(layout, num_members);
+        self(data).events.push_back(e);
+    }
+
+    static void record_struct(const char *name, FFITypeRef *member_types, const char **member_names, size_t num_members, int defined, const FFIRecordLayout *layout, void *data)
+    {
+        record_record(STRUCT_DECL, name, member_types, member_names, num_members, defined, layout, data);
+    }
+
+    static void record_union(const char *name, FFITypeRef *member_types, const char **member_names, size_t num_members, int defined, const FFIRecordLayout *layout, void *data)
+    {
+        record_record(UNION_DECL, name, member_types, member_names, num_members, defined, layout, data);
+    }
+
+    static void record_variable(const char *name, FFITypeRef *type, void *data)
+    {
+        Event e {};
+        e.kind = VARIABLE_DECL;
+        e.name = self(data).copy(name);
+        e.type = type;
+        self(data).events.push_back(e);
+    }
+
+    static void record_forward(const char *name, FFIForwardType type, void *data)
+    {
+        Event e {};
+        e.kind = FORWARD_DECL;
+        e.name = self(data).copy(name);
+        e.flag = type;
+        self(data).events.push_back(e);
+    }
+
+    BumpPtrAllocator &arena;
+    FFIGenStats &stats;
+    std::vector<Event> events;
+};
+
+// Stands in for the index shared by the files of walk_files while one of
+// them is parsed: every claim is granted, and noted against the event the
+// recording gets next, until settle makes them on the shared index.
+class DeferredIndex : public ffi_gen_index
+{
+public:
+    DeferredIndex(ffi_gen_index &shared, Recording &recording) : shared(shared), recording(recording) {}
+
+    virtual Claim claim(FFIDeclKind kind, StringRef usr, StringRef signature)
+    {
+        claims.push_back(Deferred { recording.getEvents().size(), kind, usr.str(), signature.str() });
+        return FIRST;
+    }
+
+    // Claims on the shared index, in the order they were made, and drops
+    // the events of those another walk got first
+    void settle(FFIGenStats &stats, const std::string &filename)
+    {
+        std::vector<size_t> dropped;
+
+        for (auto &c : claims) {
+            // A walk stopped right after claiming reported nothing
+            if (c.event >= recording.getEvents().size())
+                break;
+
+            Claim claim = shared.claim(c.kind, c.usr, c.signature);
+
+            if (claim == FIRST)
+                continue;
+
+            if (claim == CONFLICT) {
+                fprintf(stderr, "ffi_gen: %s: %s differs from the declaration already reported\n", filename.c_str(), c.usr.c_str());
+                ++stats.decls_conflict;
+            } else {
+                ++stats.decls_repeated;
+            }
+
+            if (c.kind == MACRO_DECL)
+                --stats.macros_emitted;
+
+            --stats.decls_emitted;
+            dropped.push_back(c.event);
+        }
+
+        recording.drop(dropped);
+        claims.clear();
+    }
+
+private:
+    struct Deferred {
+        size_t event; // the position of the event reported once claimed
+        FFIDeclKind kind;
+        std::string usr;
+        std::string signature;
+    };
+
+    ffi_gen_index &shared;
+    Recording &recording;
+    std::vector<Deferred> claims;
+};
+
+// Hands the turn to claim on a shared index from one file of walk_files to
+// the next, in file order
+class ClaimOrder
+{
+public:
+    void wait(int unit)
+    {
+        std::unique_lock<std::mutex> guard { lock };
+        turn.wait(guard, [&] { return next == unit; });
+    }
+
+    void pass()
+    {
+        std::lock_guard<std::mutex> guard { lock };
+        ++next;
+        turn.notify_all();
+    }
+
+private:
+    std::mutex lock;
+    std::condition_variable turn;
+    int next = 0;
+};
+
+// The turn of one file. It is still taken and passed on if the file never
+// claims anything, so that later files aren't kept waiting.
+class ClaimTurn
+{
+public:
+    ClaimTurn(ClaimOrder *order, int unit) : order(order), unit(unit) {}
+
+    ~ClaimTurn()
+    {
+        take();
+        release();
+    }
+
+    void take()
+    {
+        if (order && !taken)
+            order->wait(unit);
+
+        taken = true;
+    }
+
+    void release()
+    {
+        if (order && taken)
+            order->pass();
+
+        order = nullptr;
+    }
+
+private:
+    ClaimOrder *order; // NULL once the turn is passed on, or without an order
+    int unit;
+    bool taken = false;
+};
+
+// Digests of recorded declarations, covering every type, layout and value
+// they report, so that declarations from different walks can be compared.
+// Type nodes are shared within a walk, so their digests are kept per node.
+class DeclDigest
+{
+public:
+    MD5::MD5Result decl(const Recording::Event &e)
+    {
+        MD5 md5;
+
+        add(md5, e.kind);
+        string(md5, e.name);
+        string(md5, e.definition);
+        add(md5, e.flag);
+        add(md5, e.count);
+
+        if (e.value) {
+            add(md5, e.value->type);
+            add(md5, e.value->is_unsigned);
+            add(md5, e.value->integer);
+            add(md5, e.value->floating);
+            md5.update(StringRef { e.value->string ? e.value->string : "", e.value->string_size });
+        }
+
+        if (e.type)
+            add(md5, type(e.type));
+
+        for (size_t i = 0; i < e.count; ++i) {
+            if (e.types)
+                add(md5, type(&e.types[i]));
+            if (e.names)
+                string(md5, e.names[i]);
+            if (e.values)
+                add(md5, e.values[i]);
+        }
+
+        if (e.layout)
+            layout(md5, *e.layout, e.count);
+
+        MD5::MD5Result ret;
+        md5.final(ret);
+
+        return ret;
+    }
+
+private:
+    MD5::MD5Result type(const FFITypeRef *t)
+    {
+        auto i = types.find(t);
+        if (i != types.end())
+            return i->second;
+
+        MD5 md5;
+
+        add(md5, t->type);
+        string(md5, t->qual_name);
+
+        switch (t->type) {
+        case FFIRefType::ENUM_REF:
+            string(md5, t->enum_type.name);
+            add(md5, t->enum_type.anonymous);
+            break;
+        case FFIRefType::STRUCT_REF:
+        case FFIRefType::UNION_REF: {
+            // The two record layouts are identical
+            const FFIStructRef &r = t->type == FFIRefType::STRUCT_REF ? t->struct_type : reinterpret_cast<const FFIStructRef &>(t->union_type);
+
+            string(md5, r.name);
+            add(md5, r.anonymous);
+            add(md5, r.defined);
+            add(md5, r.num_members);
+
+            for (size_t m = 0; m < r.num_members; ++m) {
+                string(md5, r.members[m].name);
+                add(md5, type(r.members[m].type));
+            }
+
+            layout(md5, r.layout, r.num_members);
+            break;
+        }
+        case FFIRefType::FUNCTION_REF:
+            add(md5, type(t->func_type.return_type));
+            add(md5, t->func_type.num_params);
+
+            for (size_t p = 0; p < t->func_type.num_params; ++p)
+                add(md5, type(&t->func_type.param_types[p]));
+            break;
+        case FFIRefType::INTEGER_REF:
+            add(md5, t->int_type.type);
+            break;
+        case FFIRefType::FLOAT_REF:
+            add(md5, t->float_type.type);
+            break;
+        case FFIRefType::POINTER_REF:
+            add(md5, type(t->point_type.pointed_type));
+            break;
+        case FFIRefType::ARRAY_REF:
+            add(md5, type(t->array_type.type));
+            add(md5, t->array_type.size);
+            break;
+        case FFIRefType::FLEX_REF:
+            add(md5, type(t->flex_type.type));
+            break;
+        case FFIRefType::VOID_REF:
+            break;
+        }
+
+        MD5::MD5Result ret;
+        md5.final(ret);
+
+        return types[t] = ret;
+    }
+
+    static void layout(MD5 &md5, const FFIRecordLayout &l, size_t numFields)
+    {
+        add(md5, l.size);
+        add(md5, l.align);
+
+        for (size_t f = 0; l.fields && f < numFields; ++f) {
+            add(md5, l.fields[f].offset);
+            add(md5, l.fields[f].bit_width);
+            add(md5, l.fields[f].is_bitfield);
+        }
+    }
+
+    // Fields are added one at a time, as structs have padding
+    template <typename T>
+    static void add(MD5 &md5, const T &value)
+    {
+        md5.update(ArrayRef<uint8_t> { reinterpret_cast<const uint8_t *>(&value), sizeof(value) });
+    }
+
+    // Tells NULL from "", and keeps consecutive strings apart
+    static void string(MD5 &md5, const char *str)
+    {
+        add(md5, str != nullptr);
+
+        if (str)
+            md5.update(ArrayRef<uint8_t> { reinterpret_cast<const uint8_t *>(str), std::strlen(str) + 1 });
+    }
+
+    static void add(MD5 &md5, const MD5::MD5Result &digest)
+    {
+        md5.update(ArrayRef<uint8_t> { digest.Bytes.data(), digest.Bytes.size() });
+    }
+
+    DenseMap<const FFITypeRef *, MD5::MD5Result> types;
+};
+
+// The declarations recorded for each target of walk_targets, lined up: every
+// variant of a declaration, by kind and name, with the targets that report
+// it exactly so. Each variant is delivered from the recording of the first
+// target reporting it.
+class TargetMerge
+{
+public:
+    struct Variant {
+        int unit;
+        size_t event;
+        uint64_t targets;
+        MD5::MD5Result digest;
+    };
+
+    // Adds the declarations of target unit, in order, after those of any
+    // target added before
+    void add(int unit, const Recording &recording)
+    {
+        DeclDigest digests;
+        const std::vector<Recording::Event> &events = recording.getEvents();
+
+        for (size_t i = 0; i < events.size(); ++i) {
+            SmallString<128> key;
+
+            key.push_back('0' + events[i].kind);
+            key.append(events[i].name);
+
+            auto slot = index.insert(std::make_pair(key.str(), decls.size()));
+
+            if (slot.second)
+                decls.emplace_back();
+
+            std::vector<Variant> &variants = decls[slot.first->second];
+            MD5::MD5Result digest = digests.decl(events[i]);
+            auto same = std::find_if(variants.begin(), variants.end(), [&](const Variant &v) { return v.digest == digest; });
+
+            if (same != variants.end()) {
+                same->targets |= uint64_t { 1 } << unit;
+                ++merged;
+            } else {
+                variants.push_back(Variant { unit, i, uint64_t { 1 } << unit, digest });
+            }
+        }
+    }
+
+    // Copies of declarations left out for being identical to another
+    // target's
+    size_t numMerged() const
+    {
+        return merged;
+    }
+
+    // Hands every variant to c on this thread. Runs of consecutive events
+    // of one recording that stand for the same targets go out together, so
+    // batching still applies.
+    void deliver(ffi_gen_result &result, callbacks &c, size_t batchSize) const
+    {
+        std::vector<const Variant *> order;
+
+        for (auto &variants : decls) {
+            for (auto &v : variants)
+                order.push_back(&v);
+        }
+
+        for (size_t i = 0; i < order.size();) {
+            const Variant &first = *order[i];
+            size_t n = 1;
+
+            while (i + n < order.size() && order[i + n]->unit == first.unit && order[i + n]->targets == first.targets
+                   && order[i + n]->event == first.event + n)
+                ++n;
+
+            ffi_gen_result &unit = *result.units[first.unit];
+
+            current_unit = first.unit;
+            current_result = &unit;
+            current_targets = first.targets;
+            unit.recording->replay(first.event, first.event + n, c, batchSize, unit.stats);
+
+            i += n;
+        }
+
+        current_unit = -1;
+        current_result = nullptr;
+        current_targets = 0;
+    }
+
+private:
+    StringMap<size_t> index; // into decls
+    std::vector<std::vector<Variant> > decls;
+    size_t merged = 0;
+};
+
+// Writes a PCH of the forced -include prefix and remembers every file that
+// went into it, so the cache can tell when the PCH has gone stale.
+class BuildPreambleAction : public GeneratePCHAction
+{
+public:
+    BuildPreambleAction(const std::string &output, std::vector<std::string> &deps) : output(output), deps(deps) {}
+
+protected:
+    virtual bool BeginInvocation(CompilerInstance &CI)
+    {
+        CI.getFrontendOpts().OutputFile = output;
+
+        return GeneratePCHAction::BeginInvocation(CI);
+    }
+
+    virtual void EndSourceFileAction()
+    {
+        SourceManager &sm = getCompilerInstance().getSourceManager();
+
+        for (auto i = sm.fileinfo_begin(); i != sm.fileinfo_end(); ++i) {
+            const FileEntry *f = i->first;
+
+            deps.push_back(std::to_string(f->getModificationTime()) + " " + std::to_string(f->getSize()) + " " + f->getName().str());
+        }
+
+        GeneratePCHAction::EndSourceFileAction();
+    }
+
+private:
+    std::string output;
+    std::vector<std::string> &deps;
+};
+
+// A preamble is fresh while its PCH exists and none of the files that went
+// into it has changed; paths gets every one of those files
+static bool preamble_is_fresh(const std::string &depsPath, const std::string &pchPath, std::vector<std::string> &paths)
+{
+    std::ifstream deps { depsPath };
+    std::string line;
+    bool any = false;
+
+    if (!sys::fs::exists(pchPath))
+        return false;
+
+    while (std::getline(deps, line)) {
+        std::istringstream fields { line };
+        time_t mtime;
+        uint64_t size;
+        std::string path;
+        sys::fs::file_status st;
+
+        fields >> mtime >> size;
+        std::getline(fields >> std::ws, path);
+
+        if (sys::fs::status(path, st) || sys::toTimeT(st.getLastModificationTime()) != mtime || st.getSize() != size)
+            return false;
+
+        paths.push_back(path);
+        any = true;
+    }
+
+    return any;
+}
+
+// Whether a requested source went into the preamble. Its macros would then
+// never reach the PPCallbacks, and its include guard would hide its
+// declarations, so the walk has to parse without the PCH.
+static bool preamble_has_source(const std::vector<std::string> &paths, const std::vector<std::string> &sources)
+{
+    for (auto &p : paths)
+        for (auto &f : sources)
+            if (sys::fs::equivalent(p, f))
+                return true;
+
+    return false;
+}
+
+static std::mutex preamble_lock;
+
+// Replaces the -include prefix of args with a PCH kept in cacheDir, building
+// it on first use. The PCH is keyed on the clang version, the working
+// directory and the exact argument set, and rebuilt when any header that went
+// into it has changed. Returns args untouched if there is nothing to
+// precompile or the PCH can't be built; otherwise depsOut names the file
+// listing the PCH's inputs.
+static std::vector<std::string> preamble_args(const std::vector<std::string> &args, const std::vector<std::string> &sources, const char *cacheDir, std::string &depsOut)
+{
+    std::vector<std::string> baseArgs;
+    std::vector<std::string> includes;
+
+    if (!cacheDir)
+        return args;
+
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "-include" && i + 1 < args.size())
+            includes.push_back(args[++i]);
+        else
+            baseArgs.push_back(args[i]);
+    }
+
+    if (includes.empty())
+        return args;
+
+    // Macros from a PCH are never reported to the PPCallbacks, so a forced
+    // include that is also a requested source has to be parsed for real
+    for (auto &inc : includes)
+        for (auto &f : sources)
+            if (f == inc || StringRef { f }.endswith("/" + inc))
+                return args;
+
+    SmallString<128> cwd;
+    MD5 hash;
+    MD5::MD5Result digest;
+
+    sys::fs::current_path(cwd);
+    hash.update(getClangFullVersion());
+    hash.update(cwd.str());
+
+    for (auto &a : baseArgs) {
+        hash.update(a);
+        hash.update(StringRef { "\0", 1 });
+    }
+
+    for (auto &inc : includes) {
+        hash.update("-include");
+        hash.update(inc);
+        hash.update(StringRef { "\0", 1 });
+    }
+
+    hash.final(digest);
+
+    SmallString<128> base { StringRef { cacheDir } };
+    sys::path::append(base, Twine { "preamble-" } + digest.digest());
+
+    std::string headerPath = base.str().str() + ".h";
+    std::string pchPath = base.str().str() + ".pch";
+    std::string depsPath = base.str().str() + ".deps";
+    std::vector<std::string> ret { baseArgs };
+
+    ret.push_back("-include-pch");
+    ret.push_back(pchPath);
+
+    std::lock_guard<std::mutex> guard { preamble_lock };
+    std::vector<std::string> depPaths;
+
+    if (preamble_is_fresh(depsPath, pchPath, depPaths)) {
+        if (preamble_has_source(depPaths, sources))
+            return args;
+
+        depsOut = depsPath;
+        return ret;
+    }
+
+    if (sys::fs::create_directories(cacheDir))
+        return args;
+
+    {
+        std::ofstream header { headerPath };
+
+        for (auto &inc : includes)
+            header << "#include \"" << inc << "\"\n";
+    }
+
+    std::vector<std::string> deps;
+    std::vector<std::string> commandLine { "ffi_gen", "-fsyntax-only" };
+    FileManager files { FileSystemOptions {} };
+
+    commandLine.insert(commandLine.end(), baseArgs.begin(), baseArgs.end());
+    commandLine.push_back(headerPath);
+
+    ToolInvocation invocation { commandLine, new BuildPreambleAction { pchPath, deps }, &files };
+    TraceSpan span { "preamble", pchPath };
+
+    if (!invocation.run() || deps.empty())
+        return args;
+
+    // Only written once the PCH is in place, so a crash half way through
+    // leaves a preamble that is simply rebuilt next time
+    std::string tmpPath = depsPath + ".tmp";
+    {
+        std::ofstream out { tmpPath };
+
+        for (auto &d : deps)
+            out << d << "\n";
+    }
+
+    if (sys::fs::rename(tmpPath, depsPath) || !preamble_is_fresh(depsPath, pchPath, depPaths) || preamble_has_source(depPaths, sources))
+        return args;
+
+    depsOut = depsPath;
+
+    return ret;
+}
+
+// Clang arguments shared by every file of a walk. The preamble is only
+// prepared once some file actually has to be parsed.
+class WalkArgs
+{
+public:
+    WalkArgs(const std::vector<std::string> &args, const std::vector<std::string> &sources, const char *cacheDir)
+        : args(args), sources(sources), cacheDir(cacheDir) {}
+
+    const std::vector<std::string> &original() const
+    {
+        return args;
+    }
+
+    const std::vector<std::string> &forTool()
+    {
+        std::call_once(prepared, [this] { toolArgs = preamble_args(args, sources, cacheDir, preambleDepsPath); });
+
+        return toolArgs;
+    }
+
+    // Empty unless the walk uses a preamble
+    const std::string &preambleDeps()
+    {
+        forTool();
+
+        return preambleDepsPath;
+    }
+
+private:
+    std::vector<std::string> args;
+    std::vector<std::string> sources;
+    const char *cacheDir;
+    std::once_flag prepared;
+    std::vector<std::string> toolArgs;
+    std::string preambleDepsPath;
+};
+
+static bool hash_file(const std::string &path, uint8_t (&md5)[16])
+{
+    auto buffer = MemoryBuffer::getFile(path);
+    MD5 hash;
+    MD5::MD5Result digest;
+
+    if (!buffer)
+        return false;
+
+    hash.update((*buffer)->getBuffer());
+    hash.final(digest);
+    std::copy(digest.Bytes.begin(), digest.Bytes.end(), md5);
+
+    return true;
+}
+
+// Flattens a Recording and the include graph of its TU into the cache layout
+class SnapshotWriter
+{
+public:
+    void addFile(const std::string &path)
+    {
+        FFISnapshotFile f {};
+        sys::fs::file_status st;
+
+        if (fileIndex.count(path))
+            return;
+
+        f.path = string(path.c_str());
+
+        if (!sys::fs::status(path, st)) {
+            f.size = st.getSize();
+            f.mtime = sys::toTimeT(st.getLastModificationTime());
+        }
+
+        if (!hash_file(path, f.md5))
+            valid = false;
+
+        fileIndex[path] = files.size();
+        files.push_back(f);
+    }
+
+    void addInclude(const std::string &includer, const std::string &included)
+    {
+        includes.push_back(FFISnapshotInclude { fileIndex[includer], fileIndex[included] });
+    }
+
+    // Parameters and members are written as the nodes they copy, as listed
+    // in unitCopies for the result e came from
+    void addDecl(const Recording::Event &e, const TypeCopies &unitCopies)
+    {
+        copies = &unitCopies;
+
+        FFISnapshotDecl d {};
+
+        d.kind = e.kind;
+        d.name = string(e.name);
+        d.text = string(e.definition);
+        d.type = e.type ? type(e.type) : SNAPSHOT_NO_INDEX;
+        d.flags = e.flag;
+        d.count = e.count;
+
+        if (e.kind == ENUM_DECL) {
+            d.first = enumerators.size();
+
+            for (size_t i = 0; i < e.count; ++i)
+                enumerators.push_back(FFISnapshotEnumerator { string(e.names[i]), 0, e.values[i] });
+        } else if (e.types) {
+            d.first = memberList(e.types, e.names, e.count, nullptr, e.layout ? e.layout->fields : nullptr);
+        }
+
+        if (e.layout) {
+            d.size = e.layout->size;
+            d.align = e.layout->align;
+        }
+
+        if (e.kind == MACRO_DECL && e.value) {
+            d.value_type = e.value->type;
+            d.flags = e.value->is_unsigned ? SNAPSHOT_UNSIGNED : 0;
+
+            if (e.value->type == MACRO_FLOAT)
+                std::memcpy(&d.value, &e.value->floating, sizeof(d.value));
+            else
+                d.value = static_cast<uint64_t>(e.value->integer);
+
+            if (e.value->type == MACRO_STRING) {
+                d.value_string = bytes(StringRef { e.value->string, e.value->string_size });
+                d.value_size = e.value->string_size;
+            }
+        }
+
+        decls.push_back(d);
+    }
+
+    bool write(const std::string &path)
+    {
+        FFISnapshotHeader h {};
+        std::error_code ec;
+        std::string tmpPath = path + ".tmp";
+        uint64_t offset = sizeof(h);
+
+        if (!valid)
+            return false;
+
+        std::copy(FFI_SNAPSHOT_MAGIC, FFI_SNAPSHOT_MAGIC + sizeof(h.magic), h.magic);
+        h.version = FFI_SNAPSHOT_VERSION;
+        h.strings = section(offset, strings.size(), 1);
+        h.files = section(offset, files.size(), sizeof(FFISnapshotFile));
+        h.includes = section(offset, includes.size(), sizeof(FFISnapshotInclude));
+        h.types = section(offset, types.size(), sizeof(FFISnapshotType));
+        h.members = section(offset, members.size(), sizeof(FFISnapshotMember));
+        h.enumerators = section(offset, enumerators.size(), sizeof(FFISnapshotEnumerator));
+        h.decls = section(offset, decls.size(), sizeof(FFISnapshotDecl));
+
+        {
+            raw_fd_ostream out { tmpPath, ec, sys::fs::F_None };
+
+            if (ec)
+                return false;
+
+            out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+            writeSection(out, strings.data(), strings.size());
+            writeSection(out, files.data(), files.size() * sizeof(FFISnapshotFile));
+            writeSection(out, includes.data(), includes.size() * sizeof(FFISnapshotInclude));
+            writeSection(out, types.data(), types.size() * sizeof(FFISnapshotType));
+            writeSection(out, members.data(), members.size() * sizeof(FFISnapshotMember));
+            writeSection(out, enumerators.data(), enumerators.size() * sizeof(FFISnapshotEnumerator));
+            writeSection(out, decls.data(), decls.size() * sizeof(FFISnapshotDecl));
+
+            if (out.has_error()) {
+                out.clear_error();
+                return false;
+            }
+        }
+
+        return !sys::fs::rename(tmpPath, path);
+    }
+
+private:
+    uint32_t string(const char *str)
+    {
+        if (!str)
+            return SNAPSHOT_NO_INDEX;
+
+        auto i = stringIndex.find(str);
+        if (i != stringIndex.end())
+            return i->second;
+
+        uint32_t offset = strings.size();
+
+        strings.append(str);
+        strings.push_back('\0');
+        stringIndex[str] = offset;
+
+        return offset;
+    }
+
+    // Unlike string(), keeps embedded NULs and is not shared
+    uint32_t bytes(StringRef data)
+    {
+        uint32_t offset = strings.size();
+
+        strings.append(data.begin(), data.end());
+        strings.push_back('\0');
+
+        return offset;
+    }
+
+    uint32_t type(const FFITypeRef *t)
+    {
+        auto copy = copies->find(t);
+        if (copy != copies->end())
+            t = copy->second;
+
+        auto i = typeIndex.find(t);
+        if (i != typeIndex.end())
+            return i->second;
+
+        uint32_t index = types.size();
+        FFISnapshotType ct {};
+
+        // Reserve the slot first so that children always come after their
+        // parent and shared nodes stay shared
+        types.push_back(ct);
+        typeIndex[t] = index;
+
+        ct.kind = t->type;
+        ct.qual_name = string(t->qual_name);
+        ct.name = SNAPSHOT_NO_INDEX;
+        ct.child = SNAPSHOT_NO_INDEX;
+
+        switch (t->type) {
+        case FFIRefType::ENUM_REF:
+            ct.name = string(t->enum_type.name);
+            ct.flags = t->enum_type.anonymous ? SNAPSHOT_ANONYMOUS : 0;
+            break;
+        case FFIRefType::STRUCT_REF:
+        case FFIRefType::UNION_REF: {
+            // The two record layouts are identical
+            const FFIStructRef &r = t->type == FFIRefType::STRUCT_REF ? t->struct_type : reinterpret_cast<const FFIStructRef &>(t->union_type);
+            std::vector<const char *> memberNames;
+
+            for (size_t m = 0; m < r.num_members; ++m)
+                memberNames.push_back(r.members[m].name);
+
+            ct.name = string(r.name);
+            ct.flags = (r.anonymous ? SNAPSHOT_ANONYMOUS : 0) | (r.defined ? SNAPSHOT_DEFINED : 0);
+            ct.count = r.num_members;
+            ct.first = memberList(nullptr, memberNames.data(), r.num_members, r.members, r.layout.fields);
+            ct.size = r.layout.size;
+            ct.align = r.layout.align;
+            break;
+        }
+        case FFIRefType::FUNCTION_REF:
+            ct.child = type(t->func_type.return_type);
+            ct.count = t->func_type.num_params;
+            ct.first = memberList(t->func_type.param_types, nullptr, t->func_type.num_params);
+            break;
+        case FFIRefType::INTEGER_REF:
+            ct.subtype = t->int_type.type;
+            break;
+        case FFIRefType::FLOAT_REF:
+            ct.subtype = t->float_type.type;
+            break;
+        case FFIRefType::POINTER_REF:
+            ct.child = type(t->point_type.pointed_type);
+            break;
+        case FFIRefType::ARRAY_REF:
+            ct.child = type(t->array_type.type);
+            ct.size = t->array_type.size;
+            break;
+        case FFIRefType::FLEX_REF:
+            ct.child = type(t->flex_type.type);
+            break;
+        case FFIRefType::VOID_REF:
+            break;
+        }
+
+        types[index] = ct;
+
+        return index;
+    }
+
+    // Members are converted before being appended so that the range stays
+    // contiguous while nested types add members of their own. Record members
+    // are referenced through pointers, so those are passed to keep sharing.
+    uint32_t memberList(const FFITypeRef *memberTypes, const char *const *memberNames, size_t n, const FFIRecordMember *shared = nullptr, const FFIFieldLayout *fields = nullptr)
+    {
+        std::vector<FFISnapshotMember> list;
+
+        for (size_t i = 0; i < n; ++i) {
+            FFISnapshotMember m {};
+
+            m.name = memberNames ? string(memberNames[i]) : SNAPSHOT_NO_INDEX;
+            m.type = type(shared ? shared[i].type : &memberTypes[i]);
+
+            if (fields) {
+                m.offset = fields[i].offset;
+                m.bit_width = fields[i].bit_width;
+                m.flags = fields[i].is_bitfield ? SNAPSHOT_BITFIELD : 0;
+            }
+
+            list.push_back(m);
+        }
+
+        uint32_t first = members.size();
+        members.insert(members.end(), list.begin(), list.end());
+
+        return first;
+    }
+
+    static FFISnapshotSection section(uint64_t &offset, uint64_t count, uint64_t size)
+    {
+        FFISnapshotSection ret { offset, count };
+
+        offset = alignTo(offset + count * size, 8);
+
+        return ret;
+    }
+
+    static void writeSection(raw_fd_ostream &out, const void *data, uint64_t size)
+    {
+        static const char padding[8] = {};
+
+        out.write(static_cast<const char *>(data), size);
+        out.write(padding, alignTo(size, 8) - size);
+    }
+
+    bool valid = true;
+    std::string strings;
+    StringMap<uint32_t> stringIndex;
+    DenseMap<const FFITypeRef *, uint32_t> typeIndex;
+    const TypeCopies *copies = nullptr; // of the unit being added
+    std::map<std::string, uint32_t> fileIndex;
+    std::vector<FFISnapshotFile> files;
+    std::vector<FFISnapshotInclude> includes;
+    std::vector<FFISnapshotType> types;
+    std::vector<FFISnapshotMember> members;
+    std::vector<FFISnapshotEnumerator> enumerators;
+    std::vector<FFISnapshotDecl> decls;
+};
+
+// Rebuilds the declarations of a snapshot as FFITypeRef graphs in an arena,
+// so they can be replayed through the callbacks
+class SnapshotLoader
+{
+public:
+    explicit SnapshotLoader(ffi_gen_result &result) : arena(result.arena), result(result) {}
+
+    ~SnapshotLoader()
+    {
+        ffi_gen_snapshot_close(snapshot);
+    }
+
+    bool open(const std::string &path)
+    {
+        snapshot = ffi_gen_snapshot_open(path.c_str());
+
+        if (snapshot)
+            v = ffi_gen_snapshot_view(snapshot);
+
+        return snapshot != nullptr;
+    }
+
+    // True if every file the snapshot was built from still has the same
+    // size and either the same mtime or the same contents
+    bool filesUnchanged()
+    {
+        for (size_t i = 0; i < v->num_files; ++i) {
+            const FFISnapshotFile &f = v->files[i];
+            const char *path = v->strings + f.path;
+            sys::fs::file_status st;
+            uint8_t md5[16];
+
+            if (sys::fs::status(path, st) || st.getSize() != f.size)
+                return false;
+
+            if (sys::toTimeT(st.getLastModificationTime()) != f.mtime
+                && (!hash_file(path, md5) || !std::equal(std::begin(md5), std::end(md5), f.md5)))
+                return false;
+        }
+
+        return true;
+    }
+
+    // The snapshot library has already bounds-checked every index
+    void load(Recording &recording)
+    {
+        // Strings are copied once so they outlive the mapping
+        char *copy = arena.Allocate<char>(v->strings_size + 1);
+        std::copy(v->strings, v->strings + v->strings_size, copy);
+        copy[v->strings_size] = '\0';
+        strings = copy;
+        result.stats.string_bytes += v->strings_size + 1;
+
+        nodes = arena.Allocate<FFITypeRef>(v->num_types);
+
+        for (size_t i = 0; i < v->num_types; ++i)
+            loadType(v->types[i], nodes[i]);
+
+        // Parameter lists hold copies of their types, so they are filled in
+        // only once every node is complete
+        for (size_t i = 0; i < v->num_types; ++i)
+            if (v->types[i].kind == FFIRefType::FUNCTION_REF)
+                nodes[i].func_type.param_types = memberTypes(v->types[i].first, v->types[i].count);
+
+        for (size_t i = 0; i < v->num_decls; ++i)
+            recording.append(loadDecl(v->decls[i]));
+
+        for (size_t i = 0; i < v->num_files; ++i)
+            result.files.push_back(str(v->files[i].path));
+
+        for (size_t i = 0; i < v->num_includes; ++i)
+            result.includes.push_back(std::make_pair(v->includes[i].includer, v->includes[i].included));
+    }
+
+private:
+    char *str(uint32_t offset)
+    {
+        return offset == SNAPSHOT_NO_INDEX ? nullptr : const_cast<char *>(strings + offset);
+    }
+
+    FFITypeRef *typeAt(uint32_t index)
+    {
+        return index == SNAPSHOT_NO_INDEX ? nullptr : &nodes[index];
+    }
+
+    void loadType(const FFISnapshotType &st, FFITypeRef &t)
+    {
+        t = FFITypeRef {};
+        t.type = static_cast<FFIRefType>(st.kind);
+        t.qual_name = str(st.qual_name);
+
+        switch (st.kind) {
+        case FFIRefType::ENUM_REF:
+            t.enum_type.name = str(st.name);
+            t.enum_type.anonymous = (st.flags & SNAPSHOT_ANONYMOUS) != 0;
+            break;
+        case FFIRefType::STRUCT_REF:
+            loadRecord(st, t.struct_type);
+            break;
+        case FFIRefType::UNION_REF:
+            loadRecord(st, t.union_type);
+            break;
+        case FFIRefType::FUNCTION_REF:
+            t.func_type.return_type = typeAt(st.child);
+            t.func_type.num_params = st.count;
+            break;
+        case FFIRefType::INTEGER_REF:
+            t.int_type.type = static_cast<FFIIntegerType>(st.subtype);
+            break;
+        case FFIRefType::FLOAT_REF:
+            t.float_type.type = static_cast<FFIFloatType>(st.subtype);
+            break;
+        case FFIRefType::POINTER_REF:
+            t.point_type.pointed_type = typeAt(st.child);
+            break;
+        case FFIRefType::ARRAY_REF:
+            t.array_type.type = typeAt(st.child);
+            t.array_type.size = st.size;
+            break;
+        case FFIRefType::FLEX_REF:
+            t.flex_type.type = typeAt(st.child);
+            break;
+        }
+    }
+
+    template <typename R>
+    void loadRecord(const FFISnapshotType &st, R &r)
+    {
+        r.name = str(st.name);
+        r.anonymous = (st.flags & SNAPSHOT_ANONYMOUS) != 0;
+        r.defined = (st.flags & SNAPSHOT_DEFINED) != 0;
+        r.num_members = st.count;
+        r.members = st.count ? arena.Allocate<FFIRecordMember>(st.count) : nullptr;
+        r.layout = loadLayout(st.size, st.align, st.first, st.count);
+
+        for (size_t m = 0; m < st.count; ++m) {
+            r.members[m].name = str(v->members[st.first + m].name);
+            r.members[m].type = typeAt(v->members[st.first + m].type);
+        }
+    }
+
+    // Records without a layout were never laid out, so their members carry
+    // no positions either
+    FFIRecordLayout loadLayout(uint64_t size, uint64_t align, uint32_t first, uint32_t count)
+    {
+        FFIRecordLayout layout { size, align, nullptr };
+
+        if (!align || !count)
+            return layout;
+
+        FFIFieldLayout *fields = arena.Allocate<FFIFieldLayout>(count);
+
+        for (size_t m = 0; m < count; ++m) {
+            const FFISnapshotMember &sm = v->members[first + m];
+
+            fields[m].offset = sm.offset;
+            fields[m].bit_width = sm.bit_width;
+            fields[m].is_bitfield = (sm.flags & SNAPSHOT_BITFIELD) != 0;
+        }
+
+        layout.fields = fields;
+
+        return layout;
+    }
+
+    Recording::Event loadDecl(const FFISnapshotDecl &d)
+    {
+        Recording::Event e {};
+
+        e.kind = static_cast<FFIDeclKind>(d.kind);
+        e.name = str(d.name);
+        e.definition = str(d.text);
+        e.type = typeAt(d.type);
+        e.count = d.count;
+        e.flag = d.flags;
+
+        if (e.kind == MACRO_DECL) {
+            FFIMacroValue *value = new (arena.Allocate<FFIMacroValue>()) FFIMacroValue {};
+
+            value->type = static_cast<FFIMacroValueType>(d.value_type);
+            value->is_unsigned = (d.flags & SNAPSHOT_UNSIGNED) != 0;
+
+            if (value->type == MACRO_FLOAT)
+                std::memcpy(&value->floating, &d.value, sizeof(d.value));
+            else
+                value->integer = static_cast<int64_t>(d.value);
+
+            if (value->type == MACRO_STRING) {
+                value->string = str(d.value_string);
+                value->string_size = d.value_size;
+            }
+
+            e.value = value;
+            e.flag = 0;
+        }
+
+        if (e.kind == ENUM_DECL) {
+            e.names = arena.Allocate<const char *>(d.count);
+            e.values = arena.Allocate<int64_t>(d.count);
+
+            for (size_t m = 0; m < d.count; ++m) {
+                e.names[m] = str(v->enumerators[d.first + m].name);
+                e.values[m] = v->enumerators[d.first + m].value;
+            }
+        } else if (e.kind == FUNCTION_DECL || e.kind == STRUCT_DECL || e.kind == UNION_DECL) {
+            e.types = memberTypes(d.first, d.count);
+            e.names = arena.Allocate<const char *>(d.count);
+
+            for (size_t m = 0; m < d.count; ++m)
+                e.names[m] = str(v->members[d.first + m].name);
+        }
+
+        if (e.kind == STRUCT_DECL || e.kind == UNION_DECL)
+            e.layout = new (arena.Allocate<FFIRecordLayout>()) FFIRecordLayout { loadLayout(d.size, d.align, d.first, d.count) };
+
+        return e;
+    }
+
+    FFITypeRef *memberTypes(uint32_t first, uint32_t count)
+    {
+        if (count == 0)
+            return nullptr;
+
+        FFITypeRef *ret = arena.Allocate<FFITypeRef>(count);
+
+        for (size_t i = 0; i < count; ++i) {
+            ret[i] = *typeAt(v->members[first + i].type);
+            result.copies[&ret[i]] = typeAt(v->members[first + i].type);
+        }
+
+        return ret;
+    }
+
+    BumpPtrAllocator &arena;
+    ffi_gen_result &result;
+    ffi_gen_snapshot *snapshot = nullptr;
+    const FFISnapshotView *v = nullptr;
+    const char *strings = nullptr;
+    FFITypeRef *nodes = nullptr;
+};
+
+static std::string decl_cache_path(const char *cacheDir, const std::string &filename, StringRef content, const std::vector<std::string> &args, const std::vector<std::string> &sources,
+                                   const SymbolFilter &symbols, const walk_options &opts)
+{
+    SmallString<128> cwd;
+    MD5 hash;
+    MD5::MD5Result digest;
+
+    sys::fs::current_path(cwd);
+    hash.update(getClangFullVersion());
+    hash.update(cwd.str());
+    hash.update(filename);
+    hash.update(StringRef { "\0", 1 });
+    hash.update(content);
+
+    for (auto &a : args) {
+        hash.update(a);
+        hash.update(StringRef { "\0", 1 });
+    }
+
+    hash.update("--sources");
+
+    for (auto &f : sources) {
+        hash.update(f);
+        hash.update(StringRef { "\0", 1 });
+    }
+
+    hash.update("--symbols");
+    symbols.hash(hash);
+
+    // An overlay may shadow a file whose state the cache checks on disk
+    hash.update("--overlays");
+
+    for (size_t i = 0; i < opts.num_overlays; ++i) {
+        hash.update(opts.overlays[i].path);
+        hash.update(StringRef { "\0", 1 });
+        hash.update(StringRef { opts.overlays[i].contents, opts.overlays[i].size });
+        hash.update(StringRef { "\0", 1 });
+    }
+
+    hash.final(digest);
+
+    SmallString<128> path { StringRef { cacheDir } };
+    sys::path::append(path, Twine { "decls-" } + digest.digest() + ".bin");
+
+    return path.str().str();
+}
+
+// Writes the recorded declarations, files and include edges of each unit
+// into one snapshot
+static bool write_snapshot(const std::string &path, const std::vector<const ffi_gen_result *> &units, const std::string &preambleDeps)
+{
+    SnapshotWriter writer;
+
+    for (auto u : units) {
+        for (auto &f : u->files)
+            writer.addFile(f);
+
+        for (auto &i : u->includes)
+            writer.addInclude(u->files[i.first], u->files[i.second]);
+    }
+
+    // Headers that went into the preamble are dependencies too, even though
+    // the TU itself only saw the PCH
+    if (!preambleDeps.empty()) {
+        std::ifstream deps { preambleDeps };
+        std::string line;
+
+        while (std::getline(deps, line)) {
+            std::istringstream fields { line };
+            std::string mtime, size, path;
+
+            fields >> mtime >> size;
+            std::getline(fields >> std::ws, path);
+            writer.addFile(path);
+        }
+    }
+
+    for (auto u : units)
+        if (u->recording)
+            for (auto &e : u->recording->getEvents())
+                writer.addDecl(e, u->copies);
+
+    return writer.write(path);
+}
+
+// Handles index the nodes the walk has already converted; the table is not a
+// cheaper form of them, only a flat view with 32-bit ids. A type is indexed
+// when first asked for and its children once they are asked for, so the
+// table costs in proportion to what the caller looked at, and everything
+// else about a type is read from its node. Handles are keyed on the nodes
+// of the walk's type cache, so a parameter or member, which is a copy, gets
+// the handle of the node it copies.
+class TypeTable
+{
+public:
+    explicit TypeTable(const TypeCopies &copies) : copies(copies) {}
+
+    ffi_gen_type handle(const FFITypeRef *t)
+    {
+        if (!t)
+            return FFI_GEN_NO_TYPE;
+
+        auto copy = copies.find(t);
+        if (copy != copies.end())
+            t = copy->second;
+
+        auto i = handles.find(t);
+        if (i != handles.end())
+            return i->second;
+
+        ffi_gen_type h = nodes.size();
+
+        nodes.push_back(t);
+        firsts.push_back(UNEXPANDED);
+        counts.push_back(0);
+        handles[t] = h;
+
+        return h;
+    }
+
+    bool valid(ffi_gen_type h) const
+    {
+        return h < nodes.size();
+    }
+
+    FFIRefType kind(ffi_gen_type h) const
+    {
+        return nodes[h]->type;
+    }
+
+    const char *name(ffi_gen_type h) const
+    {
+        return nodes[h]->qual_name;
+    }
+
+    const char *tagName(ffi_gen_type h) const
+    {
+        const FFITypeRef &t = *nodes[h];
+
+        switch (t.type) {
+        case FFIRefType::ENUM_REF:
+            return t.enum_type.name;
+        case FFIRefType::STRUCT_REF:
+            return t.struct_type.name;
+        case FFIRefType::UNION_REF:
+            return t.union_type.name;
+        default:
+            return nullptr;
+        }
+    }
+
+    const FFITypeRef &node(ffi_gen_type h) const
+    {
+        return *nodes[h];
+    }
+
+    size_t numChildren(ffi_gen_type h)
+    {
+        expand(h);
+        return counts[h];
+    }
+
+    ffi_gen_type child(ffi_gen_type h, size_t i)
+    {
+        expand(h);
+        return i < counts[h] ? children[firsts[h] + i] : FFI_GEN_NO_TYPE;
+    }
+
+    const char *childName(ffi_gen_type h, size_t i)
+    {
+        expand(h);
+        return i < counts[h] ? childNames[firsts[h] + i] : nullptr;
+    }
+
+private:
+    enum : uint32_t { UNEXPANDED = 0xffffffffu };
+
+    // Functions list the return type and then the parameters; pointers,
+    // arrays and flexible arrays their element; records their members
+    void expand(ffi_gen_type h)
+    {
+        if (firsts[h] != UNEXPANDED)
+            return;
+
+        const FFITypeRef &t = *nodes[h];
+        std::vector<std::pair<const FFITypeRef *, const char *> > list;
+
+        switch (t.type) {
+        case FFIRefType::FUNCTION_REF:
+            list.emplace_back(t.func_type.return_type, nullptr);
+
+            for (size_t i = 0; i < t.func_type.num_params; ++i)
+                list.emplace_back(&t.func_type.param_types[i], nullptr);
+            break;
+        case FFIRefType::STRUCT_REF:
+            for (size_t i = 0; i < t.struct_type.num_members; ++i)
+                list.emplace_back(t.struct_type.members[i].type, t.struct_type.members[i].name);
+            break;
+        case FFIRefType::UNION_REF:
+            for (size_t i = 0; i < t.union_type.num_members; ++i)
+                list.emplace_back(t.union_type.members[i].type, t.union_type.members[i].name);
+            break;
+        case FFIRefType::POINTER_REF:
+            list.emplace_back(t.point_type.pointed_type, nullptr);
+            break;
+        case FFIRefType::ARRAY_REF:
+            list.emplace_back(t.array_type.type, nullptr);
+            break;
+        case FFIRefType::FLEX_REF:
+            list.emplace_back(t.flex_type.type, nullptr);
+            break;
+        default:
+            break;
+        }
+
+        // handle() only grows the per-type arrays, so the range stays
+        // contiguous
+        firsts[h] = children.size();
+        counts[h] = list.size();
+
+        for (auto &c : list) {
+            children.push_back(handle(c.first));
+            childNames.push_back(c.second);
+        }
+    }
+
+    // One entry per handle
+    std::vector<const FFITypeRef *> nodes;
+    std::vector<uint32_t> firsts; ///< Start of the children, or UNEXPANDED
+    std::vector<uint32_t> counts;
+
+    std::vector<ffi_gen_type> children;
+    std::vector<const char *> childNames; ///< Owned by the result's arena
+    DenseMap<const FFITypeRef *, ffi_gen_type> handles;
+    const TypeCopies &copies; ///< Owned by the result
+};
+
+static TypeTable &type_table(ffi_gen_result *result)
+{
+    if (!result->table)
+        result->table.reset(new TypeTable { result->copies });
+
+    return *result->table;
+}
+
+// Runs action over code as if it were filename, with the overlays of opts
+// mounted over the real filesystem. Clang reads code and the overlays in
+// place, without copying them. Takes ownership of action.
+static bool run_action(FrontendAction *action, StringRef code, const std::string &filename, const std::vector<std::string> &args, const walk_options &opts)
+{
+    IntrusiveRefCntPtr<vfs::OverlayFileSystem> fs { new vfs::OverlayFileSystem { vfs::getRealFileSystem() } };
+    IntrusiveRefCntPtr<vfs::InMemoryFileSystem> memory { new vfs::InMemoryFileSystem };
+
+    fs->pushOverlay(memory);
+
+    for (size_t i = 0; i < opts.num_overlays; ++i) {
+        const FFIFileOverlay &o = opts.overlays[i];
+
+        memory->addFile(o.path, 0, MemoryBuffer::getMemBuffer(StringRef { o.contents, o.size }, o.path));
+    }
+
+    memory->addFile(filename, 0, MemoryBuffer::getMemBuffer(code, filename));
+
+    // The command line runToolOnCodeWithArgs would build
+    std::vector<std::string> commandLine { "clang-tool", "-fsyntax-only" };
+    std::vector<std::string> adjusted = getClangStripDependencyFileAdjuster()(args, filename);
+
+    commandLine.insert(commandLine.end(), adjusted.begin(), adjusted.end());
+    commandLine.push_back(filename);
+
+    IntrusiveRefCntPtr<FileManager> files { new FileManager { FileSystemOptions {}, fs } };
+    ToolInvocation invocation { commandLine, action, files.get() };
+    TraceSpan span { "clang", filename };
+
+    return invocation.run();
+}
+
+// A PCH is built from the files on disk, which overlays may shadow
+static const char *preamble_dir(const walk_options &opts)
+{
+    return opts.num_overlays ? nullptr : opts.cache_dir;
+}
+
+// Walks one file, or buffer in its place when that has data. With c set, its
+// declarations are delivered there before returning; otherwise they are only
+// left in result.recording for the caller. With order set, the file claims
+// on opts.index in its turn rather than as it is parsed.
+static void walk_unit(const std::string &filename, StringRef buffer, WalkArgs &args, std::vector<std::string> &sources, const SymbolFilter &symbols, WalkControl &control,
+                      callbacks *c, ffi_gen_result &result, const walk_options &opts, ClaimOrder *order = nullptr)
+{
+    std::unique_ptr<MemoryBuffer> file;
+    StringRef inFile = buffer;
+    ClaimTurn turn { order, current_unit };
+
+    control.startFile(current_unit, filename);
+
+    if (control.stopped())
+        return;
+
+    TraceSpan span { "walk", filename };
+
+    // Mapped rather than read when it is large enough; a file that can't be
+    // read is parsed as empty, as it always was
+    if (!inFile.data()) {
+        PhaseTimer timer { result.stats.read_ns, "read", filename };
+        auto read = MemoryBuffer::getFile(filename);
+
+        if (read)
+            file = std::move(*read);
+
+        inFile = file ? file->getBuffer() : StringRef { "" };
+    }
+
+    // A cached walk would replay declarations without claiming them
+    bool incremental = opts.cache_dir && opts.incremental && !opts.index;
+    bool batched = c && c->bc && opts.batch_size;
+
+    // Reachability and ordering need the whole TU before anything can be
+    // reported
+    bool streaming = opts.streaming && !symbols.hasRoots() && !opts.topological;
+
+    if (c && !incremental && !batched && !opts.snapshot_path && !opts.topological && !order) {
+        run_action(new FFIParseAction { *c, sources, symbols, control, opts.index, result, result.stats, streaming }, inFile, filename, args.forTool(), opts);
+        return;
+    }
+
+    // Replay the declarations of an unchanged header without running clang;
+    // otherwise parse, record and cache them for next time
+    result.recording.reset(new Recording { result.arena, result.stats });
+    Recording &recording = *result.recording;
+    std::string cachePath;
+
+    if (incremental) {
+        SnapshotLoader loader { result };
+
+        cachePath = decl_cache_path(opts.cache_dir, filename, inFile, args.original(), sources, symbols, opts);
+
+        if (loader.open(cachePath) && loader.filesUnchanged()) {
+            loader.load(recording);
+            ++result.stats.cache_hits;
+            result.stats.decls_emitted += recording.getEvents().size();
+            control.done(recording.getEvents().size());
+
+            if (opts.topological)
+                recording.sortTopologically();
+
+            if (c)
+                recording.replay(*c, opts.batch_size, result.stats);
+            return;
+        }
+    }
+
+    // Recording isn't a call into the user's callbacks; replaying is. A walk
+    // that was stopped part way isn't worth caching.
+    callbacks sink = recording.sink();
+    FFIGenStats recorded {};
+    std::unique_ptr<DeferredIndex> deferred { order ? new DeferredIndex { *opts.index, recording } : nullptr };
+    ffi_gen_index *index = deferred ? deferred.get() : opts.index;
+
+    if (run_action(new FFIParseAction { sink, sources, symbols, control, index, result, recorded, streaming }, inFile, filename, args.forTool(), opts)
+        && incremental && !control.wasInterrupted() && !sys::fs::create_directories(opts.cache_dir))
+        write_snapshot(cachePath, { &result }, args.preambleDeps());
+
+    if (deferred) {
+        turn.take();
+        deferred->settle(result.stats, filename);
+        turn.release();
+    }
+
+    // Sorted after caching, so the cache holds what clang reported
+    if (opts.topological)
+        recording.sortTopologically();
+
+    if (c)
+        recording.replay(*c, opts.batch_size, result.stats);
+}
+
+static void save_snapshot(const std::vector<const ffi_gen_result *> &units, WalkArgs &args, const walk_options &opts)
+{
+    if (!opts.snapshot_path)
+        return;
+
+    if (!write_snapshot(opts.snapshot_path, units, args.preambleDeps()))
+        fprintf(stderr, "ffi_gen: could not write snapshot %s\n", opts.snapshot_path);
+}
+
+static void save_trace(Trace *trace, const walk_options &opts)
+{
+    if (trace && !trace->write(opts.trace_path))
+        fprintf(stderr, "ffi_gen: could not write trace %s\n", opts.trace_path);
+}
+
+ffi_gen_result *walk_file(const char *filename, const char **clangArgs, int argc, const char **sourceLocations, int nloc, callbacks *c)
+{
+    return walk_file_opts(filename, clangArgs, argc, sourceLocations, nloc, c, nullptr);
+}
+
+// walk_file_opts, or walk_buffer when buffer has data
+static ffi_gen_result *walk_single(const char *filename, StringRef buffer, const char **clangArgs, int argc, const char **sourceLocations, int nloc, callbacks *c, const walk_options *opts)
+{
+    walk_options defaults {};
+    std::unique_ptr<ffi_gen_result> result { new ffi_gen_result };
+    std::vector<std::string> args;
+    std::vector<std::string> sources;
+
+    for (int i = 0; i < argc; ++i)
+        args.push_back(std::string { clangArgs[i] });
+
+    for (int i = 0; i < nloc; ++i)
+        sources.push_back(std::string { sourceLocations[i] });
+
+    if (!opts)
+        opts = &defaults;
+
+    WalkArgs walkArgs { args, sources, preamble_dir(*opts) };
+    SymbolFilter symbols { *opts };
+    WalkControl control { *opts };
+    std::unique_ptr<Trace> trace { opts->trace_path ? new Trace : nullptr };
+
+    current_unit = 0;
+    current_result = result.get();
+    current_trace = trace.get();
+    walk_unit(filename, buffer, walkArgs, sources, symbols, control, c, *result, *opts);
+    current_unit = -1;
+    current_result = nullptr;
+    current_file = nullptr;
+    current_trace = nullptr;
+
+    result->complete = !control.wasInterrupted();
+
+    if (result->complete)
+        save_snapshot({ result.get() }, walkArgs, *opts);
+
+    save_trace(trace.get(), *opts);
+
+    return result.release();
+}
+
+ffi_gen_result *walk_file_opts(const char *filename, const char **clangArgs, int argc, const char **sourceLocations, int nloc, callbacks *c, const walk_options *opts)
+{
+    return walk_single(filename, StringRef {}, clangArgs, argc, sourceLocations, nloc, c, opts);
+}
+
+ffi_gen_result *walk_buffer(const char *filename, const char *buffer, size_t size, const char **clangArgs, int argc, const char **sourceLocations, int nloc, callbacks *c, const walk_options *opts)
+{
+    return walk_single(filename, StringRef { buffer, size }, clangArgs, argc, sourceLocations, nloc, c, opts);
+}
+
+// walk_files, stopped through control. With c NULL the declarations are only
+// recorded, for ffi_gen_replay.
+static ffi_gen_result *run_walk_files(const char **filenames, int nfiles, const char **clangArgs, int argc, const char **sourceLocations, int nloc, int nthreads,
+                                      FFIDeliveryType delivery, callbacks *c, const walk_options &opts, WalkControl &control)
+{
+    std::unique_ptr<ffi_gen_result> result { new ffi_gen_result };
+    std::vector<std::string> allSources;
+    std::vector<std::string> args;
+    std::vector<std::vector<std::string> > sources(nfiles);
+
+    for (int i = 0; i < argc; ++i)
+        args.push_back(std::string { clangArgs[i] });
+
+    for (int f = 0; f < nfiles; ++f) {
+        // With no explicit filter, each file reports its own declarations
+        if (nloc == 0)
+            sources[f].push_back(std::string { filenames[f] });
+
+        for (int i = 0; i < nloc; ++i)
+            sources[f].push_back(std::string { sourceLocations[i] });
+
+        allSources.insert(allSources.end(), sources[f].begin(), sources[f].end());
+        result->units.emplace_back(new ffi_gen_result);
+    }
+
+    // Every file shares the argument list, so they can share the preamble too
+    WalkArgs walkArgs { args, allSources, preamble_dir(opts) };
+    SymbolFilter symbols { opts };
+    std::unique_ptr<Trace> trace { opts.trace_path ? new Trace : nullptr };
+
+    if (nthreads <= 0)
+        nthreads = std::max(1u, std::thread::hardware_concurrency());
+
+    std::atomic<int> next { 0 };
+    std::mutex lock;
+    std::condition_variable finished;
+    std::vector<bool> done(nfiles, false);
+    std::vector<std::thread> workers;
+    std::unique_ptr<ClaimOrder> order { opts.index ? new ClaimOrder : nullptr };
+
+    for (int w = 0; w < std::min(nthreads, nfiles); ++w) {
+        workers.emplace_back([&] {
+            current_trace = trace.get();
+
+            for (int f = next++; f < nfiles; f = next++) {
+                current_unit = f;
+                current_result = result->units[f].get();
+
+                // Serialized delivery leaves the declarations recorded for
+                // this thread to hand over
+                walk_unit(filenames[f], StringRef {}, walkArgs, sources[f], symbols, control, delivery == DELIVER_SERIALIZED || !c ? nullptr : &c[f], *result->units[f], opts, order.get());
+
+                std::lock_guard<std::mutex> guard { lock };
+                done[f] = true;
+                finished.notify_all();
+            }
+
+            current_unit = -1;
+            current_result = nullptr;
+            current_file = nullptr;
+            current_trace = nullptr;
+        });
+    }
+
+    // Hand each file's declarations over on this thread, in file order, as
+    // soon as that file is finished. A file skipped by a stopped walk has
+    // nothing recorded.
+    if (delivery == DELIVER_SERIALIZED && c) {
+        current_trace = trace.get();
+
+        for (int f = 0; f < nfiles; ++f) {
+            {
+                std::unique_lock<std::mutex> guard { lock };
+                finished.wait(guard, [&] { return done[f]; });
+            }
+
+            if (!result->units[f]->recording)
+                continue;
+
+            current_unit = f;
+            current_result = result->units[f].get();
+            result->units[f]->recording->replay(*c, opts.batch_size, result->units[f]->stats);
+            current_unit = -1;
+            current_result = nullptr;
+        }
+
+        current_trace = nullptr;
+    }
+
+    for (auto &w : workers)
+        w.join();
+
+    std::vector<const ffi_gen_result *> units;
+
+    for (auto &u : result->units)
+        units.push_back(u.get());
+
+    result->complete = !control.wasInterrupted();
+
+    if (result->complete)
+        save_snapshot(units, walkArgs, opts);
+
+    save_trace(trace.get(), opts);
+
+    return result.release();
+}
+
+ffi_gen_result *walk_files(const char **filenames, int nfiles, const char **clangArgs, int argc, const char **sourceLocations, int nloc, int nthreads, FFIDeliveryType delivery, callbacks *c, const walk_options *opts)
+{
+    walk_options defaults {};
+
+    if (!opts)
+        opts = &defaults;
+
+    WalkControl control { *opts };
+
+    return run_walk_files(filenames, nfiles, clangArgs, argc, sourceLocations, nloc, nthreads, delivery, c, *opts, control);
+}
+
+ffi_gen_result *walk_targets(const char *filename, const char **targets, int ntargets, const char **clangArgs, int argc, const char **sourceLocations, int nloc, callbacks *c,
+                             const walk_options *opts)
+{
+    // Nothing to walk, so nothing to size by ntargets
+    if (ntargets <= 0)
+        return new ffi_gen_result;
+
+    walk_options defaults {};
+    std::unique_ptr<ffi_gen_result> result { new ffi_gen_result };
+    std::vector<std::unique_ptr<WalkArgs> > targetArgs;
+
+    if (!opts)
+        opts = &defaults;
+
+    if (ntargets > 64) {
+        fprintf(stderr, "ffi_gen: only the first 64 of %d targets are walked\n", ntargets);
+        ntargets = 64;
+    }
+
+    std::vector<std::vector<std::string> > sources(ntargets);
+
+    // Every target would claim the same entities in a shared index, and a
+    // snapshot only holds one target
+    walk_options targetOpts = *opts;
+    targetOpts.index = nullptr;
+    targetOpts.snapshot_path = nullptr;
+
+    for (int t = 0; t < ntargets; ++t) {
+        std::vector<std::string> args;
+
+        for (int i = 0; i < argc; ++i)
+            args.push_back(std::string { clangArgs[i] });
+
+        args.push_back("-target");
+        args.push_back(targets[t]);
+
+        for (int i = 0; i < nloc; ++i)
+            sources[t].push_back(std::string { sourceLocations[i] });
+
+        // Each target has a preamble of its own
+        targetArgs.emplace_back(new WalkArgs { args, sources[t], preamble_dir(targetOpts) });
+        result->units.emplace_back(new ffi_gen_result);
+    }
+
+    SymbolFilter symbols { targetOpts };
+    WalkControl control { targetOpts };
+    std::unique_ptr<Trace> trace { opts->trace_path ? new Trace : nullptr };
+    std::atomic<int> next { 0 };
+    std::vector<std::thread> workers;
+    int nthreads = std::min<int>(ntargets, std::max(1u, std::thread::hardware_concurrency()));
+
+    for (int w = 0; w < nthreads; ++w) {
+        workers.emplace_back([&] {
+            current_trace = trace.get();
+
+            for (int t = next++; t < ntargets; t = next++) {
+                current_unit = t;
+                current_result = result->units[t].get();
+                walk_unit(filename, StringRef {}, *targetArgs[t], sources[t], symbols, control, nullptr, *result->units[t], targetOpts);
+            }
+
+            current_unit = -1;
+            current_result = nullptr;
+            current_file = nullptr;
+            current_trace = nullptr;
+        });
+    }
+
+    for (auto &w : workers)
+        w.join();
+
+    current_trace = trace.get();
+
+    {
+        PhaseTimer timer { result->stats.merge_ns, "merge" };
+
+        result->merge.reset(new TargetMerge);
+
+        for (int t = 0; t < ntargets; ++t) {
+            if (result->units[t]->recording)
+                result->merge->add(t, *result->units[t]->recording);
+        }
+
+        result->stats.decls_merged = result->merge->numMerged();
+    }
+
+    result->complete = !control.wasInterrupted();
+
+    if (c)
+        result->merge->deliver(*result, *c, opts->batch_size);
+
+    current_trace = nullptr;
+    save_trace(trace.get(), *opts);
+
+    return result.release();
+}
+
+int ffi_gen_current_unit(void)
+{
+    return current_unit;
+}
+
+uint64_t ffi_gen_current_targets(void)
+{
+    return current_targets;
+}
+
+int ffi_gen_current_cycle(void)
+{
+    return current_cycle;
+}
+
+ffi_gen_result *ffi_gen_current_result(void)
+{
+    return current_result;
+}
+
+ffi_gen_index *ffi_gen_index_new(void)
+{
+    return new ffi_gen_index;
+}
+
+void ffi_gen_index_free(ffi_gen_index *index)
+{
+    delete index;
+}
+
+void ffi_gen_free_result(ffi_gen_result *result)
+{
+    delete result;
+}
+
+void ffi_gen_result_stats(const ffi_gen_result *result, FFIGenStats *stats)
+{
+    *stats = result->stats;
+    stats->arena_bytes = result->arena.getBytesAllocated();
+
+    for (auto &u : result->units) {
+        FFIGenStats unit;
+
+        ffi_gen_result_stats(u.get(), &unit);
+        stats->type_lookups += unit.type_lookups;
+        stats->type_nodes += unit.type_nodes;
+        stats->arena_bytes += unit.arena_bytes;
+        stats->cache_hits += unit.cache_hits;
+        stats->callbacks += unit.callbacks;
+        stats->decls_visited += unit.decls_visited;
+        stats->decls_pruned += unit.decls_pruned;
+        stats->decls_emitted += unit.decls_emitted;
+        stats->decls_filtered += unit.decls_filtered;
+        stats->decls_repeated += unit.decls_repeated;
+        stats->decls_conflict += unit.decls_conflict;
+        stats->decls_merged += unit.decls_merged;
+        stats->macros_seen += unit.macros_seen;
+        stats->macros_emitted += unit.macros_emitted;
+        stats->string_bytes += unit.string_bytes;
+        stats->read_ns += unit.read_ns;
+        stats->setup_ns += unit.setup_ns;
+        stats->parse_ns += unit.parse_ns;
+        stats->macros_ns += unit.macros_ns;
+        stats->traverse_ns += unit.traverse_ns;
+        stats->convert_ns += unit.convert_ns;
+        stats->callback_ns += unit.callback_ns;
+        stats->merge_ns += unit.merge_ns;
+    }
+}
+
+int ffi_gen_result_complete(const ffi_gen_result *result)
+{
+    return result->complete;
+}
+
+// An asynchronous walk. Everything the caller passed is copied, since it
+// only has to stay valid until walk_files_async returns.
+struct ffi_gen_walk {
+    std::deque<std::string> strings; ///< Backs every pointer below; a deque never moves its elements
+    std::vector<const char *> filenames;
+    std::vector<const char *> args;
+    std::vector<const char *> sources;
+    std::vector<const char *> includeSymbols;
+    std::vector<const char *> excludeSymbols;
+    std::vector<const char *> rootSymbols;
+    std::vector<FFIFileOverlay> overlays;
+    walk_options opts;
+    std::unique_ptr<WalkControl> control;
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable ended;
+    ffi_gen_result *result = nullptr; ///< Set, under lock, once the walk has ended
+    bool abandoned = false; ///< Set, under lock, by ffi_gen_walk_free; the thread then frees everything
+
+    const char *keep(const char *s)
+    {
+        if (!s)
+            return nullptr;
+
+        strings.emplace_back(s);
+        return strings.back().c_str();
+    }
+
+    std::vector<const char *> keep(const char **list, size_t n)
+    {
+        std::vector<const char *> ret;
+
+        for (size_t i = 0; i < n; ++i)
+            ret.push_back(keep(list[i]));
+
+        return ret;
+    }
 };
 
-static FFITypeRef type_for_qual(QualType qt, ASTContext *ctx)
+ffi_gen_walk *walk_files_async(const char **filenames, int nfiles, const char **clangArgs, int argc, const char **sourceLocations, int nloc, int nthreads, const walk_options *opts)
 {
-    FFITypeRef returnTy;
-    returnTy.qual_name = strdup(qt.getAsString().c_str()); // LEAK
+    walk_options defaults {};
+    std::unique_ptr<ffi_gen_walk> walk { new ffi_gen_walk };
+
+    if (!opts)
+        opts = &defaults;
+
+    walk->filenames = walk->keep(filenames, nfiles);
+    walk->args = walk->keep(clangArgs, argc);
+    walk->sources = walk->keep(sourceLocations, nloc);
+    walk->includeSymbols = walk->keep(opts->include_symbols, opts->num_include_symbols);
+    walk->excludeSymbols = walk->keep(opts->exclude_symbols, opts->num_exclude_symbols);
+    walk->rootSymbols = walk->keep(opts->root_symbols, opts->num_root_symbols);
+
+    walk->opts = *opts;
+    walk->opts.cache_dir = walk->keep(opts->cache_dir);
+    walk->opts.snapshot_path = walk->keep(opts->snapshot_path);
+    walk->opts.trace_path = walk->keep(opts->trace_path);
+    walk->opts.include_symbols = walk->includeSymbols.data();
+    walk->opts.exclude_symbols = walk->excludeSymbols.data();
+    walk->opts.root_symbols = walk->rootSymbols.data();
+
+    for (size_t i = 0; i < opts->num_overlays; ++i) {
+        const FFIFileOverlay &o = opts->overlays[i];
+
+        const char *path = walk->keep(o.path);
+
+        walk->strings.emplace_back(o.contents, o.size);
+        walk->overlays.push_back(FFIFileOverlay { path, walk->strings.back().c_str(), o.size });
+    }
 
-    if (qt->isVoidType()) {
-        returnTy.type = FFIRefType::VOID_REF;
-    } else if (qt->isPointerType()) {
-        // LEAK
-        FFITypeRef *pointee = new FFITypeRef { type_for_qual(qt->getPointeeType(), ctx) };
+    walk->opts.overlays = walk->overlays.data();
+    walk->control.reset(new WalkControl { walk->opts });
 
-        returnTy.type = FFIRefType::POINTER_REF;
-        returnTy.point_type.pointed_type = pointee;
-    } else if (qt->isEnumeralType()) {
-        const EnumDecl *ed = qt->castAs<EnumType>()->getDecl();
+    ffi_gen_walk *w = walk.get();
 
-        returnTy.type = FFIRefType::ENUM_REF;
+    walk->thread = std::thread { [w, nfiles, argc, nloc, nthreads] {
+        ffi_gen_result *result = run_walk_files(w->filenames.data(), nfiles, w->args.data(), argc, w->sources.data(), nloc, nthreads,
+                                                DELIVER_SERIALIZED, nullptr, w->opts, *w->control);
 
-        if (ed->hasNameForLinkage()) {
-            std::string name = ed->getNameAsString();
-            if (name.size() == 0)
-                name = ed->getTypedefNameForAnonDecl()->getUnderlyingType().getAsString();
+        bool abandoned;
 
-            returnTy.enum_type.name = strdup(name.c_str()); // LEAK
-            returnTy.enum_type.anonymous = 0;            
-        } else {
-            returnTy.enum_type.name = NULL;
-            returnTy.enum_type.anonymous = 1;
+        {
+            std::lock_guard<std::mutex> guard { w->lock };
+            w->result = result;
+            abandoned = w->abandoned;
+            w->ended.notify_all();
         }
-    } else if (qt->isRecordType()) {
-        const RecordDecl *rd = qt->castAs<RecordType>()->getDecl();
 
-        std::string name;
-        std::vector<FFIRecordMember> *members = NULL;
+        if (abandoned) {
+            ffi_gen_free_result(result);
+            delete w;
+        }
+    } };
 
-        // see if it's defined
-        bool defined = rd->getDefinition() != NULL;
+    return walk.release();
+}
 
-        if (rd->isAnonymousStructOrUnion()) {
-            // Only add fields in an anonymous record!
-            members = new std::vector<FFIRecordMember>; // LEAK
-            std::vector<FFITypeRef> *memberTypes = new std::vector<FFITypeRef>; // LEAK
-            std::vector<std::string> memberNames;
+int ffi_gen_walk_poll(ffi_gen_walk *walk)
+{
+    std::lock_guard<std::mutex> guard { walk->lock };
 
-            for (auto f : rd->fields()) {
-                FFITypeRef type = type_for_qual(f->getType(), ctx);
-                std::string memberName = f->getNameAsString();
+    return walk->result != nullptr;
+}
 
-                memberTypes->push_back(type);
-                memberNames.push_back(memberName);
-            }
+int ffi_gen_walk_wait(ffi_gen_walk *walk, int64_t timeout_ms)
+{
+    std::unique_lock<std::mutex> guard { walk->lock };
+    auto ended = [walk] { return walk->result != nullptr; };
 
-            for (size_t i = 0; i < memberNames.size(); ++i) {
-                FFIRecordMember m;
-                if (memberNames[i].size() > 0)
-                    m.name = strdup(memberNames[i].c_str()); // LEAK
-                m.type = &((*memberTypes)[i]);
+    if (timeout_ms < 0) {
+        walk->ended.wait(guard, ended);
+        return 1;
+    }
 
-                members->push_back(m);
-            }
-        } else if (rd->hasNameForLinkage()) {
-            name = rd->getNameAsString();
-            if (name.size() == 0)
-                name = rd->getTypedefNameForAnonDecl()->getUnderlyingType().getAsString();
-        }
+    return walk->ended.wait_for(guard, std::chrono::milliseconds(timeout_ms), ended);
+}
 
-        if (qt->isUnionType()) {
-            returnTy.type = FFIRefType::UNION_REF;
-            returnTy.union_type.anonymous = rd->isAnonymousStructOrUnion();
-            returnTy.union_type.members = NULL;
-            returnTy.union_type.num_members = 0;
-            returnTy.union_type.name = NULL;
-            returnTy.union_type.defined = defined;
-            if (members) {
-                returnTy.union_type.members = &((*members)[0]);
-                returnTy.union_type.num_members = members->size();
-            }
-            if (name.size() > 0)
-                returnTy.union_type.name = strdup(name.c_str()); // LEAK
-        } else {
-            returnTy.type = FFIRefType::STRUCT_REF;
-            returnTy.struct_type.anonymous = rd->isAnonymousStructOrUnion();
-            returnTy.struct_type.members = NULL;
-            returnTy.struct_type.num_members = 0;
-            returnTy.struct_type.name = NULL;
-            returnTy.struct_type.defined = defined;
-            if (members) {
-                returnTy.struct_type.members = &((*members)[0]);
-                returnTy.struct_type.num_members = members->size();
-            }
-            if (name.size() > 0)
-                returnTy.struct_type.name = strdup(name.c_str()); // LEAK
+void ffi_gen_walk_cancel(ffi_gen_walk *walk)
+{
+    walk->control->cancel();
+}
+
+int ffi_gen_walk_progress(ffi_gen_walk *walk, size_t *decls)
+{
+    *decls = walk->control->processed();
+
+    return walk->control->currentFile();
+}
+
+ffi_gen_result *ffi_gen_walk_finish(ffi_gen_walk *walk)
+{
+    walk->thread.join();
+
+    ffi_gen_result *result = walk->result;
+
+    delete walk;
+
+    return result;
+}
+
+void ffi_gen_walk_free(ffi_gen_walk *walk)
+{
+    walk->control->cancel();
+
+    {
+        std::lock_guard<std::mutex> guard { walk->lock };
+
+        // Still running: the thread cleans up once it sees the flag
+        if (!walk->result) {
+            walk->abandoned = true;
+            walk->thread.detach();
+            return;
         }
-    } else if (qt->isFunctionProtoType()) {
-        const FunctionProtoType *ft = qt->castAs<FunctionProtoType>();
+    }
 
-        FFITypeRef *ret_type = new FFITypeRef { type_for_qual(ft->getReturnType(), ctx) }; // LEAK
-        std::vector<FFITypeRef> *param_types = new std::vector<FFITypeRef>; // LEAK
-        for (size_t i = 0; i < ft->getNumParams(); ++i)
-            param_types->push_back(FFITypeRef { type_for_qual(ft->getParamType(i), ctx) } );
+    walk->thread.join();
+    ffi_gen_free_result(walk->result);
+    delete walk;
+}
 
-        returnTy.type = FFIRefType::FUNCTION_REF;
-        returnTy.func_type.return_type = ret_type;
-        returnTy.func_type.param_types = &((*param_types)[0]);
-        returnTy.func_type.num_params = ft->getNumParams();
-    } else if (qt->isFunctionNoProtoType()) {
-        const FunctionNoProtoType *ft = qt->castAs<FunctionNoProtoType>();
+void ffi_gen_replay(ffi_gen_result *result, callbacks *c, size_t batch_size)
+{
+    if (result->merge) {
+        result->merge->deliver(*result, *c, batch_size);
+        return;
+    }
 
-        FFITypeRef *ret_type = new FFITypeRef { type_for_qual(ft->getReturnType(), ctx) }; // LEAK
-        returnTy.type = FFIRefType::FUNCTION_REF;
-        returnTy.func_type.return_type = ret_type;
-        returnTy.func_type.param_types = nullptr;
-        returnTy.func_type.num_params = 0;
-    } else if (qt->isConstantArrayType()) {
-        const ConstantArrayType *at = ctx->getAsConstantArrayType(qt);
+    for (size_t f = 0; f < result->units.size(); ++f) {
+        ffi_gen_result &unit = *result->units[f];
 
-        FFITypeRef *var_type = new FFITypeRef { type_for_qual(at->getElementType(), ctx) }; // LEAK
-        returnTy.type = FFIRefType::ARRAY_REF;
-        returnTy.array_type.type = var_type;
-        returnTy.array_type.size = at->getSize().getZExtValue();
-    } else if (qt->isIncompleteArrayType()) {
-        const IncompleteArrayType *at = ctx->getAsIncompleteArrayType(qt);
+        if (!unit.recording)
+            continue;
 
-        returnTy.type = FFIRefType::FLEX_REF;
-        returnTy.flex_type.type = new FFITypeRef { type_for_qual(at->getElementType(), ctx) }; // LEAK
-    } else if (qt->isBuiltinType()) {
-        const BuiltinType *bt = qt->castAs<BuiltinType>();
+        current_unit = f;
+        current_result = &unit;
+        unit.recording->replay(*c, batch_size, unit.stats);
+    }
 
-        switch (bt->getKind()) {
-        case BuiltinType::Kind::Bool:
-            returnTy.type = FFIRefType::INTEGER_REF;
-            returnTy.int_type.type = FFIIntegerType::Bool;
-            break;
+    current_unit = -1;
+    current_result = nullptr;
+}
 
-        case BuiltinType::Kind::Char_U:
-        case BuiltinType::Kind::UChar:
-            returnTy.type = FFIRefType::INTEGER_REF;
-            returnTy.int_type.type = FFIIntegerType::UInt8;
-            break;
+ffi_gen_type ffi_gen_type_handle(ffi_gen_result *result, const FFITypeRef *type)
+{
+    return type_table(result).handle(type);
+}
 
-        case BuiltinType::Kind::Char8:
-        case BuiltinType::Kind::Char_S:
-        case BuiltinType::Kind::SChar:
-            returnTy.type = FFIRefType::INTEGER_REF;
-            returnTy.int_type.type = FFIIntegerType::Int8;
-            break;
+FFIRefType ffi_gen_type_kind(ffi_gen_result *result, ffi_gen_type h)
+{
+    TypeTable &table = type_table(result);
 
-        case BuiltinType::Kind::WChar_U:
-        case BuiltinType::Kind::UShort:
-            returnTy.type = FFIRefType::INTEGER_REF;
-            returnTy.int_type.type = FFIIntegerType::UInt16;
-            break;
+    return table.valid(h) ? table.kind(h) : FFIRefType::VOID_REF;
+}
 
-        case BuiltinType::Kind::WChar_S:
-        case BuiltinType::Kind::Char16:
-        case BuiltinType::Kind::Short:
-            returnTy.type = FFIRefType::INTEGER_REF;
-            returnTy.int_type.type = FFIIntegerType::Int16;
-            break;
+const char *ffi_gen_type_name(ffi_gen_result *result, ffi_gen_type h)
+{
+    TypeTable &table = type_table(result);
 
-        case BuiltinType::Kind::Char32:
-        case BuiltinType::Kind::Int:
-            returnTy.type = FFIRefType::INTEGER_REF;
-            returnTy.int_type.type = FFIIntegerType::Int32;
-            break;
+    return table.valid(h) ? table.name(h) : nullptr;
+}
 
-        case BuiltinType::Kind::UInt:
-            returnTy.type = FFIRefType::INTEGER_REF;
-            returnTy.int_type.type = FFIIntegerType::UInt32;
-            break;
+const char *ffi_gen_type_tag(ffi_gen_result *result, ffi_gen_type h)
+{
+    TypeTable &table = type_table(result);
 
-        case BuiltinType::Kind::Long:
-        case BuiltinType::Kind::LongLong:
-            returnTy.type = FFIRefType::INTEGER_REF;
-            returnTy.int_type.type = FFIIntegerType::Int64;
-            break;
+    return table.valid(h) ? table.tagName(h) : nullptr;
+}
 
-        case BuiltinType::Kind::ULong:
-        case BuiltinType::Kind::ULongLong:
-            returnTy.type = FFIRefType::INTEGER_REF;
-            returnTy.int_type.type = FFIIntegerType::UInt64;
-            break;
+int ffi_gen_type_subtype(ffi_gen_result *result, ffi_gen_type h)
+{
+    TypeTable &table = type_table(result);
+
+    if (!table.valid(h))
+        return -1;
+
+    switch (table.kind(h)) {
+    case FFIRefType::INTEGER_REF:
+        return table.node(h).int_type.type;
+    case FFIRefType::FLOAT_REF:
+        return table.node(h).float_type.type;
+    default:
+        return -1;
+    }
+}
 
-        case BuiltinType::Kind::Int128:
-            returnTy.type = FFIRefType::INTEGER_REF;
-            returnTy.int_type.type = FFIIntegerType::Int128;
-            break;
+int ffi_gen_type_flags(ffi_gen_result *result, ffi_gen_type h)
+{
+    TypeTable &table = type_table(result);
+
+    if (!table.valid(h))
+        return 0;
+
+    const FFITypeRef &t = table.node(h);
+
+    switch (t.type) {
+    case FFIRefType::ENUM_REF:
+        return t.enum_type.anonymous ? FFI_GEN_TYPE_ANONYMOUS : 0;
+    case FFIRefType::STRUCT_REF:
+        return (t.struct_type.anonymous ? FFI_GEN_TYPE_ANONYMOUS : 0) | (t.struct_type.defined ? FFI_GEN_TYPE_DEFINED : 0);
+    case FFIRefType::UNION_REF:
+        return (t.union_type.anonymous ? FFI_GEN_TYPE_ANONYMOUS : 0) | (t.union_type.defined ? FFI_GEN_TYPE_DEFINED : 0);
+    default:
+        return 0;
+    }
+}
 
-        case BuiltinType::Kind::Float:
-            returnTy.type = FFIRefType::FLOAT_REF;
-            returnTy.float_type.type = FFIFloatType::Float;
-            break;
+uint64_t ffi_gen_array_size(ffi_gen_result *result, ffi_gen_type h)
+{
+    TypeTable &table = type_table(result);
 
-        case BuiltinType::Kind::Double:
-            returnTy.type = FFIRefType::FLOAT_REF;
-            returnTy.float_type.type = FFIFloatType::Double;
-            break;
+    return table.valid(h) && table.kind(h) == FFIRefType::ARRAY_REF ? table.node(h).array_type.size : 0;
+}
 
-        case BuiltinType::Kind::LongDouble:
-            returnTy.type = FFIRefType::FLOAT_REF;
-            returnTy.float_type.type = FFIFloatType::LongDouble;
-            break;
-        default:
-            fprintf(stderr, "unknown type %s\n", qt.getAsString().c_str());
-            abort();
-        };
-    } else {
-        fprintf(stderr, "unknown type %s\n", qt.getAsString().c_str());
-        abort();
+ffi_gen_type ffi_gen_type_pointee(ffi_gen_result *result, ffi_gen_type h)
+{
+    TypeTable &table = type_table(result);
+
+    if (!table.valid(h))
+        return FFI_GEN_NO_TYPE;
+
+    switch (table.kind(h)) {
+    case FFIRefType::POINTER_REF:
+    case FFIRefType::ARRAY_REF:
+    case FFIRefType::FLEX_REF:
+    case FFIRefType::FUNCTION_REF:
+        return table.child(h, 0);
+    default:
+        return FFI_GEN_NO_TYPE;
     }
+}
 
-    return returnTy;
+size_t ffi_gen_record_num_fields(ffi_gen_result *result, ffi_gen_type h)
+{
+    TypeTable &table = type_table(result);
+
+    if (!table.valid(h) || (table.kind(h) != FFIRefType::STRUCT_REF && table.kind(h) != FFIRefType::UNION_REF))
+        return 0;
+
+    return table.numChildren(h);
 }
 
-static void get_types_for_func(FunctionDecl *fd, FFITypeRef &returnTy, std::vector<FFITypeRef> &paramTys, ASTContext *ctx)
+ffi_gen_type ffi_gen_record_field(ffi_gen_result *result, ffi_gen_type h, size_t i)
 {
-    returnTy = type_for_qual(fd->getReturnType(), ctx);
+    return ffi_gen_record_num_fields(result, h) > i ? type_table(result).child(h, i) : FFI_GEN_NO_TYPE;
+}
 
-    const FunctionProtoType *ft = fd->getType()->getAs<FunctionProtoType>();
-    if (ft) {
-        for (size_t i = 0; i < ft->getNumParams(); ++i)
-            paramTys.push_back(FFITypeRef { type_for_qual(ft->getParamType(i), ctx) });
+const char *ffi_gen_record_field_name(ffi_gen_result *result, ffi_gen_type h, size_t i)
+{
+    return ffi_gen_record_num_fields(result, h) > i ? type_table(result).childName(h, i) : nullptr;
+}
+
+// Layout of a record handle, or NULL for other kinds
+static const FFIRecordLayout *record_layout(TypeTable &table, ffi_gen_type h)
+{
+    if (!table.valid(h))
+        return nullptr;
+
+    switch (table.kind(h)) {
+    case FFIRefType::STRUCT_REF:
+        return &table.node(h).struct_type.layout;
+    case FFIRefType::UNION_REF:
+        return &table.node(h).union_type.layout;
+    default:
+        return nullptr;
     }
 }
 
+uint64_t ffi_gen_record_size(ffi_gen_result *result, ffi_gen_type h)
+{
+    const FFIRecordLayout *layout = record_layout(type_table(result), h);
+
+    return layout ? layout->size : 0;
+}
 
-void walk_file(const char *filename, const char **clangArgs, int argc, const char **sourceLocations, int nloc, callbacks *c)
+uint64_t ffi_gen_record_align(ffi_gen_result *result, ffi_gen_type h)
 {
-    std::ifstream t { filename };
-    std::string inFile { std::istreambuf_iterator<char>(t), std::istreambuf_iterator<char>() };
-    std::vector<std::string> args;
-    std::vector<std::string> sources;
+    const FFIRecordLayout *layout = record_layout(type_table(result), h);
 
-    for (int i = 0; i < argc; ++i)
-        args.push_back(std::string { clangArgs[i] });
+    return layout ? layout->align : 0;
+}
 
-    for (int i = 0; i < nloc; ++i)
-        sources.push_back(std::string { sourceLocations[i] });
+uint64_t ffi_gen_record_field_offset(ffi_gen_result *result, ffi_gen_type h, size_t i)
+{
+    const FFIRecordLayout *layout = record_layout(type_table(result), h);
+
+    return layout && layout->fields && ffi_gen_record_num_fields(result, h) > i ? layout->fields[i].offset : 0;
+}
+
+int ffi_gen_record_field_bit_width(ffi_gen_result *result, ffi_gen_type h, size_t i)
+{
+    const FFIRecordLayout *layout = record_layout(type_table(result), h);
+
+    if (!layout || !layout->fields || ffi_gen_record_num_fields(result, h) <= i || !layout->fields[i].is_bitfield)
+        return -1;
 
-    clang::tooling::runToolOnCodeWithArgs(new MacroParseAction { *c, sources }, inFile, args, filename);
-    clang::tooling::runToolOnCodeWithArgs(new FFIParseAction { *c, sources }, inFile, args, filename);
+    return layout->fields[i].bit_width;
+}
+
+size_t ffi_gen_function_num_params(ffi_gen_result *result, ffi_gen_type h)
+{
+    TypeTable &table = type_table(result);
+
+    if (!table.valid(h) || table.kind(h) != FFIRefType::FUNCTION_REF)
+        return 0;
+
+    return table.numChildren(h) - 1;
+}
+
+ffi_gen_type ffi_gen_function_param(ffi_gen_result *result, ffi_gen_type h, size_t i)
+{
+    return ffi_gen_function_num_params(result, h) > i ? type_table(result).child(h, i + 1) : FFI_GEN_NO_TYPE;
 }
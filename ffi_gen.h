@@ -10,6 +10,10 @@ extern "C" {
 
 struct FFITypeRef;
 
+/// Owns every type node and string reported by one walk. Everything passed to
+/// the callbacks stays valid until the result is given to ffi_gen_free_result.
+typedef struct ffi_gen_result ffi_gen_result;
+
 enum FFIIntegerType {
     Bool,
     UInt8,
@@ -48,6 +52,29 @@ enum FFIForwardType {
     UNION
 };
 
+enum FFIDeclKind {
+    MACRO_DECL,
+    TYPEDEF_DECL,
+    FUNCTION_DECL,
+    ENUM_DECL,
+    STRUCT_DECL,
+    UNION_DECL,
+    VARIABLE_DECL,
+    FORWARD_DECL
+};
+
+enum FFIMacroValueType {
+    MACRO_NONE,    ///< Not a constant expression; only the spelling is known
+    MACRO_INTEGER,
+    MACRO_FLOAT,
+    MACRO_STRING
+};
+
+enum FFIDeliveryType {
+    DELIVER_SERIALIZED, ///< All callbacks on the calling thread, in file order
+    DELIVER_PER_TU      ///< Callbacks for file i through c[i], on a worker thread
+};
+
 struct FFIIntegerRef {
     enum FFIIntegerType type;
 };
@@ -86,12 +113,27 @@ struct FFIRecordMember {
     struct FFITypeRef *type;
 };
 
+/// Where a record member lives, as clang lays it out for the target
+struct FFIFieldLayout {
+    uint64_t offset;    ///< In bits from the start of the record
+    unsigned bit_width; ///< Width of a bitfield, otherwise 0
+    int is_bitfield;    ///< Set even for zero-width bitfields
+};
+
+/// The ASTRecordLayout of a record; all zero if the record isn't defined
+struct FFIRecordLayout {
+    uint64_t size;  ///< sizeof, in bytes, tail padding included
+    uint64_t align; ///< alignof, in bytes
+    const struct FFIFieldLayout *fields; ///< One per member, NULL if the members aren't listed
+};
+
 struct FFIStructRef {
     char *name;
     struct FFIRecordMember *members;
     size_t num_members;
     int anonymous;
     int defined;
+    struct FFIRecordLayout layout; ///< Sized for named records too, which list no members
 };
 
 struct FFIUnionRef {
@@ -100,6 +142,7 @@ struct FFIUnionRef {
     size_t num_members;
     int anonymous;
     int defined;
+    struct FFIRecordLayout layout; ///< Sized for named records too, which list no members
 };
 
 struct FFIPointerRef {
@@ -123,14 +166,77 @@ struct FFITypeRef {
     };
 };
 
-typedef void (*macro_callback)(const char *name, const char *definition, void *data);
+/// The value of an object-like macro whose expansion is a constant expression,
+/// computed with the target's type widths and C's conversion rules
+struct FFIMacroValue {
+    enum FFIMacroValueType type;
+    int is_unsigned;        ///< The integer should be read as a uint64_t
+    int64_t integer;
+    double floating;
+    const char *string;     ///< NUL-terminated, but may also contain NULs
+    size_t string_size;     ///< Excluding the terminator
+};
+
+/// Counters and phase timings describing the work done by one walk. Times
+/// are in nanoseconds of wall clock, summed over files for walk_files. A
+/// phase includes the conversions and callbacks made during it, so the
+/// phases don't add up to the whole walk.
+struct FFIGenStats {
+    size_t type_lookups;   ///< Types requested during conversion, repeats included
+    size_t type_nodes;     ///< Distinct type nodes converted and allocated, one type_for_qual call each
+    size_t arena_bytes;    ///< Bytes taken from the result's arena
+    size_t cache_hits;     ///< Files replayed from the declaration cache
+    size_t callbacks;      ///< Calls made into the callbacks struct
+    size_t decls_visited;  ///< Declarations looked at in the requested files
+    size_t decls_pruned;   ///< Top-level declarations skipped as outside them
+    size_t decls_emitted;  ///< Declarations reported or recorded, cached ones included
+    size_t decls_filtered; ///< Declarations and macros dropped by the symbol filters or not reachable from the roots
+    size_t decls_repeated; ///< Redeclarations, and entities another walk sharing the index reported
+    size_t decls_conflict; ///< Redeclarations skipped for differing from the one already reported
+    size_t decls_merged;   ///< Copies of declarations identical on several targets of walk_targets, delivered once
+    size_t macros_seen;    ///< Object-like macros defined in the requested files
+    size_t macros_emitted; ///< Macros left at the end of the TU and reported
+    size_t string_bytes;   ///< Bytes of names and spellings copied into the arena
+    uint64_t read_ns;      ///< Reading the main file
+    uint64_t setup_ns;     ///< Building the compiler instance, up to the first token
+    uint64_t parse_ns;     ///< Preprocessing and parsing, which clang interleaves
+    uint64_t macros_ns;    ///< Expanding, folding and reporting macros
+    uint64_t traverse_ns;  ///< Visiting the AST
+    uint64_t convert_ns;   ///< Converting clang types to FFITypeRefs
+    uint64_t callback_ns;  ///< Inside the callbacks struct
+    uint64_t merge_ns;     ///< Lining up the declarations of the targets of walk_targets
+};
+
+/// One declaration as handed to a batch_callback. The fields hold the
+/// arguments the per-kind callback would have received.
+struct FFIDecl {
+    enum FFIDeclKind kind;
+    const char *name;
+    const char *definition;    ///< Macro definition
+    const struct FFIMacroValue *value; ///< Macro value
+    struct FFITypeRef *type;   ///< Typedef target, variable type or return type
+    struct FFITypeRef *types;  ///< Member or parameter types
+    const char **names;        ///< Member or enumerator names
+    int64_t *values;           ///< Enumerator values
+    size_t count;              ///< Number of members, parameters or enumerators
+    int flag;                  ///< Record definedness or FFIForwardType
+    const struct FFIRecordLayout *layout; ///< Record layout
+    int cycle;                 ///< See ffi_gen_current_cycle
+};
+
+typedef void (*macro_callback)(const char *name, const char *definition, const struct FFIMacroValue *value, void *data);
 typedef void (*typedef_callback)(const char *name, struct FFITypeRef *to, void *data);
 typedef void (*function_callback)(const char *name, struct FFITypeRef *return_type, struct FFITypeRef *param_types, size_t num_params, void *data);
 typedef void (*enum_callback)(const char *name, const char **member_names, int64_t *member_values, size_t num_members, void *data);
-typedef void (*struct_callback)(const char *name, struct FFITypeRef *member_types, const char **member_names, size_t num_members, int defined, void *data);
-typedef void (*union_callback)(const char *name, struct FFITypeRef *member_types, const char **member_names, size_t num_members, int defined, void *data);
+typedef void (*struct_callback)(const char *name, struct FFITypeRef *member_types, const char **member_names, size_t num_members, int defined, const struct FFIRecordLayout *layout, void *data);
+typedef void (*union_callback)(const char *name, struct FFITypeRef *member_types, const char **member_names, size_t num_members, int defined, const struct FFIRecordLayout *layout, void *data);
 typedef void (*variable_callback)(const char *name, struct FFITypeRef *type, void *data);
 typedef void (*forward_callback)(const char *name, enum FFIForwardType type, void *data);
+typedef void (*batch_callback)(const struct FFIDecl *decls, size_t num_decls, void *data);
+
+/// Reports the number of declarations and macros processed so far by a walk,
+/// and the file the reporting thread is walking
+typedef void (*progress_callback)(size_t decls, const char *file, void *data);
 
 typedef struct {
     macro_callback mc;
@@ -142,9 +248,129 @@ typedef struct {
     variable_callback vc;
     forward_callback fdc;
     void *user_data;
+    batch_callback bc; ///< Used instead of the others when walk_options.batch_size is set
 } callbacks;
 
-void walk_file(
+/// A file that only exists in memory, visible to the walk at path. The
+/// contents are read in place and must be followed by a NUL byte, which
+/// size doesn't count, as clang's lexer expects.
+struct FFIFileOverlay {
+    const char *path;
+    const char *contents;
+    size_t size;
+};
+
+/// Entities reported so far, by USR, shared by every walk given it in
+/// walk_options.index. Walks on several threads may use one at once.
+typedef struct ffi_gen_index ffi_gen_index;
+
+/// Optional settings for a walk. A zeroed struct gives the defaults.
+typedef struct {
+    /// Directory for cached build products. When set, the forced -include
+    /// headers are precompiled there on first use and the PCH is reused by
+    /// later walks with identical arguments. Clang reports no macros
+    /// from a PCH, so when a requested source is among the files the
+    /// forced includes pull in, directly or not, the walk parses them
+    /// without it.
+    const char *cache_dir;
+
+    /// With cache_dir set, record each file's declarations and include graph
+    /// there. A file whose contents, arguments and dependencies are unchanged
+    /// is then replayed from the cache without invoking clang.
+    int incremental;
+
+    /// When set, every declaration delivered by the walk is also written to
+    /// this path as a snapshot (see ffi_gen_snapshot.h) once the walk ends
+    const char *snapshot_path;
+
+    /// When nonzero and the callbacks have bc set, declarations are
+    /// delivered in order through bc, up to batch_size at a time, once each
+    /// file has been walked
+    size_t batch_size;
+
+    /// Filters over declaration names, each "[<kind>:]<pattern>". A kind of
+    /// macro, typedef, function, enum, struct, union, variable or forward
+    /// limits the pattern to that kind of declaration. A pattern is a glob
+    /// (*, ? and [...]) unless written as /regex/, an extended regular
+    /// expression that must match the whole name. A declaration is kept if
+    /// it matches an include pattern for its kind, or there are none, and
+    /// matches no exclude pattern. Filtered declarations are dropped before
+    /// their types are converted.
+    const char **include_symbols;
+    size_t num_include_symbols;
+    const char **exclude_symbols;
+    size_t num_exclude_symbols;
+
+    /// When set, only these declarations and what their types depend on are
+    /// reported: the records, enums and typedefs reachable through typedefs,
+    /// pointers, arrays, function types and record fields. Roots are usually
+    /// functions and variables but may name any declaration, an enumerator
+    /// or a macro. Declarations keep their source order, in which C already
+    /// declares whatever a type needs by value before using it.
+    const char **root_symbols;
+    size_t num_root_symbols;
+
+    /// When set, called as each file starts and every progress_interval
+    /// declarations (every one if 0) from whichever thread is walking, one
+    /// call at a time
+    progress_callback progress;
+    void *progress_data;
+    size_t progress_interval;
+
+    /// When nonzero, the walk stops this many milliseconds after it started,
+    /// as if cancelled. The deadline is checked between top-level
+    /// declarations, so without streaming a parse in progress still runs to
+    /// its end.
+    uint64_t timeout_ms;
+
+    /// When nonzero, each declaration is reported as soon as clang has
+    /// parsed it rather than once the whole file has been, and a stopped
+    /// walk abandons the parse. Macros then follow the declarations instead
+    /// of preceding them. A record used before its definition is reported
+    /// as undefined at first and updated in place once the definition is
+    /// parsed, wherever it was reported: parameters and members taking it
+    /// by value are updated too. Functions declared without a prototype,
+    /// which a later declaration may still give parameters, are reported
+    /// once the whole file has been parsed. Ignored when root_symbols are
+    /// set or topological is.
+    int streaming;
+
+    /// When nonzero, each file's declarations are reported in dependency
+    /// order instead of the order clang parsed them: after every record,
+    /// enum and typedef their types refer to by name, through pointers
+    /// too. Declarations that depend on each other in a cycle, such as
+    /// records pointing to each other, are reported together, preceded by
+    /// forward declarations of the records among them; see
+    /// ffi_gen_current_cycle. A generator can then emit in one linear pass.
+    int topological;
+
+    /// Files mounted over the real filesystem for every parse of the walk,
+    /// shadowing any file at the same path. The forced -include headers
+    /// aren't precompiled while there are overlays, since they might be
+    /// among them.
+    const struct FFIFileOverlay *overlays;
+    size_t num_overlays;
+
+    /// When set, an entity already reported by any walk sharing the index is
+    /// skipped, so each is reported once per session rather than once per
+    /// TU. One whose type, members or definition differ from what was
+    /// reported is skipped too, and flagged on stderr. Redeclarations
+    /// within a TU are always skipped. The files of one walk_files call
+    /// claim their entities in file order, however many threads parse
+    /// them. Walks with an index don't use the incremental declaration
+    /// cache, whose replays the index can't see.
+    ffi_gen_index *index;
+
+    /// When set, a timeline of the walk is written there once it ends, as
+    /// Chrome trace-event JSON for chrome://tracing or Perfetto. It has a
+    /// span per thread for each file walked, the clang invocation and its
+    /// setup and parse, every declaration and macro reported, the type
+    /// conversions and each call into the callbacks. Delivery through
+    /// ffi_gen_replay comes after the trace is written and isn't in it.
+    const char *trace_path;
+} walk_options;
+
+ffi_gen_result *walk_file(
     const char *filename,
     const char **clang_args,
     int argc,
@@ -153,6 +379,228 @@ void walk_file(
     callbacks *c
 );
 
+/// walk_file with options; opts may be NULL
+ffi_gen_result *walk_file_opts(
+    const char *filename,
+    const char **clang_args,
+    int argc,
+    const char **source_locations,
+    int nloc,
+    callbacks *c,
+    const walk_options *opts
+);
+
+/// walk_file_opts on a header held in memory, parsed in place as if it were
+/// the file at filename, which need not exist. Like an overlay, buffer must
+/// be followed by a NUL byte that size doesn't count.
+ffi_gen_result *walk_buffer(
+    const char *filename,
+    const char *buffer,
+    size_t size,
+    const char **clang_args,
+    int argc,
+    const char **source_locations,
+    int nloc,
+    callbacks *c,
+    const walk_options *opts
+);
+
+/// Walks every file in its own translation unit on up to nthreads worker
+/// threads (all cores if nthreads <= 0). With no source_locations, each file
+/// reports only its own declarations.
+///
+/// DELIVER_SERIALIZED invokes the single callbacks struct c on the calling
+/// thread, file by file as each one finishes. DELIVER_PER_TU expects nfiles
+/// callbacks structs and invokes them concurrently from the workers.
+ffi_gen_result *walk_files(
+    const char **filenames,
+    int nfiles,
+    const char **clang_args,
+    int argc,
+    const char **source_locations,
+    int nloc,
+    int nthreads,
+    enum FFIDeliveryType delivery,
+    callbacks *c,
+    const walk_options *opts
+);
+
+/// Walks filename once for each target triple, adding -target <triple> to
+/// clang_args, with the targets parsed in parallel, and delivers the merged
+/// declarations to c on the calling thread. A declaration every target
+/// reports identically, types, layouts and values included, is delivered
+/// once; one that differs, such as a struct holding a long, is delivered
+/// once per distinct variant. ffi_gen_current_targets tells which targets a
+/// delivery stands for. Declarations come in the order of the first target
+/// reporting them.
+///
+/// At most 64 targets are walked; with none, the result is empty.
+/// opts.index and opts.snapshot_path are ignored. With c NULL the
+/// declarations are kept for ffi_gen_replay.
+ffi_gen_result *walk_targets(
+    const char *filename,
+    const char **targets,
+    int ntargets,
+    const char **clang_args,
+    int argc,
+    const char **source_locations,
+    int nloc,
+    callbacks *c,
+    const walk_options *opts
+);
+
+/// Index of the file whose declarations are being delivered to the calling
+/// thread, or of the first target reporting them for walk_targets; -1
+/// outside of a callback
+int ffi_gen_current_unit(void);
+
+/// For walks with walk_options.topological, a number shared by the
+/// declarations of one cycle of mutually dependent declarations, including
+/// the forward declarations reported before them, or 0 for declarations
+/// outside of any cycle. Numbers are per file. Batches carry it in
+/// FFIDecl.cycle instead.
+int ffi_gen_current_cycle(void);
+
+/// Bit t is set for each target t of walk_targets that reports the
+/// declaration being delivered exactly as delivered; 0 outside of a
+/// walk_targets callback
+uint64_t ffi_gen_current_targets(void);
+
+/// The result that owns the types passed to the current callback, for use
+/// with the handle API below while the walk is still running; NULL outside
+/// of a callback
+ffi_gen_result *ffi_gen_current_result(void);
+
+ffi_gen_index *ffi_gen_index_new(void);
+void ffi_gen_index_free(ffi_gen_index *index);
+
+/// Releases the whole type graph of a walk at once
+void ffi_gen_free_result(ffi_gen_result *result);
+
+/// Copies the counters of a finished walk into stats
+void ffi_gen_result_stats(const ffi_gen_result *result, struct FFIGenStats *stats);
+
+/// 0 if the walk was cancelled or ran out of time, in which case the result
+/// holds whatever was reported before it stopped and nothing was cached
+int ffi_gen_result_complete(const ffi_gen_result *result);
+
+/*
+ * Asynchronous walks: walk_files on a background thread, which records the
+ * declarations instead of invoking any callbacks. The caller polls or waits
+ * for it, may cancel it, and once it is finished delivers the declarations
+ * on its own thread with ffi_gen_replay, or gives up on it with
+ * ffi_gen_walk_free. Cancellation is cooperative and honoured between
+ * top-level declarations and between files.
+ */
+
+typedef struct ffi_gen_walk ffi_gen_walk;
+
+/// Starts the walk and returns at once. Every argument is copied; the
+/// progress callback in opts is invoked from the walking threads.
+ffi_gen_walk *walk_files_async(
+    const char **filenames,
+    int nfiles,
+    const char **clang_args,
+    int argc,
+    const char **source_locations,
+    int nloc,
+    int nthreads,
+    const walk_options *opts
+);
+
+/// 1 once the walk has ended, finished or stopped, otherwise 0
+int ffi_gen_walk_poll(ffi_gen_walk *walk);
+
+/// Waits up to timeout_ms for the walk to end, or for as long as it takes if
+/// timeout_ms is negative; returns as ffi_gen_walk_poll
+int ffi_gen_walk_wait(ffi_gen_walk *walk, int64_t timeout_ms);
+
+/// Asks the walk to stop at the next check; returns immediately
+void ffi_gen_walk_cancel(ffi_gen_walk *walk);
+
+/// Stores the number of declarations and macros processed so far in decls
+/// and returns the index of the file most recently started, or -1
+int ffi_gen_walk_progress(ffi_gen_walk *walk, size_t *decls);
+
+/// Waits for the walk to end, releases walk and returns its result
+ffi_gen_result *ffi_gen_walk_finish(ffi_gen_walk *walk);
+
+/// Cancels a walk that won't be finished and releases it along with its
+/// result, without waiting: a walk still running is left to free itself
+/// once it stops. Anything opts borrowed, such as the index, must outlive
+/// that.
+void ffi_gen_walk_free(ffi_gen_walk *walk);
+
+/// Delivers the declarations recorded by an asynchronous walk to c on the
+/// calling thread, file by file, as DELIVER_SERIALIZED would have. With a
+/// nonzero batch_size and c->bc set, they are handed over in batches.
+void ffi_gen_replay(ffi_gen_result *result, callbacks *c, size_t batch_size);
+
+/*
+ * Handle API: an alternative to walking FFITypeRef pointers. A handle is a
+ * 32-bit index into a per-result table of the types asked for and their
+ * child ranges. It is a view of the FFITypeRef graph, not a cheaper form of
+ * it: the walk converts every type either way, and the table costs a little
+ * more for each type reached through it. Any type a callback receives can be
+ * turned into a handle, during the callback or after it, until the result
+ * is freed. Handles are only meaningful together with the result they came
+ * from, and a result's table must not be used from two threads at once.
+ */
+
+typedef uint32_t ffi_gen_type;
+
+/// Returned where there is no type, and accepted everywhere as an empty type
+#define FFI_GEN_NO_TYPE 0xffffffffu
+
+enum FFITypeFlags {
+    FFI_GEN_TYPE_ANONYMOUS = 1,
+    FFI_GEN_TYPE_DEFINED = 2
+};
+
+/// Handle for a type reported by a walk of result, or FFI_GEN_NO_TYPE for
+/// NULL. A type gets the same handle wherever it was reported, as a return
+/// type, parameter or member alike.
+ffi_gen_type ffi_gen_type_handle(ffi_gen_result *result, const struct FFITypeRef *type);
+
+enum FFIRefType ffi_gen_type_kind(ffi_gen_result *result, ffi_gen_type h);
+
+/// Qualified spelling of the type
+const char *ffi_gen_type_name(ffi_gen_result *result, ffi_gen_type h);
+
+/// Name of an enum, struct or union, otherwise NULL
+const char *ffi_gen_type_tag(ffi_gen_result *result, ffi_gen_type h);
+
+/// FFIIntegerType or FFIFloatType, or -1 for other kinds
+int ffi_gen_type_subtype(ffi_gen_result *result, ffi_gen_type h);
+
+/// FFITypeFlags of an enum, struct or union
+int ffi_gen_type_flags(ffi_gen_result *result, ffi_gen_type h);
+
+uint64_t ffi_gen_array_size(ffi_gen_result *result, ffi_gen_type h);
+
+/// Pointed-to type, array or flexible array element, or function return
+/// type; FFI_GEN_NO_TYPE for other kinds
+ffi_gen_type ffi_gen_type_pointee(ffi_gen_result *result, ffi_gen_type h);
+
+size_t ffi_gen_record_num_fields(ffi_gen_result *result, ffi_gen_type h);
+ffi_gen_type ffi_gen_record_field(ffi_gen_result *result, ffi_gen_type h, size_t i);
+
+/// NULL for an anonymous member
+const char *ffi_gen_record_field_name(ffi_gen_result *result, ffi_gen_type h, size_t i);
+
+/// sizeof and alignof in bytes, or 0 if the record isn't defined
+uint64_t ffi_gen_record_size(ffi_gen_result *result, ffi_gen_type h);
+uint64_t ffi_gen_record_align(ffi_gen_result *result, ffi_gen_type h);
+
+/// Offset of member i in bits from the start of the record
+uint64_t ffi_gen_record_field_offset(ffi_gen_result *result, ffi_gen_type h, size_t i);
+
+/// Width of member i if it is a bitfield, otherwise -1
+int ffi_gen_record_field_bit_width(ffi_gen_result *result, ffi_gen_type h, size_t i);
+
+size_t ffi_gen_function_num_params(ffi_gen_result *result, ffi_gen_type h);
+ffi_gen_type ffi_gen_function_param(ffi_gen_result *result, ffi_gen_type h, size_t i);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -43,6 +43,29 @@ module FFIGen
     :UNION
   ]
 
+  enum :FFIDeclKind, [
+    :macro_decl,
+    :typedef_decl,
+    :function_decl,
+    :enum_decl,
+    :struct_decl,
+    :union_decl,
+    :variable_decl,
+    :forward_decl
+  ]
+
+  enum :FFIMacroValueType, [
+    :macro_none,
+    :macro_integer,
+    :macro_float,
+    :macro_string
+  ]
+
+  enum :FFIDeliveryType, [
+    :deliver_serialized,
+    :deliver_per_tu
+  ]
+
   class FFITypeRef < FFI::Struct
   end
 
@@ -82,12 +105,25 @@ module FFIGen
            :type, FFITypeRef.by_ref
   end
 
+  class FFIFieldLayout < FFI::Struct
+    layout :offset, :uint64,
+           :bit_width, :uint,
+           :is_bitfield, :int
+  end
+
+  class FFIRecordLayout < FFI::Struct
+    layout :size, :uint64,
+           :align, :uint64,
+           :fields, :pointer
+  end
+
   class FFIStructRef < FFI::Struct
     layout :name, :string,
            :members, FFIRecordMember.by_ref,
            :num_members, :size_t,
            :anonymous, :int,
-           :defined, :int
+           :defined, :int,
+           :layout, FFIRecordLayout.by_value
   end
 
   class FFIUnionRef < FFI::Struct
@@ -95,7 +131,8 @@ module FFIGen
            :members, FFIRecordMember.by_ref,
            :num_members, :size_t,
            :anonymous, :int,
-           :defined, :int
+           :defined, :int,
+           :layout, FFIRecordLayout.by_value
   end
 
   class FFIPointerRef < FFI::Struct
@@ -121,8 +158,70 @@ module FFIGen
            :kind, FFITypeUnion.by_value
   end
 
-  # typedef void (*macro_callback)(const char *name, const char *definition, void *data);
-  callback :macro_callback, [:string, :string, :pointer], :void
+  class FFIMacroValue < FFI::Struct
+    layout :type, :FFIMacroValueType,
+           :is_unsigned, :int,
+           :integer, :int64,
+           :floating, :double,
+           :string, :pointer,
+           :string_size, :size_t
+
+    # The value as a Ruby Integer, Float or String, or nil
+    def value
+      case self[:type]
+      when :macro_integer
+        self[:is_unsigned] != 0 ? [self[:integer]].pack('q').unpack('Q').first : self[:integer]
+      when :macro_float
+        self[:floating]
+      when :macro_string
+        self[:string].read_bytes(self[:string_size])
+      end
+    end
+  end
+
+  class FFIGenStats < FFI::Struct
+    layout :type_lookups, :size_t,
+           :type_nodes, :size_t,
+           :arena_bytes, :size_t,
+           :cache_hits, :size_t,
+           :callbacks, :size_t,
+           :decls_visited, :size_t,
+           :decls_pruned, :size_t,
+           :decls_emitted, :size_t,
+           :decls_filtered, :size_t,
+           :decls_repeated, :size_t,
+           :decls_conflict, :size_t,
+           :decls_merged, :size_t,
+           :macros_seen, :size_t,
+           :macros_emitted, :size_t,
+           :string_bytes, :size_t,
+           :read_ns, :uint64,
+           :setup_ns, :uint64,
+           :parse_ns, :uint64,
+           :macros_ns, :uint64,
+           :traverse_ns, :uint64,
+           :convert_ns, :uint64,
+           :callback_ns, :uint64,
+           :merge_ns, :uint64
+  end
+
+  class FFIDecl < FFI::Struct
+    layout :kind, :FFIDeclKind,
+           :name, :string,
+           :definition, :string,
+           :value, FFIMacroValue.by_ref,
+           :type, FFITypeRef.by_ref,
+           :types, :pointer,
+           :names, :pointer,
+           :values, :pointer,
+           :count, :size_t,
+           :flag, :int,
+           :layout, FFIRecordLayout.by_ref,
+           :cycle, :int
+  end
+
+  # typedef void (*macro_callback)(const char *name, const char *definition, const struct FFIMacroValue *value, void *data);
+  callback :macro_callback, [:string, :string, FFIMacroValue.by_ref, :pointer], :void
 
   # typedef void (*typedef_callback)(const char *name, FFITypeRef *to, void *data);
   callback :typedef_callback, [:string, FFITypeRef.by_ref, :pointer], :void
@@ -133,11 +232,11 @@ module FFIGen
   # typedef void (*enum_callback)(const char *name, const char **member_names, int64_t *member_values, size_t num_members, void *data);
   callback :enum_callback, [:string, :pointer, :pointer, :size_t, :pointer], :void
 
-  # typedef void (*struct_callback)(const char *name, struct FFITypeRef *member_types, const char **member_names, size_t num_members, int defined, void *data);
-  callback :struct_callback, [:string, FFITypeRef.by_ref, :pointer, :size_t, :int, :pointer], :void
+  # typedef void (*struct_callback)(const char *name, struct FFITypeRef *member_types, const char **member_names, size_t num_members, int defined, const struct FFIRecordLayout *layout, void *data);
+  callback :struct_callback, [:string, FFITypeRef.by_ref, :pointer, :size_t, :int, FFIRecordLayout.by_ref, :pointer], :void
 
-  # typedef void (*union_callback)(const char *name, FFITypeRef *member_types, const char **member_names, size_t num_members, int defined, void *data);
-  callback :union_callback, [:string, FFITypeRef.by_ref, :pointer, :size_t, :int, :pointer], :void
+  # typedef void (*union_callback)(const char *name, FFITypeRef *member_types, const char **member_names, size_t num_members, int defined, const struct FFIRecordLayout *layout, void *data);
+  callback :union_callback, [:string, FFITypeRef.by_ref, :pointer, :size_t, :int, FFIRecordLayout.by_ref, :pointer], :void
 
   # typedef void (*variable_callback)(const char *name, struct FFITypeRef *type, void *data);
   callback :variable_callback, [:string, FFITypeRef.by_ref, :pointer], :void
@@ -145,6 +244,12 @@ module FFIGen
   # typedef void (*forward_callback)(const char *name, enum FFIForwardType type, void *data);
   callback :forward_callback, [:string, :FFIForwardType, :pointer], :void
 
+  # typedef void (*batch_callback)(const struct FFIDecl *decls, size_t num_decls, void *data);
+  callback :batch_callback, [:pointer, :size_t, :pointer], :void
+
+  # typedef void (*progress_callback)(size_t decls, const char *file, void *data);
+  callback :progress_callback, [:size_t, :string, :pointer], :void
+
   class Callbacks < FFI::Struct
     layout :mc, :macro_callback,
            :tc, :typedef_callback,
@@ -154,21 +259,379 @@ module FFIGen
            :uc, :union_callback,
            :vc, :variable_callback,
            :fdc, :forward_callback,
-           :data, :pointer
+           :data, :pointer,
+           :bc, :batch_callback
+  end
+
+  class FFIFileOverlay < FFI::Struct
+    layout :path, :pointer,
+           :contents, :pointer,
+           :size, :size_t
+  end
+
+  class WalkOptions < FFI::Struct
+    layout :cache_dir, :pointer,
+           :incremental, :int,
+           :snapshot_path, :pointer,
+           :batch_size, :size_t,
+           :include_symbols, :pointer,
+           :num_include_symbols, :size_t,
+           :exclude_symbols, :pointer,
+           :num_exclude_symbols, :size_t,
+           :root_symbols, :pointer,
+           :num_root_symbols, :size_t,
+           :progress, :progress_callback,
+           :progress_data, :pointer,
+           :progress_interval, :size_t,
+           :timeout_ms, :uint64,
+           :streaming, :int,
+           :topological, :int,
+           :overlays, :pointer,
+           :num_overlays, :size_t,
+           :index, :pointer,
+           :trace_path, :pointer
+  end
+
+  # ffi_gen_result *walk_file(const char *filename, const char **clang_args, int argc, const char **source_locations, int nloc, callbacks *c);
+  attach_function :walk_file, [:string, :pointer, :int, :pointer, :int, :pointer], :pointer
+
+  # ffi_gen_result *walk_buffer(const char *filename, const char *buffer, size_t size, const char **clang_args, int argc, const char **source_locations, int nloc, callbacks *c, const walk_options *opts);
+  attach_function :walk_buffer, [:string, :pointer, :size_t, :pointer, :int, :pointer, :int, :pointer, :pointer], :pointer
+
+  # ffi_gen_result *walk_file_opts(const char *filename, const char **clang_args, int argc, const char **source_locations, int nloc, callbacks *c, const walk_options *opts);
+  attach_function :walk_file_opts, [:string, :pointer, :int, :pointer, :int, :pointer, :pointer], :pointer
+
+  # ffi_gen_index *ffi_gen_index_new(void);
+  attach_function :ffi_gen_index_new, [], :pointer
+
+  # void ffi_gen_index_free(ffi_gen_index *index);
+  attach_function :ffi_gen_index_free, [:pointer], :void
+
+  # Entities reported so far by the walks given this as their index,
+  # which may run at once. An async walk only borrows it, so it has to
+  # outlive the walk.
+  class Index < FFI::AutoPointer
+    def self.release(pointer)
+      FFIGen.ffi_gen_index_free(pointer)
+    end
+
+    def initialize
+      super(FFIGen.ffi_gen_index_new)
+    end
+  end
+
+  # void ffi_gen_free_result(ffi_gen_result *result);
+  attach_function :ffi_gen_free_result, [:pointer], :void
+
+  # void ffi_gen_result_stats(const ffi_gen_result *result, struct FFIGenStats *stats);
+  attach_function :ffi_gen_result_stats, [:pointer, FFIGenStats.by_ref], :void
+
+  # ffi_gen_result *walk_files(const char **filenames, int nfiles, const char **clang_args, int argc, const char **source_locations, int nloc, int nthreads, enum FFIDeliveryType delivery, callbacks *c, const walk_options *opts);
+  attach_function :walk_files, [:pointer, :int, :pointer, :int, :pointer, :int, :int, :FFIDeliveryType, :pointer, :pointer], :pointer
+
+  # ffi_gen_result *walk_targets(const char *filename, const char **targets, int ntargets, const char **clang_args, int argc, const char **source_locations, int nloc, callbacks *c, const walk_options *opts);
+  attach_function :walk_targets, [:string, :pointer, :int, :pointer, :int, :pointer, :int, :pointer, :pointer], :pointer
+
+  # int ffi_gen_current_unit(void);
+  attach_function :ffi_gen_current_unit, [], :int
+
+  # uint64_t ffi_gen_current_targets(void);
+  attach_function :ffi_gen_current_targets, [], :uint64
+
+  # int ffi_gen_current_cycle(void);
+  attach_function :ffi_gen_current_cycle, [], :int
+
+  # ffi_gen_result *ffi_gen_current_result(void);
+  attach_function :ffi_gen_current_result, [], :pointer
+
+  # int ffi_gen_result_complete(const ffi_gen_result *result);
+  attach_function :ffi_gen_result_complete, [:pointer], :int
+
+  # ffi_gen_walk *walk_files_async(const char **filenames, int nfiles, const char **clang_args, int argc, const char **source_locations, int nloc, int nthreads, const walk_options *opts);
+  attach_function :walk_files_async, [:pointer, :int, :pointer, :int, :pointer, :int, :int, :pointer], :pointer
+
+  # int ffi_gen_walk_poll(ffi_gen_walk *walk);
+  attach_function :ffi_gen_walk_poll, [:pointer], :int
+
+  # Waiting releases the GVL, so other Ruby threads run meanwhile
+  # int ffi_gen_walk_wait(ffi_gen_walk *walk, int64_t timeout_ms);
+  attach_function :ffi_gen_walk_wait, [:pointer, :int64], :int, blocking: true
+
+  # void ffi_gen_walk_cancel(ffi_gen_walk *walk);
+  attach_function :ffi_gen_walk_cancel, [:pointer], :void
+
+  # int ffi_gen_walk_progress(ffi_gen_walk *walk, size_t *decls);
+  attach_function :ffi_gen_walk_progress, [:pointer, :pointer], :int
+
+  # ffi_gen_result *ffi_gen_walk_finish(ffi_gen_walk *walk);
+  attach_function :ffi_gen_walk_finish, [:pointer], :pointer, blocking: true
+
+  # void ffi_gen_walk_free(ffi_gen_walk *walk);
+  attach_function :ffi_gen_walk_free, [:pointer], :void
+
+  # void ffi_gen_replay(ffi_gen_result *result, callbacks *c, size_t batch_size);
+  attach_function :ffi_gen_replay, [:pointer, :pointer, :size_t], :void
+
+  # Handle API; see ffi_gen.h. Every function takes the result first.
+  typedef :uint32, :ffi_gen_type
+
+  NO_TYPE = 0xffffffff
+
+  attach_function :ffi_gen_type_handle, [:pointer, FFITypeRef.by_ref], :ffi_gen_type
+  attach_function :ffi_gen_type_kind, [:pointer, :ffi_gen_type], :FFIRefType
+  attach_function :ffi_gen_type_name, [:pointer, :ffi_gen_type], :string
+  attach_function :ffi_gen_type_tag, [:pointer, :ffi_gen_type], :string
+  attach_function :ffi_gen_type_subtype, [:pointer, :ffi_gen_type], :int
+  attach_function :ffi_gen_type_flags, [:pointer, :ffi_gen_type], :int
+  attach_function :ffi_gen_array_size, [:pointer, :ffi_gen_type], :uint64
+  attach_function :ffi_gen_type_pointee, [:pointer, :ffi_gen_type], :ffi_gen_type
+  attach_function :ffi_gen_record_num_fields, [:pointer, :ffi_gen_type], :size_t
+  attach_function :ffi_gen_record_field, [:pointer, :ffi_gen_type, :size_t], :ffi_gen_type
+  attach_function :ffi_gen_record_field_name, [:pointer, :ffi_gen_type, :size_t], :string
+  attach_function :ffi_gen_record_size, [:pointer, :ffi_gen_type], :uint64
+  attach_function :ffi_gen_record_align, [:pointer, :ffi_gen_type], :uint64
+  attach_function :ffi_gen_record_field_offset, [:pointer, :ffi_gen_type, :size_t], :uint64
+  attach_function :ffi_gen_record_field_bit_width, [:pointer, :ffi_gen_type, :size_t], :int
+  attach_function :ffi_gen_function_num_params, [:pointer, :ffi_gen_type], :size_t
+  attach_function :ffi_gen_function_param, [:pointer, :ffi_gen_type, :size_t], :ffi_gen_type
+
+  # Options:
+  #   cache_dir:   directory in which to keep a precompiled header of the
+  #                forced -include prefix, reused while the arguments and
+  #                those headers stay the same
+  #   incremental: also cache each file's declarations in cache_dir and
+  #                replay them without parsing while nothing they depend on
+  #                has changed
+  #   batch_size:  hand declarations over up to this many per call into Ruby
+  #                instead of one call each; the callback sees no difference
+  #   include_symbols, exclude_symbols:
+  #                name patterns, optionally prefixed by a kind such as
+  #                'function:'; see walk_options in ffi_gen.h. Declarations
+  #                filtered out never reach the callback
+  #   roots:       names of the functions and variables to bind; only they
+  #                and the types they depend on are reported
+  #   timeout:     seconds after which the walk gives up; the stats then
+  #                have complete: false
+  #   streaming:   report each declaration as soon as it is parsed; macros
+  #                then come after the declarations
+  #   topological: report each declaration after everything its types refer
+  #                to, with forward declarations ahead of records that refer
+  #                to each other; see current_cycle
+  #   overlays:    { path => contents } of headers that only exist in
+  #                memory, shadowing any file at the same path
+  #   index:       an FFIGen::Index shared by the walks of a session, which
+  #                then report each entity once; conflicting redeclarations
+  #                are skipped and printed to stderr
+  #   trace:       path to write a Chrome trace-event timeline of the walk
+  #                to, showing where the time went: parsing, conversion or
+  #                the callback
+  def self.inspect_file(filename, source_filter, args, callback, **options)
+    argv, _argv_strings = string_array(args)
+    sources, _source_strings = string_array(source_filter)
+    cb = callbacks_for(callback)
+    opts, _opt_strings = walk_options(**options)
+
+    # Every type reference is only valid until the result is freed, so the
+    # callback has to copy out whatever it wants to keep
+    result = walk_file_opts(filename, argv, args.size, sources, source_filter.size, cb, opts)
+
+    collect_stats(result)
+  end
+
+  # inspect_file on a header held in a string, parsed as if it were the file
+  # at filename, which need not exist
+  def self.inspect_buffer(filename, contents, source_filter, args, callback, **options)
+    buffer = FFI::MemoryPointer.from_string(contents)
+    argv, _argv_strings = string_array(args)
+    sources, _source_strings = string_array(source_filter)
+    cb = callbacks_for(callback)
+    opts, _opt_strings = walk_options(**options)
+
+    result = walk_buffer(filename, buffer, contents.bytesize, argv, args.size, sources, source_filter.size, cb, opts)
+
+    collect_stats(result)
+  end
+
+  # Parses every file in its own translation unit on up to `threads` native
+  # threads (all cores when 0). The callback is still invoked on this thread,
+  # one file at a time and in order; FFIGen.ffi_gen_current_unit tells which
+  # file a declaration came from. An empty source_filter means each file
+  # reports its own declarations.
+  def self.inspect_files(filenames, source_filter, args, callback, threads: 0, **options)
+    files, _file_strings = string_array(filenames)
+    argv, _argv_strings = string_array(args)
+    sources, _source_strings = string_array(source_filter)
+    cb = callbacks_for(callback)
+    opts, _opt_strings = walk_options(**options)
+
+    result = walk_files(files, filenames.size, argv, args.size, sources, source_filter.size,
+                        threads, :deliver_serialized, cb, opts)
+
+    collect_stats(result)
+  end
+
+  # Parses filename once per target triple, in parallel, and hands the
+  # merged declarations to the callback: once when every target agrees on
+  # one, otherwise once per variant. During a callback,
+  # FFIGen.current_targets(targets) lists the triples the declaration holds
+  # for. Stats have decls_merged, the copies that were left out.
+  def self.inspect_targets(filename, targets, source_filter, args, callback, **options)
+    triples, _triple_strings = string_array(targets)
+    argv, _argv_strings = string_array(args)
+    sources, _source_strings = string_array(source_filter)
+    cb = callbacks_for(callback)
+    opts, _opt_strings = walk_options(**options)
+
+    result = walk_targets(filename, triples, targets.size, argv, args.size, sources, source_filter.size, cb, opts)
+
+    collect_stats(result)
+  end
+
+  # During a callback of a topological walk, the number shared by the
+  # declarations of one dependency cycle, or 0 outside of any
+  def self.current_cycle
+    Thread.current[:ffi_gen_cycle] || ffi_gen_current_cycle
+  end
+
+  # The triples, out of those given to inspect_targets, of the declaration
+  # being delivered
+  def self.current_targets(targets)
+    mask = ffi_gen_current_targets
+    targets.each_index.select { |t| mask[t] == 1 }.map { |t| targets[t] }
+  end
+
+  # A walk running on native threads, started by inspect_files_async. Nothing
+  # reaches Ruby until finish, which delivers every declaration in order. A
+  # walk that is dropped without finish is cancelled and freed when it is
+  # garbage collected.
+  class AsyncWalk
+    class Handle < FFI::AutoPointer
+      def self.release(pointer)
+        FFIGen.ffi_gen_walk_free(pointer)
+      end
+    end
+
+    def initialize(handle)
+      @handle = Handle.new(handle)
+    end
+
+    def done?
+      FFIGen.ffi_gen_walk_poll(@handle) == 1
+    end
+
+    # Waits up to timeout seconds, or indefinitely when nil, without holding
+    # the GVL; returns done?
+    def wait(timeout = nil)
+      FFIGen.ffi_gen_walk_wait(@handle, timeout ? (timeout * 1000).to_i : -1) == 1
+    end
+
+    # Stops the walk at its next top-level declaration
+    def cancel
+      FFIGen.ffi_gen_walk_cancel(@handle)
+    end
+
+    # Returns [declarations processed, index of the file being walked or nil]
+    def progress
+      decls = FFI::MemoryPointer.new(:size_t)
+      file = FFIGen.ffi_gen_walk_progress(@handle, decls)
+
+      [decls.read(:size_t), file.negative? ? nil : file]
+    end
+
+    # Waits for the walk, hands its declarations to callback and returns the
+    # stats; complete: false when it was cancelled or timed out
+    def finish(callback, batch_size: 0)
+      @handle.autorelease = false
+      result = FFIGen.ffi_gen_walk_finish(@handle)
+      @handle = nil
+
+      FFIGen.ffi_gen_replay(result, FFIGen.callbacks_for(callback), batch_size)
+      FFIGen.collect_stats(result)
+    end
+  end
+
+  # inspect_files without blocking: the walk starts on native threads and
+  # the returned AsyncWalk is polled, waited on or cancelled. Every argument
+  # is copied before this returns.
+  def self.inspect_files_async(filenames, source_filter, args, threads: 0, **options)
+    files, _file_strings = string_array(filenames)
+    argv, _argv_strings = string_array(args)
+    sources, _source_strings = string_array(source_filter)
+    opts, _opt_strings = walk_options(**options)
+
+    AsyncWalk.new(walk_files_async(files, filenames.size, argv, args.size, sources, source_filter.size, threads, opts))
   end
 
-  # void walk_file(const char *filename, const char **clang_args, int argc, const char **source_locations, int nloc, callbacks *c);
-  attach_function :walk_file, [:string, :pointer, :int, :pointer, :int, :pointer], :void
+  # Returns a char ** for the strings, along with the buffers backing it,
+  # which must be kept alive for as long as the array is in use
+  def self.string_array(strings)
+    buffers = strings.map { |s| FFI::MemoryPointer.from_string(s) }
+    array = FFI::MemoryPointer.new(:pointer, [buffers.count, 1].max)
+    array.write_array_of_pointer(buffers)
 
-  def self.inspect_file(filename, source_filter, args, callback)
-    argv = FFI::MemoryPointer.new(:pointer, args.count)
-    args.map!{|a| FFI::MemoryPointer.from_string(a) }
-    argv.write_array_of_pointer(args)
+    [array, buffers]
+  end
 
-    sources = FFI::MemoryPointer.new(:pointer, source_filter.count)
-    source_filter.map!{|f| FFI::MemoryPointer.from_string(f) }
-    sources.write_array_of_pointer(source_filter)
+  # Returns a walk_options struct, along with the strings it points to
+  def self.walk_options(cache_dir: nil, incremental: false, snapshot_path: nil, batch_size: 0,
+                        include_symbols: [], exclude_symbols: [], roots: [], timeout: nil,
+                        streaming: false, topological: false, overlays: {}, index: nil, trace: nil)
+    opts = WalkOptions.new
+    strings = []
+
+    opts[:incremental] = incremental ? 1 : 0
+    opts[:batch_size] = batch_size
+    opts[:streaming] = streaming ? 1 : 0
+    opts[:topological] = topological ? 1 : 0
+    opts[:timeout_ms] = (timeout * 1000).ceil if timeout
+    opts[:index] = index if index
+
+    if cache_dir
+      strings << FFI::MemoryPointer.from_string(cache_dir)
+      opts[:cache_dir] = strings.last
+    end
+
+    if snapshot_path
+      strings << FFI::MemoryPointer.from_string(snapshot_path)
+      opts[:snapshot_path] = strings.last
+    end
+
+    if trace
+      strings << FFI::MemoryPointer.from_string(trace)
+      opts[:trace_path] = strings.last
+    end
+
+    includes, include_strings = string_array(include_symbols)
+    excludes, exclude_strings = string_array(exclude_symbols)
+    root_array, root_strings = string_array(roots)
+    strings.push(includes, excludes, root_array, *include_strings, *exclude_strings, *root_strings)
+    opts[:include_symbols] = includes
+    opts[:num_include_symbols] = include_symbols.size
+    opts[:exclude_symbols] = excludes
+    opts[:num_exclude_symbols] = exclude_symbols.size
+    opts[:root_symbols] = root_array
+    opts[:num_root_symbols] = roots.size
+
+    unless overlays.empty?
+      array = FFI::MemoryPointer.new(FFIFileOverlay, overlays.size)
+      strings << array
+
+      overlays.each_with_index do |(path, contents), i|
+        o = FFIFileOverlay.new(array + i * FFIFileOverlay.size)
+        strings.push(FFI::MemoryPointer.from_string(path), FFI::MemoryPointer.from_string(contents))
+        o[:path] = strings[-2]
+        o[:contents] = strings[-1]
+        o[:size] = contents.bytesize
+      end
+
+      opts[:overlays] = array
+      opts[:num_overlays] = overlays.size
+    end
+
+    [opts, strings]
+  end
 
+  def self.callbacks_for(callback)
     cb = Callbacks.new
     cb[:mc] = callback.method(:define_macro)
     cb[:tc] = callback.method(:define_typedef)
@@ -176,8 +639,47 @@ module FFIGen
     cb[:ec] = callback.method(:define_enum)
     cb[:sc] = callback.method(:define_struct)
     cb[:uc] = callback.method(:define_union)
+    cb[:vc] = callback.method(:define_variable)
     cb[:fdc] = callback.method(:declare_forward)
+    cb[:bc] = ->(decls, num_decls, _data) { dispatch_batch(callback, decls, num_decls) }
+    cb
+  end
+
+  # Unpacks a batch into the same calls the per-kind callbacks would make
+  def self.dispatch_batch(callback, decls, num_decls)
+    (0...num_decls).each do |i|
+      d = FFIDecl.new(decls + i * FFIDecl.size)
+      Thread.current[:ffi_gen_cycle] = d[:cycle]
+
+      case d[:kind]
+      when :macro_decl
+        callback.define_macro(d[:name], d[:definition], d[:value], nil)
+      when :typedef_decl
+        callback.define_typedef(d[:name], d[:type], nil)
+      when :function_decl
+        callback.define_function(d[:name], d[:type], d[:types], d[:count], nil)
+      when :enum_decl
+        callback.define_enum(d[:name], d[:names], d[:values], d[:count], nil)
+      when :struct_decl
+        callback.define_struct(d[:name], d[:types], d[:names], d[:count], d[:flag], d[:layout], nil)
+      when :union_decl
+        callback.define_union(d[:name], d[:types], d[:names], d[:count], d[:flag], d[:layout], nil)
+      when :variable_decl
+        callback.define_variable(d[:name], d[:type], nil)
+      when :forward_decl
+        callback.declare_forward(d[:name], enum_type(:FFIForwardType)[d[:flag]], nil)
+      end
+    end
+  ensure
+    Thread.current[:ffi_gen_cycle] = nil
+  end
+
+  def self.collect_stats(result)
+    stats = FFIGenStats.new
+    ffi_gen_result_stats(result, stats)
+    complete = ffi_gen_result_complete(result) == 1
+    ffi_gen_free_result(result)
 
-    walk_file(filename, argv, args.size, sources, source_filter.size, cb)
+    stats.members.map { |m| [m, stats[m]] }.to_h.merge(complete: complete)
   end
 end
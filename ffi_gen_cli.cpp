@@ -0,0 +1,525 @@
+#include <unistd.h>
+
+#include <cinttypes>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "ffi_gen.h"
+
+/*
+ * Invocation: ffi_gen_cli [-s <source>]... [-i <pattern>]... [-x <pattern>]... [-r <root>]... [-c <cache dir>] [-T <timeout ms>] [-a <target>]... [-p <trace file>] [-S] [-o] [-t] <header> [--] [<clang argument>...]
+ *
+ * Walks a header and writes each declaration to stdout as one JSON object
+ * per line, in callback order, as clang produces them. Sources default to
+ * the header itself. Declarations are filtered by name with -i and -x,
+ * which add include and exclude patterns as in walk_options: a glob or a
+ * /regex/, optionally prefixed by a kind, as in -x 'macro:_*'. With -r
+ * only the named roots and the declarations their types need are written.
+ * With -c the forced includes are precompiled and unchanged headers are
+ * answered from the declaration cache, as in task.rb. With -T the walk gives
+ * up after that many milliseconds and the exit status is 1. With -S each
+ * declaration is written out as soon as clang has parsed it, and macros
+ * come last instead of first. With -a the header is walked once for each
+ * target triple given, as by walk_targets, and every declaration ends with
+ * "targets":[...], the triples it holds for exactly as written. With -p a
+ * Chrome trace-event timeline of the walk is written to the trace file.
+ * With -o declarations come in dependency order, as with
+ * walk_options.topological, and those in a cycle have "cycle":<n>.
+ * With -t the FFIGenStats of the walk are written to stderr as JSON.
+ *
+ * Declarations look like
+ *
+ *     {"kind":"function","name":"f","return":<type>,"params":[<type>,...]}
+ *     {"kind":"struct","name":"s","defined":true,"size":8,"align":4,"members":[{"name":"a","offset":0,"type":<type>},...]}
+ *     {"kind":"macro","name":"M","definition":"1 + 2","value":3}
+ *
+ * and types like {"kind":"pointer","name":"const char *","pointee":<type>},
+ * with the fields of the matching FFITypeRef member. Named records and
+ * enums are referred to by name only; their members are in their own
+ * declaration. Member offsets are in bits; bitfields also have a bit_width.
+ */
+
+// Length of the well-formed UTF-8 sequence at s, or 0 if there is none:
+// overlong forms, surrogates and code points past U+10FFFF are rejected as
+// RFC 3629 requires
+static size_t utf8_length(const unsigned char *s, size_t n)
+{
+    size_t len;
+    unsigned char lo = 0x80, hi = 0xbf;
+
+    if (s[0] >= 0xc2 && s[0] <= 0xdf)
+        len = 2;
+    else if (s[0] >= 0xe0 && s[0] <= 0xef)
+        len = 3;
+    else if (s[0] >= 0xf0 && s[0] <= 0xf4)
+        len = 4;
+    else
+        return 0;
+
+    // The second byte is narrowed to rule out the invalid ranges
+    if (s[0] == 0xe0)
+        lo = 0xa0;
+    else if (s[0] == 0xed)
+        hi = 0x9f;
+    else if (s[0] == 0xf0)
+        lo = 0x90;
+    else if (s[0] == 0xf4)
+        hi = 0x8f;
+
+    if (n < len || s[1] < lo || s[1] > hi)
+        return 0;
+
+    for (size_t i = 2; i < len; ++i)
+        if (s[i] < 0x80 || s[i] > 0xbf)
+            return 0;
+
+    return len;
+}
+
+// Builds one line of output. Everything is appended to a single string so
+// a declaration costs one write into stdio's buffer.
+class Line
+{
+public:
+    Line &raw(const char *s)
+    {
+        out.append(s);
+        return *this;
+    }
+
+    Line &key(const char *k)
+    {
+        if (out.back() != '{' && out.back() != '[')
+            out.push_back(',');
+
+        out.push_back('"');
+        out.append(k);
+        out.append("\":");
+
+        return *this;
+    }
+
+    Line &string(const char *s)
+    {
+        return s ? string(s, std::strlen(s)) : raw("null");
+    }
+
+    // Bytes that aren't valid UTF-8, as a macro's string value may hold,
+    // become U+FFFD, one per byte, so the line stays valid JSON
+    Line &string(const char *s, size_t n)
+    {
+        static const char hex[] = "0123456789abcdef";
+
+        out.push_back('"');
+
+        for (size_t i = 0; i < n; ++i) {
+            unsigned char c = s[i];
+
+            if (c >= 0x80) {
+                size_t len = utf8_length(reinterpret_cast<const unsigned char *>(s) + i, n - i);
+
+                if (len) {
+                    out.append(s + i, len);
+                    i += len - 1;
+                } else {
+                    out.append("\\ufffd");
+                }
+
+                continue;
+            }
+
+            switch (c) {
+            case '"': out.append("\\\""); break;
+            case '\\': out.append("\\\\"); break;
+            case '\n': out.append("\\n"); break;
+            case '\t': out.append("\\t"); break;
+            case '\r': out.append("\\r"); break;
+            default:
+                if (c < 0x20) {
+                    out.append("\\u00");
+                    out.push_back(hex[c >> 4]);
+                    out.push_back(hex[c & 15]);
+                } else {
+                    out.push_back(c);
+                }
+            }
+        }
+
+        out.push_back('"');
+
+        return *this;
+    }
+
+    Line &boolean(int b)
+    {
+        return raw(b ? "true" : "false");
+    }
+
+    Line &number(const char *format, ...) __attribute__((format(printf, 2, 3)))
+    {
+        char buf[32];
+        va_list ap;
+
+        va_start(ap, format);
+        vsnprintf(buf, sizeof(buf), format, ap);
+        va_end(ap);
+
+        return raw(buf);
+    }
+
+    Line &array()
+    {
+        out.push_back('[');
+        return *this;
+    }
+
+    Line &next()
+    {
+        if (out.back() != '[')
+            out.push_back(',');
+
+        return *this;
+    }
+
+    Line &end(char c)
+    {
+        out.push_back(c);
+        return *this;
+    }
+
+    Line &type(const FFITypeRef *t)
+    {
+        static const char *const kinds[] = { "enum", "struct", "union", "function", "integer", "float", "pointer", "array", "flex", "void" };
+        static const char *const integers[] = { "Bool", "UInt8", "Int8", "UInt16", "Int16", "UInt32", "Int32", "UInt64", "Int64", "Int128" };
+        static const char *const floats[] = { "Half", "Float", "Double", "LongDouble" };
+
+        raw("{").key("kind").string(kinds[t->type]).key("name").string(t->qual_name);
+
+        switch (t->type) {
+        case ENUM_REF:
+            key("tag").string(t->enum_type.name).key("anonymous").boolean(t->enum_type.anonymous);
+            break;
+        case STRUCT_REF:
+            record(t->struct_type.name, t->struct_type.members, t->struct_type.num_members, t->struct_type.anonymous, t->struct_type.defined, t->struct_type.layout);
+            break;
+        case UNION_REF:
+            record(t->union_type.name, t->union_type.members, t->union_type.num_members, t->union_type.anonymous, t->union_type.defined, t->union_type.layout);
+            break;
+        case FUNCTION_REF:
+            key("return").type(t->func_type.return_type).key("params").array();
+
+            for (size_t i = 0; i < t->func_type.num_params; ++i)
+                next().type(&t->func_type.param_types[i]);
+
+            end(']');
+            break;
+        case INTEGER_REF:
+            key("type").string(integers[t->int_type.type]);
+            break;
+        case FLOAT_REF:
+            key("type").string(floats[t->float_type.type]);
+            break;
+        case POINTER_REF:
+            key("pointee").type(t->point_type.pointed_type);
+            break;
+        case ARRAY_REF:
+            key("element").type(t->array_type.type).key("size").number("%zu", t->array_type.size);
+            break;
+        case FLEX_REF:
+            key("element").type(t->flex_type.type);
+            break;
+        case VOID_REF:
+            break;
+        }
+
+        return end('}');
+    }
+
+    // Size and alignment in bytes; only present for records clang laid out
+    Line &layout(const FFIRecordLayout &l)
+    {
+        if (l.align)
+            key("size").number("%" PRIu64, l.size).key("align").number("%" PRIu64, l.align);
+
+        return *this;
+    }
+
+    // Offset in bits, and the width of a bitfield
+    Line &position(const FFIRecordLayout &l, size_t i)
+    {
+        if (!l.fields)
+            return *this;
+
+        key("offset").number("%" PRIu64, l.fields[i].offset);
+
+        if (l.fields[i].is_bitfield)
+            key("bit_width").number("%u", l.fields[i].bit_width);
+
+        return *this;
+    }
+
+    // Writes the line and starts the next one
+    void flush()
+    {
+        if (int cycle = ffi_gen_current_cycle()) {
+            out.pop_back();
+            key("cycle").number("%d", cycle).end('}');
+        }
+
+        if (!targets.empty()) {
+            uint64_t mask = ffi_gen_current_targets();
+
+            out.pop_back();
+            key("targets").array();
+
+            for (size_t t = 0; t < targets.size(); ++t) {
+                if (mask & (uint64_t { 1 } << t))
+                    next().string(targets[t]);
+            }
+
+            end(']').end('}');
+        }
+
+        out.push_back('\n');
+        fwrite(out.data(), 1, out.size(), stdout);
+        out.clear();
+    }
+
+    std::vector<const char *> targets; ///< Triples of a multi-target walk, by bit of ffi_gen_current_targets
+
+private:
+    void record(const char *name, const FFIRecordMember *members, size_t n, int anonymous, int defined, const FFIRecordLayout &l)
+    {
+        key("tag").string(name).key("anonymous").boolean(anonymous).key("defined").boolean(defined).layout(l);
+
+        if (!anonymous)
+            return;
+
+        key("members").array();
+
+        for (size_t i = 0; i < n; ++i)
+            next().raw("{").key("name").string(members[i].name).position(l, i).key("type").type(members[i].type).end('}');
+
+        end(']');
+    }
+
+    std::string out;
+};
+
+static Line &line(void *data)
+{
+    return *static_cast<Line *>(data);
+}
+
+static void emit_macro(const char *name, const char *definition, const FFIMacroValue *value, void *data)
+{
+    Line &l = line(data);
+
+    l.raw("{").key("kind").string("macro").key("name").string(name).key("definition").string(definition).key("value");
+
+    // JSON has no infinities or NaNs; those are left to the definition
+    if (value->type == MACRO_INTEGER && value->is_unsigned)
+        l.number("%" PRIu64, static_cast<uint64_t>(value->integer));
+    else if (value->type == MACRO_INTEGER)
+        l.number("%" PRId64, value->integer);
+    else if (value->type == MACRO_FLOAT && std::isfinite(value->floating))
+        l.number("%.17g", value->floating);
+    else if (value->type == MACRO_STRING)
+        l.string(value->string, value->string_size);
+    else
+        l.raw("null");
+
+    l.end('}').flush();
+}
+
+static void emit_typedef(const char *name, FFITypeRef *to, void *data)
+{
+    line(data).raw("{").key("kind").string("typedef").key("name").string(name).key("type").type(to).end('}').flush();
+}
+
+static void emit_function(const char *name, FFITypeRef *returnType, FFITypeRef *paramTypes, size_t n, void *data)
+{
+    Line &l = line(data);
+
+    l.raw("{").key("kind").string("function").key("name").string(name).key("return").type(returnType).key("params").array();
+
+    for (size_t i = 0; i < n; ++i)
+        l.next().type(&paramTypes[i]);
+
+    l.end(']').end('}').flush();
+}
+
+static void emit_enum(const char *name, const char **memberNames, int64_t *memberValues, size_t n, void *data)
+{
+    Line &l = line(data);
+
+    l.raw("{").key("kind").string("enum").key("name").string(name).key("members").array();
+
+    for (size_t i = 0; i < n; ++i)
+        l.next().raw("{").key("name").string(memberNames[i]).key("value").number("%" PRId64, memberValues[i]).end('}');
+
+    l.end(']').end('}').flush();
+}
+
+static void emit_record(const char *kind, const char *name, FFITypeRef *memberTypes, const char **memberNames, size_t n, int defined, const FFIRecordLayout *layout, void *data)
+{
+    Line &l = line(data);
+
+    l.raw("{").key("kind").string(kind).key("name").string(name).key("defined").boolean(defined).layout(*layout).key("members").array();
+
+    for (size_t i = 0; i < n; ++i)
+        l.next().raw("{").key("name").string(memberNames[i]).position(*layout, i).key("type").type(&memberTypes[i]).end('}');
+
+    l.end(']').end('}').flush();
+}
+
+static void emit_struct(const char *name, FFITypeRef *memberTypes, const char **memberNames, size_t n, int defined, const FFIRecordLayout *layout, void *data)
+{
+    emit_record("struct", name, memberTypes, memberNames, n, defined, layout, data);
+}
+
+static void emit_union(const char *name, FFITypeRef *memberTypes, const char **memberNames, size_t n, int defined, const FFIRecordLayout *layout, void *data)
+{
+    emit_record("union", name, memberTypes, memberNames, n, defined, layout, data);
+}
+
+static void emit_variable(const char *name, FFITypeRef *type, void *data)
+{
+    line(data).raw("{").key("kind").string("variable").key("name").string(name).key("type").type(type).end('}').flush();
+}
+
+static void emit_forward(const char *name, FFIForwardType type, void *data)
+{
+    line(data).raw("{").key("kind").string("forward").key("name").string(name).key("tag").string(type == UNION ? "union" : "struct").end('}').flush();
+}
+
+static void print_stats(const FFIGenStats &s)
+{
+    fprintf(stderr,
+            "{\"type_lookups\":%zu,\"type_nodes\":%zu,\"arena_bytes\":%zu,\"cache_hits\":%zu,\"callbacks\":%zu,"
+            "\"decls_visited\":%zu,\"decls_pruned\":%zu,\"decls_filtered\":%zu,\"decls_repeated\":%zu,\"decls_conflict\":%zu,\"decls_merged\":%zu,\"decls_emitted\":%zu,\"macros_seen\":%zu,\"macros_emitted\":%zu,\"string_bytes\":%zu,"
+            "\"read_ns\":%" PRIu64 ",\"setup_ns\":%" PRIu64 ",\"parse_ns\":%" PRIu64 ",\"macros_ns\":%" PRIu64 ","
+            "\"traverse_ns\":%" PRIu64 ",\"convert_ns\":%" PRIu64 ",\"callback_ns\":%" PRIu64 ",\"merge_ns\":%" PRIu64 "}\n",
+            s.type_lookups, s.type_nodes, s.arena_bytes, s.cache_hits, s.callbacks,
+            s.decls_visited, s.decls_pruned, s.decls_filtered, s.decls_repeated, s.decls_conflict, s.decls_merged, s.decls_emitted, s.macros_seen, s.macros_emitted, s.string_bytes,
+            s.read_ns, s.setup_ns, s.parse_ns, s.macros_ns, s.traverse_ns, s.convert_ns, s.callback_ns, s.merge_ns);
+}
+
+static int usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-s <source>]... [-i <pattern>]... [-x <pattern>]... [-r <root>]... [-c <cache dir>] [-T <timeout ms>] [-a <target>]... [-p <trace file>] [-S] [-o] [-t] <header> [--] [<clang argument>...]\n", argv0);
+    return 2;
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<const char *> sources, args, includes, excludes, roots, targets;
+    walk_options opts {};
+    bool stats = false;
+    int c;
+
+    // Options end at the header; everything after it goes to clang
+    while ((c = getopt(argc, argv, "+s:i:x:r:c:T:a:p:Sot")) != -1) {
+        switch (c) {
+        case 's':
+            sources.push_back(optarg);
+            break;
+        case 'i':
+            includes.push_back(optarg);
+            break;
+        case 'x':
+            excludes.push_back(optarg);
+            break;
+        case 'r':
+            roots.push_back(optarg);
+            break;
+        case 'c':
+            opts.cache_dir = optarg;
+            opts.incremental = 1;
+            break;
+        case 'T':
+            opts.timeout_ms = std::strtoull(optarg, nullptr, 10);
+            break;
+        case 'a':
+            targets.push_back(optarg);
+            break;
+        case 'p':
+            opts.trace_path = optarg;
+            break;
+        case 'S':
+            opts.streaming = 1;
+            break;
+        case 'o':
+            opts.topological = 1;
+            break;
+        case 't':
+            stats = true;
+            break;
+        default:
+            return usage(argv[0]);
+        }
+    }
+
+    if (optind >= argc)
+        return usage(argv[0]);
+
+    const char *header = argv[optind++];
+
+    if (optind < argc && std::strcmp(argv[optind], "--") == 0)
+        ++optind;
+
+    for (int i = optind; i < argc; ++i)
+        args.push_back(argv[i]);
+
+    if (access(header, R_OK) != 0) {
+        perror(header);
+        return 1;
+    }
+
+    if (sources.empty())
+        sources.push_back(header);
+
+    opts.include_symbols = includes.data();
+    opts.num_include_symbols = includes.size();
+    opts.exclude_symbols = excludes.data();
+    opts.num_exclude_symbols = excludes.size();
+    opts.root_symbols = roots.data();
+    opts.num_root_symbols = roots.size();
+
+    // Lines go out in large writes, not one per declaration, unless each
+    // one is wanted as soon as it is parsed
+    static char buffer[1 << 16];
+    setvbuf(stdout, buffer, opts.streaming ? _IOLBF : _IOFBF, sizeof(buffer));
+
+    Line l;
+    callbacks cb { emit_macro, emit_typedef, emit_function, emit_enum, emit_struct, emit_union, emit_variable, emit_forward, &l, nullptr };
+    ffi_gen_result *result;
+
+    if (targets.empty()) {
+        result = walk_file_opts(header, args.data(), args.size(), sources.data(), sources.size(), &cb, &opts);
+    } else {
+        l.targets = targets;
+        result = walk_targets(header, targets.data(), targets.size(), args.data(), args.size(), sources.data(), sources.size(), &cb, &opts);
+    }
+
+    if (stats) {
+        FFIGenStats s;
+
+        ffi_gen_result_stats(result, &s);
+        print_stats(s);
+    }
+
+    int complete = ffi_gen_result_complete(result);
+
+    ffi_gen_free_result(result);
+
+    if (!complete)
+        fprintf(stderr, "%s: timed out\n", header);
+
+    return fflush(stdout) == 0 && complete ? 0 : 1;
+}
@@ -0,0 +1,490 @@
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ffi_gen.h"
+#include "ffi_gen_snapshot.h"
+
+/*
+ * Invocation: ffi_gen_server <socket> <cache dir>
+ *
+ * Serves walks over a Unix socket from one long-lived process, so clients
+ * skip loading LLVM, and a header whose dependencies haven't changed is
+ * answered from memory without touching the file system. The precompiled
+ * prefix and per-file declaration caches live in the cache directory.
+ *
+ * A request is a few lines ending with an empty one:
+ *
+ *     walk <header>            or: watch <header>
+ *     arg <clang argument>     any number of times
+ *     source <file>            any number of times; defaults to the header
+ *
+ * and each result is one line:
+ *
+ *     ok <declarations> <snapshot>
+ *     error <message>
+ *
+ * where <snapshot> is a file in the format of ffi_gen_snapshot.h. A walk
+ * connection may send further requests. A watch connection is sent a new
+ * result whenever a file the walk read changes, until it disconnects.
+ *
+ * A new snapshot replaces the old one by rename, so a client that has opened
+ * a snapshot keeps reading it whole. The server keeps the results of the
+ * MAX_ENTRIES most recently requested walks and deletes the snapshots of
+ * those it drops.
+ */
+
+static const size_t MAX_ENTRIES = 256;
+
+struct Request {
+    bool watch = false;
+    std::string filename;
+    std::vector<std::string> args;
+    std::vector<std::string> sources;
+
+    std::string key() const
+    {
+        std::string k = filename;
+
+        for (auto &a : args)
+            k += '\0' + a;
+
+        k += '\1';
+
+        for (auto &s : sources)
+            k += '\0' + s;
+
+        return k;
+    }
+};
+
+struct Entry {
+    std::mutex walking;        ///< Held for the whole of a walk
+    std::string snapshot;
+    size_t decls = 0;
+    bool fresh = false;        ///< Nothing the last walk read has changed since
+    unsigned generation = 0;   ///< Bumped on every change
+    uint64_t lastUsed = 0;     ///< When it was last requested, for eviction
+};
+
+static void ignore_macro(const char *, const char *, const FFIMacroValue *, void *) {}
+static void ignore_typedef(const char *, FFITypeRef *, void *) {}
+static void ignore_function(const char *, FFITypeRef *, FFITypeRef *, size_t, void *) {}
+static void ignore_enum(const char *, const char **, int64_t *, size_t, void *) {}
+static void ignore_record(const char *, FFITypeRef *, const char **, size_t, int, const FFIRecordLayout *, void *) {}
+static void ignore_variable(const char *, FFITypeRef *, void *) {}
+static void ignore_forward(const char *, FFIForwardType, void *) {}
+
+static std::string real_path(const std::string &path)
+{
+    char buf[PATH_MAX];
+
+    return realpath(path.c_str(), buf) ? std::string { buf } : path;
+}
+
+// Whether path is gone or was modified at or after since, which is read from
+// CLOCK_REALTIME_COARSE: the clock the kernel stamps files with. An mtime
+// later than now is a skewed clock rather than an edit; anything modified
+// after now is left to the watch the caller has already installed.
+static bool modified_since(const std::string &path, const timespec &since)
+{
+    struct stat st;
+    timespec now;
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+
+    if (stat(path.c_str(), &st) != 0)
+        return true;
+
+    auto before = [](const timespec &a, const timespec &b) {
+        return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+    };
+
+    return !before(st.st_mtim, since) && !before(now, st.st_mtim);
+}
+
+class Server
+{
+public:
+    explicit Server(const std::string &cacheDir) : cacheDir(real_path(cacheDir)) {}
+
+    bool listen(const std::string &path)
+    {
+        sockaddr_un addr {};
+
+        if (path.size() >= sizeof(addr.sun_path))
+            return false;
+
+        addr.sun_family = AF_UNIX;
+        std::strcpy(addr.sun_path, path.c_str());
+        unlink(path.c_str());
+
+        listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        inotify = inotify_init1(IN_CLOEXEC);
+
+        return listener >= 0 && inotify >= 0
+            && bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0
+            && ::listen(listener, SOMAXCONN) == 0;
+    }
+
+    void run()
+    {
+        std::thread { [this] { watcher(); } }.detach();
+
+        for (;;) {
+            int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+
+            if (fd < 0) {
+                if (errno == EINTR)
+                    continue;
+
+                perror("accept");
+                return;
+            }
+
+            std::thread { [this, fd] { serve(fd); close(fd); } }.detach();
+        }
+    }
+
+private:
+    void serve(int fd)
+    {
+        Request r;
+        std::string buffer;
+
+        while (read(fd, buffer, r)) {
+            std::shared_ptr<Entry> e = entry(r.key());
+            unsigned seen = 0;
+
+            if (!send(fd, walk(r, *e, seen)))
+                return;
+
+            while (r.watch) {
+                std::unique_lock<std::mutex> guard { lock };
+
+                // Wake up now and then to notice a client that went away
+                if (!changed.wait_for(guard, std::chrono::seconds(1), [&] { return e->generation != seen; })) {
+                    guard.unlock();
+
+                    char c;
+                    if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0)
+                        return;
+
+                    continue;
+                }
+
+                guard.unlock();
+
+                // Editors tend to save in several steps
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+                if (!send(fd, walk(r, *e, seen)))
+                    return;
+            }
+
+            r = Request {};
+        }
+    }
+
+    // Reads one request, keeping whatever follows it in buffer
+    bool read(int fd, std::string &buffer, Request &r)
+    {
+        bool any = false;
+
+        for (;;) {
+            size_t nl;
+
+            while ((nl = buffer.find('\n')) != std::string::npos) {
+                std::string line = buffer.substr(0, nl);
+                size_t space = line.find(' ');
+                std::string verb = line.substr(0, space);
+                std::string value = space == std::string::npos ? "" : line.substr(space + 1);
+
+                buffer.erase(0, nl + 1);
+
+                if (line.empty()) {
+                    if (!any)
+                        continue;
+
+                    if (r.sources.empty())
+                        r.sources.push_back(r.filename);
+
+                    return true;
+                }
+
+                any = true;
+
+                if (verb == "walk" || verb == "watch") {
+                    r.watch = verb == "watch";
+                    r.filename = value;
+                } else if (verb == "arg") {
+                    r.args.push_back(value);
+                } else if (verb == "source") {
+                    r.sources.push_back(value);
+                }
+            }
+
+            char chunk[4096];
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+
+            if (n <= 0)
+                return false;
+
+            buffer.append(chunk, n);
+        }
+    }
+
+    bool send(int fd, const std::string &line)
+    {
+        size_t done = 0;
+
+        while (done < line.size()) {
+            ssize_t n = ::send(fd, line.data() + done, line.size() - done, MSG_NOSIGNAL);
+
+            if (n <= 0)
+                return false;
+
+            done += n;
+        }
+
+        return true;
+    }
+
+    std::shared_ptr<Entry> entry(const std::string &key)
+    {
+        std::lock_guard<std::mutex> guard { lock };
+        std::shared_ptr<Entry> e = entries[key];
+
+        if (!e) {
+            std::ostringstream path;
+
+            path << cacheDir << "/server-" << std::hex << std::hash<std::string> {}(key) << "-" << ++created << ".bin";
+            e.reset(new Entry);
+            e->snapshot = path.str();
+            entries[key] = e;
+            keys[e.get()] = key;
+        }
+
+        e->lastUsed = ++requests;
+        evict();
+
+        return e;
+    }
+
+    // Drops the least recently requested entries beyond MAX_ENTRIES, except
+    // those a connection is still using. Called with lock held.
+    void evict()
+    {
+        while (entries.size() > MAX_ENTRIES) {
+            auto oldest = entries.end();
+
+            for (auto i = entries.begin(); i != entries.end(); ++i)
+                if (i->second.use_count() == 1 && (oldest == entries.end() || i->second->lastUsed < oldest->second->lastUsed))
+                    oldest = i;
+
+            if (oldest == entries.end())
+                return;
+
+            for (auto &d : dependents)
+                d.second.erase(oldest->first);
+
+            unlink(oldest->second->snapshot.c_str());
+            keys.erase(oldest->second.get());
+            entries.erase(oldest);
+        }
+    }
+
+    // Answers from the last walk while nothing it read has changed,
+    // otherwise walks again and watches everything the walk read
+    std::string walk(const Request &r, Entry &e, unsigned &seen)
+    {
+        std::lock_guard<std::mutex> walking { e.walking };
+        unsigned generation;
+
+        {
+            std::lock_guard<std::mutex> guard { lock };
+
+            seen = generation = e.generation;
+
+            if (e.fresh)
+                return reply(e);
+        }
+
+        std::vector<const char *> args, sources;
+        callbacks c { ignore_macro, ignore_typedef, ignore_function, ignore_enum, ignore_record, ignore_record, ignore_variable, ignore_forward, nullptr, nullptr };
+        walk_options opts {};
+
+        for (auto &a : r.args)
+            args.push_back(a.c_str());
+
+        for (auto &s : r.sources)
+            sources.push_back(s.c_str());
+
+        // The walk writes next to the snapshot clients were given, which
+        // stays in place until the new one is complete
+        std::string next = e.snapshot + ".next";
+
+        opts.cache_dir = cacheDir.c_str();
+        opts.incremental = 1;
+        opts.snapshot_path = next.c_str();
+
+        // The files the walk reads are only known once it is done, so edits
+        // made during the walk are found by their mtimes rather than by the
+        // watches installed afterwards
+        timespec start;
+
+        clock_gettime(CLOCK_REALTIME_COARSE, &start);
+        unlink(next.c_str());
+        ffi_gen_free_result(walk_file_opts(r.filename.c_str(), args.data(), args.size(), sources.data(), sources.size(), &c, &opts));
+
+        ffi_gen_snapshot *snapshot = ffi_gen_snapshot_open(next.c_str());
+
+        if (!snapshot || rename(next.c_str(), e.snapshot.c_str()) != 0) {
+            ffi_gen_snapshot_close(snapshot);
+            return "error could not walk " + r.filename + "\n";
+        }
+
+        const FFISnapshotView *v = ffi_gen_snapshot_view(snapshot);
+        std::lock_guard<std::mutex> guard { lock };
+        bool modified = false;
+
+        for (size_t i = 0; i < v->num_files; ++i) {
+            std::string path = real_path(ffi_gen_snapshot_string(snapshot, v->files[i].path));
+
+            watch(path, keys[&e]);
+            modified = modified || modified_since(path, start);
+        }
+
+        if (modified) {
+            ++e.generation;
+            changed.notify_all();
+        }
+
+        e.decls = v->num_decls;
+        e.fresh = e.generation == generation;
+        ffi_gen_snapshot_close(snapshot);
+
+        return reply(e);
+    }
+
+    std::string reply(const Entry &e)
+    {
+        return "ok " + std::to_string(e.decls) + " " + e.snapshot + "\n";
+    }
+
+    // Directories are watched rather than files, since editors often save by
+    // replacing the file. Called with lock held.
+    void watch(const std::string &path, const std::string &key)
+    {
+        std::string dir = path.substr(0, path.rfind('/'));
+
+        if (!watchedDirs.count(dir)) {
+            int wd = inotify_add_watch(inotify, dir.empty() ? "/" : dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+
+            if (wd >= 0)
+                dirs[wd] = dir;
+
+            watchedDirs.insert(dir);
+        }
+
+        dependents[path].insert(key);
+    }
+
+    void watcher()
+    {
+        alignas(inotify_event) char events[16384];
+
+        for (;;) {
+            ssize_t n = ::read(inotify, events, sizeof(events));
+
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR)
+                    continue;
+
+                perror("inotify");
+                return;
+            }
+
+            std::lock_guard<std::mutex> guard { lock };
+
+            for (char *p = events; p < events + n; ) {
+                inotify_event *ev = reinterpret_cast<inotify_event *>(p);
+
+                if (ev->len && dirs.count(ev->wd)) {
+                    auto d = dependents.find(dirs[ev->wd] + "/" + ev->name);
+
+                    if (d != dependents.end()) {
+                        for (auto &key : d->second) {
+                            Entry &e = *entries.at(key);
+
+                            e.fresh = false;
+                            ++e.generation;
+                        }
+
+                        changed.notify_all();
+                    }
+                }
+
+                p += sizeof(inotify_event) + ev->len;
+            }
+        }
+    }
+
+    std::string cacheDir;
+    int listener = -1;
+    int inotify = -1;
+
+    // Everything below is guarded by lock
+    std::mutex lock;
+    std::condition_variable changed;
+    std::map<std::string, std::shared_ptr<Entry> > entries;
+    std::map<const Entry *, std::string> keys;
+    std::map<int, std::string> dirs;
+    std::set<std::string> watchedDirs;
+    std::map<std::string, std::set<std::string> > dependents;
+    uint64_t requests = 0; ///< Orders entries by last use
+    uint64_t created = 0;  ///< Keeps snapshot paths unique across evictions
+};
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <socket> <cache dir>\n", argv[0]);
+        return 1;
+    }
+
+    mkdir(argv[2], 0755);
+    signal(SIGPIPE, SIG_IGN);
+
+    Server server { argv[2] };
+
+    if (!server.listen(argv[1])) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    server.run();
+
+    return 1;
+}
@@ -0,0 +1,172 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "ffi_gen_snapshot.h"
+
+struct ffi_gen_snapshot {
+    void *mapping;
+    size_t size;
+    FFISnapshotView view;
+};
+
+template <typename T>
+static bool section(const ffi_gen_snapshot &s, const FFISnapshotSection &sec, const T *&data, size_t &count, size_t size = sizeof(T))
+{
+    // Records are read in place, so each section has to be aligned
+    if (sec.offset % 8 != 0 || sec.offset > s.size || sec.count > (s.size - sec.offset) / size)
+        return false;
+
+    data = reinterpret_cast<const T *>(static_cast<const char *>(s.mapping) + sec.offset);
+    count = sec.count;
+
+    return true;
+}
+
+static bool valid_string(const FFISnapshotView &v, uint32_t offset)
+{
+    return offset == SNAPSHOT_NO_INDEX || offset < v.strings_size;
+}
+
+static bool valid_type(const FFISnapshotView &v, uint32_t index)
+{
+    return index == SNAPSHOT_NO_INDEX || index < v.num_types;
+}
+
+static bool valid_range(uint32_t first, uint32_t count, size_t size)
+{
+    return count == 0 || (first < size && count <= size - first);
+}
+
+static bool validate(const ffi_gen_snapshot &s)
+{
+    const FFISnapshotView &v = s.view;
+
+    if (v.strings_size > 0 && v.strings[v.strings_size - 1] != '\0')
+        return false;
+
+    for (size_t i = 0; i < v.num_files; ++i)
+        if (v.files[i].path >= v.strings_size)
+            return false;
+
+    for (size_t i = 0; i < v.num_includes; ++i)
+        if (v.includes[i].includer >= v.num_files || v.includes[i].included >= v.num_files)
+            return false;
+
+    for (size_t i = 0; i < v.num_members; ++i)
+        if (!valid_string(v, v.members[i].name) || v.members[i].type >= v.num_types)
+            return false;
+
+    for (size_t i = 0; i < v.num_enumerators; ++i)
+        if (!valid_string(v, v.enumerators[i].name))
+            return false;
+
+    for (size_t i = 0; i < v.num_types; ++i) {
+        const FFISnapshotType &t = v.types[i];
+
+        if (t.kind > VOID_REF || !valid_string(v, t.qual_name) || !valid_string(v, t.name) || !valid_type(v, t.child))
+            return false;
+
+        if (!valid_range(t.first, t.count, v.num_members))
+            return false;
+
+        // Every kind that has a child needs one
+        bool needsChild = t.kind == FUNCTION_REF || t.kind == POINTER_REF || t.kind == ARRAY_REF || t.kind == FLEX_REF;
+        if (needsChild && t.child == SNAPSHOT_NO_INDEX)
+            return false;
+    }
+
+    for (size_t i = 0; i < v.num_decls; ++i) {
+        const FFISnapshotDecl &d = v.decls[i];
+
+        if (d.kind > FORWARD_DECL || !valid_string(v, d.name) || !valid_string(v, d.text) || !valid_type(v, d.type))
+            return false;
+
+        if (!valid_range(d.first, d.count, d.kind == ENUM_DECL ? v.num_enumerators : v.num_members))
+            return false;
+
+        // Callbacks dereference these without checking
+        bool needsType = d.kind == FUNCTION_DECL || d.kind == TYPEDEF_DECL || d.kind == VARIABLE_DECL;
+        if (d.name == SNAPSHOT_NO_INDEX || (needsType && d.type == SNAPSHOT_NO_INDEX))
+            return false;
+
+        if (d.value_type > MACRO_STRING)
+            return false;
+
+        // String values are followed by a terminator like every other string
+        if (d.value_type == MACRO_STRING && (d.value_string >= v.strings_size || d.value_size >= v.strings_size - d.value_string))
+            return false;
+    }
+
+    return true;
+}
+
+ffi_gen_snapshot *ffi_gen_snapshot_open(const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return nullptr;
+
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(FFISnapshotHeader)) {
+        close(fd);
+        return nullptr;
+    }
+
+    void *mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED)
+        return nullptr;
+
+    ffi_gen_snapshot *s = new ffi_gen_snapshot {};
+    const FFISnapshotHeader *h = static_cast<const FFISnapshotHeader *>(mapping);
+    FFISnapshotView &v = s->view;
+
+    s->mapping = mapping;
+    s->size = st.st_size;
+
+    bool ok = memcmp(h->magic, FFI_SNAPSHOT_MAGIC, sizeof(h->magic)) == 0
+        && h->version == FFI_SNAPSHOT_VERSION
+        && section(*s, h->strings, v.strings, v.strings_size, 1)
+        && section(*s, h->files, v.files, v.num_files)
+        && section(*s, h->includes, v.includes, v.num_includes)
+        && section(*s, h->types, v.types, v.num_types)
+        && section(*s, h->members, v.members, v.num_members)
+        && section(*s, h->enumerators, v.enumerators, v.num_enumerators)
+        && section(*s, h->decls, v.decls, v.num_decls)
+        && validate(*s);
+
+    if (!ok) {
+        ffi_gen_snapshot_close(s);
+        return nullptr;
+    }
+
+    return s;
+}
+
+void ffi_gen_snapshot_close(ffi_gen_snapshot *snapshot)
+{
+    if (!snapshot)
+        return;
+
+    munmap(snapshot->mapping, snapshot->size);
+    delete snapshot;
+}
+
+const FFISnapshotView *ffi_gen_snapshot_view(const ffi_gen_snapshot *snapshot)
+{
+    return &snapshot->view;
+}
+
+const char *ffi_gen_snapshot_string(const ffi_gen_snapshot *snapshot, uint32_t offset)
+{
+    if (offset == SNAPSHOT_NO_INDEX || offset >= snapshot->view.strings_size)
+        return nullptr;
+
+    return snapshot->view.strings + offset;
+}
@@ -0,0 +1,151 @@
+#ifndef _INCLUDE_SNAPSHOT_H_
+#define _INCLUDE_SNAPSHOT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ffi_gen.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A snapshot is a flat file holding every declaration of one or more walks.
+ * It starts with an FFISnapshotHeader, followed by arrays of the fixed-size
+ * records below, each 8-byte aligned. Records refer to each other by index
+ * and to strings by byte offset into the string section, never by pointer,
+ * so a snapshot can be mapped and read in place by any process without
+ * linking clang. All values are in native byte order.
+ */
+
+#define FFI_SNAPSHOT_MAGIC "FFIGENSS"
+#define FFI_SNAPSHOT_VERSION 3
+
+/// Stands in for a missing string offset or type index
+#define SNAPSHOT_NO_INDEX 0xffffffffu
+
+enum FFISnapshotFlags {
+    SNAPSHOT_ANONYMOUS = 1,
+    SNAPSHOT_DEFINED = 2,
+    SNAPSHOT_UNSIGNED = 4, ///< Macro value is an unsigned integer
+    SNAPSHOT_BITFIELD = 8  ///< Record member is a bitfield
+};
+
+struct FFISnapshotSection {
+    uint64_t offset; ///< From the start of the file
+    uint64_t count;  ///< Number of records, or bytes for the string section
+};
+
+struct FFISnapshotHeader {
+    char magic[8];                         ///< FFI_SNAPSHOT_MAGIC, not NUL-terminated
+    uint32_t version;                      ///< FFI_SNAPSHOT_VERSION
+    uint32_t reserved;
+    struct FFISnapshotSection strings;     ///< NUL-terminated strings
+    struct FFISnapshotSection files;       ///< FFISnapshotFile
+    struct FFISnapshotSection includes;    ///< FFISnapshotInclude
+    struct FFISnapshotSection types;       ///< FFISnapshotType
+    struct FFISnapshotSection members;     ///< FFISnapshotMember
+    struct FFISnapshotSection enumerators; ///< FFISnapshotEnumerator
+    struct FFISnapshotSection decls;       ///< FFISnapshotDecl, in callback order
+};
+
+/// A file read while producing the snapshot
+struct FFISnapshotFile {
+    uint32_t path;
+    uint32_t reserved;
+    uint64_t size;
+    int64_t mtime;
+    uint8_t md5[16];
+};
+
+/// An #include edge between two FFISnapshotFiles
+struct FFISnapshotInclude {
+    uint32_t includer;
+    uint32_t included;
+};
+
+/// One node of the type graph; the counterpart of FFITypeRef
+struct FFISnapshotType {
+    uint32_t kind;      ///< FFIRefType
+    uint32_t qual_name;
+    uint32_t name;      ///< Enum and record name
+    uint32_t subtype;   ///< FFIIntegerType or FFIFloatType
+    uint32_t child;     ///< Pointee, element or return type
+    uint32_t first;     ///< First record member or function parameter
+    uint32_t count;
+    uint32_t flags;     ///< FFISnapshotFlags
+    uint64_t size;      ///< Array length, or record size in bytes
+    uint64_t align;     ///< Record alignment in bytes; 0 if the record has no layout
+};
+
+/// A record member or function parameter; parameters have no name and no
+/// position
+struct FFISnapshotMember {
+    uint32_t name;
+    uint32_t type;
+    uint64_t offset;    ///< In bits from the start of the record
+    uint32_t bit_width;
+    uint32_t flags;     ///< FFISnapshotFlags
+};
+
+struct FFISnapshotEnumerator {
+    uint32_t name;
+    uint32_t reserved;
+    int64_t value;
+};
+
+struct FFISnapshotDecl {
+    uint32_t kind;  ///< FFIDeclKind
+    uint32_t name;
+    uint32_t text;  ///< Macro definition
+    uint32_t type;  ///< Typedef target, variable type or return type
+    uint32_t first; ///< First member, parameter or enumerator
+    uint32_t count;
+    uint32_t flags; ///< FFISnapshotFlags, or FFIForwardType for forward declarations
+    uint32_t value_type;   ///< FFIMacroValueType
+    uint64_t value;        ///< Integer macro value, or the bits of a double
+    uint32_t value_string; ///< String macro value
+    uint32_t value_size;   ///< Length of the string value, which may contain NULs
+    uint64_t size;         ///< Record size in bytes
+    uint64_t align;        ///< Record alignment in bytes; 0 if the record has no layout
+};
+
+/// The sections of an open snapshot, pointing straight into the mapping
+struct FFISnapshotView {
+    const char *strings;
+    size_t strings_size;
+    const struct FFISnapshotFile *files;
+    size_t num_files;
+    const struct FFISnapshotInclude *includes;
+    size_t num_includes;
+    const struct FFISnapshotType *types;
+    size_t num_types;
+    const struct FFISnapshotMember *members;
+    size_t num_members;
+    const struct FFISnapshotEnumerator *enumerators;
+    size_t num_enumerators;
+    const struct FFISnapshotDecl *decls;
+    size_t num_decls;
+};
+
+typedef struct ffi_gen_snapshot ffi_gen_snapshot;
+
+/// Maps a snapshot read-only and checks that every offset, index and range in
+/// it is in bounds. Returns NULL if the file can't be mapped, is truncated or
+/// was written by another format version.
+ffi_gen_snapshot *ffi_gen_snapshot_open(const char *path);
+
+/// Unmaps a snapshot; views and strings taken from it become invalid
+void ffi_gen_snapshot_close(ffi_gen_snapshot *snapshot);
+
+const struct FFISnapshotView *ffi_gen_snapshot_view(const ffi_gen_snapshot *snapshot);
+
+/// Returns NULL for SNAPSHOT_NO_INDEX
+const char *ffi_gen_snapshot_string(const ffi_gen_snapshot *snapshot, uint32_t offset);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // _INCLUDE_SNAPSHOT_H_
@@ -33,8 +33,13 @@ class Generator
     @nodes = []
   end
 
-  def define_macro(name, definition, _data)
-    @nodes << MacroNode.new(@ctx, name, definition)
+  def define_macro(name, definition, value, _data)
+    value = value.value
+
+    # Infinities and NaN have no Ruby literal
+    value = nil if value.is_a?(Float) && !value.finite?
+
+    @nodes << MacroNode.new(@ctx, name, definition, value)
   end
 
   def define_typedef(name, type, _data)
@@ -52,27 +57,31 @@ class Generator
     )
   end
 
-  def define_struct(name, member_types, member_names, num_members, defined, _data)
+  def define_struct(name, member_types, member_names, num_members, defined, layout, _data)
     member_names = to_array_of_string(member_names, num_members)
     member_types = resolve_type_array(member_types, num_members)
+    fields = field_layouts(layout, num_members)
 
     @nodes << StructDeclNode.new(
       @ctx,
       untypedef_name(name),
-      member_names.zip(member_types).map { |n,t| RecordMember.new(n, t) },
-      defined
+      member_names.zip(member_types, fields).map { |n,t,f| RecordMember.new(n, t, *f) },
+      defined,
+      record_sizing(layout)
     )
   end
 
-  def define_union(name, member_types, member_names, num_members, defined, _data)
+  def define_union(name, member_types, member_names, num_members, defined, layout, _data)
     member_names = to_array_of_string(member_names, num_members)
     member_types = resolve_type_array(member_types, num_members)
+    fields = field_layouts(layout, num_members)
 
     @nodes << UnionDeclNode.new(
       @ctx,
       untypedef_name(name),
-      member_names.zip(member_types).map { |n,t| RecordMember.new(n, t) },
-      defined
+      member_names.zip(member_types, fields).map { |n,t,f| RecordMember.new(n, t, *f) },
+      defined,
+      record_sizing(layout)
     )
   end
 
@@ -118,19 +127,43 @@ class Generator
     types.map(&method(:resolve_type_ref))
   end
 
-  def resolve_record_members(members, num_members)
+  def resolve_record_members(members, num_members, layout)
     members = to_array_of(FFIGen::FFIRecordMember, members, num_members)
-    members.map { |m| RecordMember.new(m[:name], resolve_type_ref(m[:type])) }
+    fields = field_layouts(layout, num_members)
+
+    members.zip(fields).map { |m,f| RecordMember.new(m[:name], resolve_type_ref(m[:type]), *f) }
+  end
+
+  # [byte offset, bitfield?] of each member as clang laid it out, or nothing
+  # for a record clang couldn't lay out
+  def field_layouts(layout, num_members)
+    return [] if layout.nil? || layout.null? || layout[:fields].null?
+
+    to_array_of(FFIGen::FFIFieldLayout, layout[:fields], num_members).map do |f|
+      [f[:offset] / 8, f[:is_bitfield] != 0]
+    end
+  end
+
+  # [sizeof, alignof] of a record clang laid out, or nil
+  def record_sizing(layout)
+    return nil if layout.nil? || layout.null? || layout[:size].zero?
+
+    [layout[:size], layout[:align]]
   end
 
-  # To make FFI arrays easier to work with
+  # To make FFI arrays easier to work with. Records without fields hand
+  # over null arrays.
   def to_array_of(type, base_ptr, num)
+    return [] if num.zero?
+
     base_ptr = base_ptr.to_ptr
 
     (0...num).map { |i| type.new(base_ptr + i*type.size) }
   end
   
   def to_array_of_string(base_ptr, num)
+    return [] if num.zero?
+
     base_ptr.read_array_of_pointer(num).map(&:read_string)
   end
 
@@ -158,8 +191,9 @@ class Generator
         @ctx,
         untypedef_name(type[:qual_name]),
         untypedef_name(struct_type[:name]),
-        resolve_record_members(struct_type[:members], struct_type[:num_members]),
-        struct_type[:defined]
+        resolve_record_members(struct_type[:members], struct_type[:num_members], struct_type[:layout]),
+        struct_type[:defined],
+        record_sizing(struct_type[:layout])
       )
     when :union_ref
       union_type = type[:kind][:union_type]
@@ -168,8 +202,9 @@ class Generator
         @ctx,
         untypedef_name(type[:qual_name]),
         untypedef_name(union_type[:name]),
-        resolve_record_members(union_type[:members], union_type[:num_members]),
-        union_type[:defined]
+        resolve_record_members(union_type[:members], union_type[:num_members], union_type[:layout]),
+        union_type[:defined],
+        record_sizing(union_type[:layout])
       )
     when :function_ref
       func_type = type[:kind][:func_type]
@@ -268,11 +303,13 @@ class Generator
   end
 
   class RecordMember
-    attr_reader :name, :child
+    attr_reader :name, :child, :offset, :bitfield
 
-    def initialize(name, child)
+    def initialize(name, child, offset = nil, bitfield = false)
       @name = name
       @child = child
+      @offset = offset
+      @bitfield = bitfield
     end
   end
 
@@ -280,21 +317,50 @@ class Generator
     def class_name(name)
       ActiveSupport::Inflector.classify(name)
     end
+
+    # Arguments to `layout`, with each member at the byte offset clang gave
+    # it so FFI doesn't have to work the layout out again. FFI has no
+    # bitfields, so those are left out.
+    def layout_string(members)
+      members.reject(&:bitfield).map do |m|
+        [":#{m.name.presence || anonymous_name}", m.child.to_param, m.offset].compact.join(", ")
+      end.join(", ")
+    end
+
+    # Body of a defined record's class. A record with bitfields is given
+    # clang's size and alignment, so the bytes they occupy are kept even
+    # though FFI can't name them.
+    def layout_body(members, sizing)
+      member_string = layout_string(members)
+      lines = []
+
+      if sizing && members.any?(&:bitfield)
+        size, align = sizing
+
+        lines << "self.size = #{size}" << "aligned #{align}"
+        member_string = ":_bitfields, [:uint8, #{size}], 0" if member_string.blank?
+      end
+
+      lines << "layout #{member_string}" if member_string.present?
+      lines.join("\n  ")
+    end
   end
 
   class MacroNode < Node
-    def initialize(ctx, name, definition)
+    def initialize(ctx, name, definition, value)
       @ctx = ctx
       @name = name.upcase
       @definition = definition
+      @value = value
     end
 
+    # Macros that aren't constant expressions keep their spelling as a string
     def to_ffi
       if @ctx.macro_defined?(@name)
         ''
       else
         @ctx.define_macro(@name)
-        "#{@name} = #{@definition.squish.inspect}"
+        "#{@name} = #{(@value.nil? ? @definition.squish : @value).inspect}"
       end
     end
   end
@@ -318,25 +384,23 @@ class Generator
   end
 
   class StructDeclNode < Node
-    def initialize(ctx, name, members, defined)
+    def initialize(ctx, name, members, defined, sizing = nil)
       @ctx = ctx
       @name = class_name(name)
       @members = members
       @defined = defined
+      @sizing = sizing
     end
 
     def to_ffi
       @ctx.declare_type(@name)
 
-      member_names = @members.map { |m| m.name.presence || anonymous_name }
-      member_types = @members.map { |m| m.child.to_param }
-
-      member_string = member_names.zip(member_types).map { |n,t| ":#{n}, #{t}" }.join(", ")
+      body = layout_body(@members, @sizing)
 
       if @defined
         <<~RUBY
           class #{@name} < FFI::Struct
-            #{"layout #{member_string}" if member_string.present?}
+            #{body}
           end
         RUBY
       else
@@ -355,25 +419,23 @@ class Generator
   end
 
   class UnionDeclNode < Node
-    def initialize(ctx, name, members, defined)
+    def initialize(ctx, name, members, defined, sizing = nil)
       @ctx = ctx
       @name = class_name(name)
       @members = members
       @defined = defined
+      @sizing = sizing
     end
 
     def to_ffi
       @ctx.declare_type(@name)
 
-      member_names = @members.map { |m| m.name.presence || anonymous_name }
-      member_types = @members.map { |m| m.child.to_param }
-
-      member_string = member_names.zip(member_types).map { |n,t| ":#{n}, #{t}" }.join(", ")
+      body = layout_body(@members, @sizing)
 
       if @defined
         <<~RUBY
           class #{@name} < FFI::Union
-            #{"layout #{member_string}" if member_string.present?}
+            #{body}
           end
         RUBY
       else
@@ -511,12 +573,13 @@ class Generator
   end
 
   class StructTypeNode < Node
-    def initialize(ctx, qual_name, name, members, defined)
+    def initialize(ctx, qual_name, name, members, defined, sizing = nil)
       @ctx = ctx
       @qual_name = class_name(qual_name)
       @name = class_name(name)
       @members = members
       @defined = defined
+      @sizing = sizing
     end
 
     def to_param
@@ -531,15 +594,12 @@ class Generator
     end
 
     def emit_definition
-      member_names = @members.map { |m| m.name.presence || anonymous_name }
-      member_types = @members.map { |m| m.child.to_param }
-
-      member_string = member_names.zip(member_types).map { |n,t| ":#{n}, #{t}" }.join(", ")
+      body = layout_body(@members, @sizing)
 
       if @defined
         @ctx.emit <<~RUBY
           class #{@name} < FFI::Struct
-            #{"layout #{member_string}" if member_string.present?}
+            #{body}
           end
         RUBY
       else
@@ -558,12 +618,13 @@ class Generator
   end
 
   class UnionTypeNode < Node
-    def initialize(ctx, qual_name, name, members, defined)
+    def initialize(ctx, qual_name, name, members, defined, sizing = nil)
       @ctx = ctx
       @qual_name = class_name(qual_name)
       @name = class_name(name)
       @members = members
       @defined = defined
+      @sizing = sizing
     end
 
     def to_param
@@ -578,15 +639,12 @@ class Generator
     end
 
     def emit_definition
-      member_names = @members.map { |m| m.name.presence || anonymous_name }
-      member_types = @members.map { |m| m.child.to_param }
-
-      member_string = member_names.zip(member_types).map { |n,t| ":#{n}, #{t}" }.join(", ")
+      body = layout_body(@members, @sizing)
 
       if @defined
         @ctx.emit <<~RUBY
           class #{@name} < FFI::Union
-            #{"layout #{member_string}" if member_string.present?}
+            #{body}
           end
         RUBY
       else
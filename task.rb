@@ -5,6 +5,16 @@ require 'ffi_gen'
 require 'generator'
 
 # Invocation: ruby task.rb <modulename> <filename> [<clang args>]
+#
+# Set FFI_GEN_CACHE_DIR to keep a precompiled header of the default includes
+# and the extracted declarations there between runs; an unchanged header is
+# then regenerated without parsing it again.
+#
+# Set FFI_GEN_ROOTS to a comma-separated list of functions and variables to
+# bind only those and the types they need.
+#
+# Declarations arrive in dependency order, so the Generator has seen every
+# type by the time something uses it.
 
 default_arguments = "-I/usr/lib/llvm-7/lib/clang/7.0.1/include -I/usr/include/x86_64-linux-gnu -include stddef.h -include stdio.h".split(" ")
 module_name, file_name, *args = ARGV
@@ -12,5 +22,8 @@ module_name, file_name, *args = ARGV
 g = Generator.new(module_name)
 default_arguments.concat args
 
-FFIGen.inspect_file(file_name, default_arguments, g)
+cache_dir = ENV['FFI_GEN_CACHE_DIR']
+roots = ENV.fetch('FFI_GEN_ROOTS', '').split(',')
+FFIGen.inspect_file(file_name, [file_name], default_arguments, g,
+                    cache_dir: cache_dir, incremental: !cache_dir.nil?, roots: roots, topological: true)
 puts g.parsed.join("\n")
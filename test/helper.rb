@@ -0,0 +1,90 @@
+$:.unshift(File.expand_path('..', __dir__))
+
+require 'minitest/autorun'
+require 'ffi_gen'
+
+# Collects what a walk reports as plain Ruby values, copied out before the
+# result behind them is freed
+class Recorder
+  attr_reader :decls
+
+  def initialize
+    @decls = []
+  end
+
+  def [](name)
+    @decls.find { |d| d[:name] == name }
+  end
+
+  def names
+    @decls.map { |d| d[:name] }
+  end
+
+  def define_macro(name, definition, value, _data)
+    record(:macro, name, definition: definition, value: value.value, type: value[:type])
+  end
+
+  def define_typedef(name, type, _data)
+    record(:typedef, name, type: type[:qual_name])
+  end
+
+  def define_function(name, return_type, param_types, num_params, _data)
+    params = to_array_of(FFIGen::FFITypeRef, param_types, num_params).map { |t| t[:qual_name] }
+    record(:function, name, return_type: return_type[:qual_name], params: params)
+  end
+
+  def define_enum(name, member_names, member_values, num_members, _data)
+    names = member_names.read_array_of_pointer(num_members).map(&:read_string)
+    record(:enum, name, members: names.zip(member_values.read_array_of_int64(num_members)).to_h)
+  end
+
+  def define_struct(name, member_types, member_names, num_members, defined, layout, _data)
+    record(:struct, name, **members(member_types, member_names, num_members, defined, layout))
+  end
+
+  def define_union(name, member_types, member_names, num_members, defined, layout, _data)
+    record(:union, name, **members(member_types, member_names, num_members, defined, layout))
+  end
+
+  def define_variable(name, type, _data)
+    record(:variable, name, type: type[:qual_name])
+  end
+
+  def declare_forward(name, type, _data)
+    record(:forward, name, type: type)
+  end
+
+  private
+
+  def record(kind, name, **details)
+    @decls << { kind: kind, name: name, cycle: FFIGen.current_cycle, **details }
+  end
+
+  def members(types, names, count, defined, layout)
+    {
+      members: (count.zero? ? [] : names.read_array_of_pointer(count).map(&:read_string))
+                    .zip(to_array_of(FFIGen::FFITypeRef, types, count).map { |t| t[:qual_name] }),
+      defined: defined != 0,
+      size: layout.null? ? nil : layout[:size],
+      align: layout.null? ? nil : layout[:align]
+    }
+  end
+
+  def to_array_of(type, base_ptr, num)
+    return [] if num.zero?
+
+    (0...num).map { |i| type.new(base_ptr.to_ptr + i * type.size) }
+  end
+end
+
+module WalkHelper
+  HEADER = 'test.h'
+
+  # Walks the header source held in a string; returns the recorder and the
+  # stats
+  def walk(source, args: [], callback: Recorder.new, **options)
+    stats = FFIGen.inspect_buffer(HEADER, source, [HEADER], args, callback, **options)
+
+    [callback, stats]
+  end
+end
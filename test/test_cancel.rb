@@ -0,0 +1,46 @@
+require_relative 'helper'
+require 'tmpdir'
+
+class TestCancel < Minitest::Test
+  include WalkHelper
+
+  COUNT = 20_000
+
+  def big_header
+    (0...COUNT).map { |i| "struct s#{i} { int a; }; int f#{i}(struct s#{i} *);\n" }.join
+  end
+
+  def test_timeout_stops_a_parse_that_does_not_stream
+    recorder, stats = walk(big_header, timeout: 0.001)
+
+    refute stats[:complete]
+    assert_operator recorder.decls.size, :<, 2 * COUNT
+  end
+
+  def test_cancel_stops_an_async_walk
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'big.h')
+      File.write(path, big_header)
+
+      walk = FFIGen.inspect_files_async([path], [], [])
+      walk.cancel
+      stats = walk.finish(Recorder.new)
+
+      refute stats[:complete]
+      assert_operator stats[:decls_emitted], :<, 2 * COUNT
+    end
+  end
+
+  def test_dropped_async_walk_is_released
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'big.h')
+      File.write(path, big_header)
+
+      FFIGen.inspect_files_async([path], [], [])
+      GC.start
+
+      _, stats = walk("int g(void);\n")
+      assert stats[:complete]
+    end
+  end
+end
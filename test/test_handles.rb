@@ -0,0 +1,73 @@
+require_relative 'helper'
+
+class TestHandles < Minitest::Test
+  include WalkHelper
+
+  # Takes handles on the types of every function and struct as they are
+  # reported, and reads them back once the last declaration arrives
+  class HandleRecorder < Recorder
+    attr_reader :handles, :names, :pointees
+
+    def initialize
+      super
+      @handles = {}
+    end
+
+    def define_function(name, return_type, param_types, num_params, data)
+      types = [return_type] + (0...num_params).map { |i| FFIGen::FFITypeRef.new(param_types.to_ptr + i * FFIGen::FFITypeRef.size) }
+      @handles[name] = types.map { |t| FFIGen.ffi_gen_type_handle(FFIGen.ffi_gen_current_result, t) }
+      super
+    end
+
+    def define_struct(name, member_types, member_names, num_members, defined, layout, data)
+      result = FFIGen.ffi_gen_current_result
+      @handles[name] = (0...num_members).map { |i| FFIGen.ffi_gen_type_handle(result, FFIGen::FFITypeRef.new(member_types.to_ptr + i * FFIGen::FFITypeRef.size)) }
+
+      if name == 'last'
+        @names = @handles.transform_values { |hs| hs.map { |h| FFIGen.ffi_gen_type_name(result, h) } }
+        @pointees = @handles['f'].map { |h| FFIGen.ffi_gen_type_pointee(result, h) }
+                                 .map { |h| h == FFIGen::NO_TYPE ? nil : FFIGen.ffi_gen_type_name(result, h) }
+      end
+
+      super
+    end
+  end
+
+  def test_handles_taken_in_callbacks_outlive_them
+    recorder, = walk(<<~C, callback: HandleRecorder.new)
+      struct s { int a; };
+      struct s *f(long, struct s *);
+      void g(char, double);
+      struct u { short b; unsigned c; };
+      struct last { int z; };
+    C
+
+    assert_equal ['struct s *', 'long', 'struct s *'], recorder.names['f']
+    assert_equal ['void', 'char', 'double'], recorder.names['g']
+    assert_equal ['short', 'unsigned int'], recorder.names['u']
+    assert_empty recorder.handles['f'] & recorder.handles['g']
+  end
+
+  def test_same_type_gets_the_same_handle_in_every_position
+    recorder, = walk(<<~C, callback: HandleRecorder.new)
+      struct s { int a; };
+      struct s *f(long, struct s *);
+      struct v { struct s *p; long n; };
+      struct last { int z; };
+    C
+
+    return_type, long_param, pointer_param = recorder.handles['f']
+    assert_equal return_type, pointer_param
+    assert_equal [return_type, long_param], recorder.handles['v']
+  end
+
+  def test_pointee_is_only_defined_for_pointers_arrays_and_functions
+    recorder, = walk(<<~C, callback: HandleRecorder.new)
+      struct s { int a; };
+      struct s *f(long, struct s *);
+      struct last { int z; };
+    C
+
+    assert_equal ['struct s', nil, 'struct s'], recorder.pointees
+  end
+end
@@ -0,0 +1,46 @@
+require_relative 'helper'
+require 'generator'
+
+class TestLayouts < Minitest::Test
+  include WalkHelper
+
+  SOURCE = <<~C
+    struct flags { unsigned a : 3; unsigned b : 5; int c; char d : 2; };
+    struct only_bits { unsigned long long a : 1; };
+    union mixed { unsigned a : 4; short b; };
+    struct outer { char x; struct { unsigned y : 9; } inner; };
+  C
+
+  # The Ruby the Generator writes for SOURCE, evaluated in a fresh module
+  def generated
+    g = Generator.new('Test')
+    walk(SOURCE, callback: g)
+
+    Module.new.tap { |m| m.module_eval(g.parsed.join("\n")) }
+  end
+
+  def test_records_with_bitfields_keep_clang_sizes
+    recorder, = walk(SOURCE)
+    mod = generated
+
+    { 'Flags' => 'flags', 'OnlyBits' => 'only_bits', 'Mixed' => 'mixed', 'Outer' => 'outer' }.each do |klass, name|
+      assert_equal recorder[name][:size], mod.const_get(klass).size, klass
+      assert_equal recorder[name][:align], mod.const_get(klass).alignment, klass
+    end
+  end
+
+  def test_members_around_bitfields_keep_their_offsets
+    mod = generated
+
+    assert_equal 4, mod::Flags.offset_of(:c)
+    assert_equal 0, mod::Outer.offset_of(:x)
+    assert_equal 4, mod::Outer.offset_of(:inner)
+  end
+
+  def test_record_without_fields_reports_no_members
+    recorder, = walk("struct empty {};\n")
+
+    assert_equal [], recorder['empty'][:members]
+    assert recorder['empty'][:defined]
+  end
+end
@@ -0,0 +1,39 @@
+require_relative 'helper'
+
+class TestMacros < Minitest::Test
+  include WalkHelper
+
+  def value(source, name = 'M')
+    walk(source).first[name][:value]
+  end
+
+  def test_long_literals_fill_their_type
+    assert_equal 1, value("#define M 1L\n")
+    assert_equal 1, value("#define M 1LL\n")
+    assert_equal 2**64 - 1, value("#define M 0xffffffffffffffffULL\n")
+    assert_equal(-2**63, value("#define M (-9223372036854775807LL - 1)\n"))
+  end
+
+  def test_decimal_literal_too_large_for_long_long_is_unsigned
+    assert_equal 2**63, value("#define M 9223372036854775808\n")
+  end
+
+  def test_enumerators_and_sizeof
+    assert_equal 3, value("enum { A = 1, B };\n#define M (A + B)\n")
+    assert_equal 8, value("struct s { int a, b; };\n#define M sizeof(struct s)\n")
+    assert_equal 4, value("#define M sizeof(int)\n")
+  end
+
+  def test_signed_overflow_is_not_folded
+    assert_nil value("#define M (2147483647 + 1)\n")
+    assert_nil value("#define M (1 << 32)\n")
+    assert_equal 0, value("#define M (4294967295U + 1)\n")
+  end
+
+  def test_skipped_operands_are_not_evaluated
+    assert_equal 0, value("#define M (0 && 1 / 0)\n")
+    assert_equal 1, value("#define M (1 || 1 / 0)\n")
+    assert_equal 2, value("#define M (1 ? 2 : 1 / 0)\n")
+    assert_nil value("#define M (1 && 1 / 0)\n")
+  end
+end
@@ -0,0 +1,42 @@
+require_relative 'helper'
+require 'tmpdir'
+
+class TestRedeclarations < Minitest::Test
+  include WalkHelper
+
+  def test_later_prototype_gives_the_parameters
+    recorder, = walk("int f();\nint f(int);\n")
+
+    assert_equal ['int'], recorder['f'][:params]
+  end
+
+  def test_later_prototype_gives_the_parameters_when_streaming
+    recorder, = walk("int f();\nint f(int);\n", streaming: true)
+
+    assert_equal ['int'], recorder['f'][:params]
+    assert_equal 1, recorder.names.count('f')
+  end
+
+  def test_later_declaration_completes_an_array
+    recorder, = walk("extern int a[];\nextern int a[4];\n")
+
+    assert_equal 'int [4]', recorder['a'][:type]
+  end
+
+  # The first file is much slower to parse, yet still claims first
+  def test_shared_index_claims_in_file_order
+    Dir.mktmpdir do |dir|
+      slow = File.join(dir, 'slow.h')
+      fast = File.join(dir, 'fast.h')
+      File.write(slow, (0...5000).map { |i| "struct s#{i} { int a; };\n" }.join + "int shared(int);\n")
+      File.write(fast, "long shared(long);\n")
+
+      recorder = Recorder.new
+      stats = FFIGen.inspect_files([slow, fast], [], [], recorder, threads: 2, index: FFIGen::Index.new)
+
+      assert_equal ['int'], recorder['shared'][:params]
+      assert_equal 1, recorder.names.count('shared')
+      assert_equal 1, stats[:decls_conflict]
+    end
+  end
+end
@@ -0,0 +1,44 @@
+require_relative 'helper'
+
+class TestStreaming < Minitest::Test
+  include WalkHelper
+
+  # Keeps the first parameter of f as reported and looks at it again once
+  # the last declaration arrives, while the result is still alive
+  class LateReader < Recorder
+    attr_reader :param_then, :param_later
+
+    def define_function(name, return_type, param_types, num_params, data)
+      if name == 'f'
+        @param = FFIGen::FFITypeRef.new(param_types.to_ptr)
+        @param_then = record_of(@param)
+      end
+
+      super
+    end
+
+    def define_struct(name, member_types, member_names, num_members, defined, layout, data)
+      @param_later = record_of(@param) if name == 'last'
+      super
+    end
+
+    private
+
+    def record_of(type)
+      r = type[:kind][:struct_type]
+      { defined: r[:defined] != 0, size: r[:layout][:size] }
+    end
+  end
+
+  def test_record_passed_by_value_is_completed_once_defined
+    recorder, = walk(<<~C, callback: LateReader.new, streaming: true)
+      struct foo;
+      void f(struct foo);
+      struct foo { int a; };
+      struct last { int z; };
+    C
+
+    assert_equal({ defined: false, size: 0 }, recorder.param_then)
+    assert_equal({ defined: true, size: 4 }, recorder.param_later)
+  end
+end
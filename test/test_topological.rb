@@ -0,0 +1,67 @@
+require_relative 'helper'
+require 'tmpdir'
+
+class TestTopological < Minitest::Test
+  include WalkHelper
+
+  def sorted(source)
+    recorder, = walk(source, topological: true)
+    recorder.decls
+  end
+
+  def position(decls, kind, name)
+    decls.index { |d| d[:kind] == kind && d[:name] == name }
+  end
+
+  def test_declarations_follow_what_they_refer_to
+    decls = sorted("struct s;\nint f(struct s *p);\ntypedef struct s s_t;\nstruct s { int a; };\n")
+
+    assert_operator position(decls, :struct, 's'), :<, position(decls, :function, 'f')
+    assert_operator position(decls, :struct, 's'), :<, position(decls, :typedef, 's_t')
+    assert decls.all? { |d| d[:cycle].zero? }
+  end
+
+  def test_records_in_a_cycle_share_a_number_after_forward_declarations
+    decls = sorted("struct a { struct b *b; };\nstruct b { struct a *a; };\nstruct c { struct c *next; };\n")
+
+    assert_equal [[:forward, 'a'], [:forward, 'b'], [:struct, 'a'], [:struct, 'b']],
+                 decls.first(4).map { |d| [d[:kind], d[:name]] }
+    assert_equal [1], decls.first(4).map { |d| d[:cycle] }.uniq
+    assert_equal 0, decls[position(decls, :struct, 'c')][:cycle]
+    assert_nil position(decls, :forward, 'c')
+  end
+
+  def test_tag_spelling_is_not_a_typedef_of_the_same_name
+    decls = sorted("typedef struct foo foo;\nstruct foo { struct foo *next; };\n")
+
+    assert decls.all? { |d| d[:cycle].zero? }
+    assert_nil position(decls, :forward, 'foo')
+  end
+
+  # Each record points to the next, so every one depends on all that
+  # follow it; sorted on a walk_files worker thread
+  def test_long_dependency_chain_is_sorted_without_deep_recursion
+    count = 100_000
+
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'chain.h')
+      File.write(path, (0...count).map { |i| "struct s#{i} { struct s#{i + 1} *next; };\n" }.join)
+
+      recorder = Recorder.new
+      FFIGen.inspect_files([path], [], [], recorder, threads: 1, topological: true)
+
+      assert_equal count, recorder.decls.size
+      assert_equal "s#{count - 1}", recorder.decls.first[:name]
+      assert_equal 's0', recorder.decls.last[:name]
+    end
+  end
+
+  def test_recorded_forward_declaration_is_not_repeated
+    decls = sorted("struct a;\nstruct a { struct b *b; };\nstruct b { struct a *a; };\n")
+
+    assert_equal 1, decls.count { |d| d[:kind] == :forward && d[:name] == 'a' }
+    assert_equal 1, decls.count { |d| d[:kind] == :forward && d[:name] == 'b' }
+    assert_operator position(decls, :forward, 'a'), :<, position(decls, :struct, 'a')
+    assert_equal decls[position(decls, :struct, 'a')][:cycle], decls[position(decls, :struct, 'b')][:cycle]
+  end
+end